@@ -0,0 +1,748 @@
+/******************************************************************************
+ * A load generator for telnetlogger: opens up to N sessions at once, and
+ * plays each one the way a Mirai-style scanner would. It answers the
+ * server's option negotiation, waits for the prompts, types credentials at
+ * some pace, and waits for "Login incorrect". As each session ends
+ * another starts, until the time or the session count runs out.
+ *
+ *	loadgen [-t threads] [-c concurrent] [-d seconds] [-n sessions]
+ *		[-f scenario] [-p server-pid] [host [port]]
+ *
+ * A scenario file mixes profiles, one per line, as a name, a weight, and
+ * options; see mirai.scenario. Without one, every session is a burst
+ * sender with one try.
+ *
+ * Each thread is an epoll loop with a timer wheel (the server's own), and
+ * session latencies go into the server's histograms, merged at the end.
+ ******************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "wheel.h"
+#include "histogram.h"
+
+/* How long a session can take before we count it as timed out, in ms */
+#define SESSION_TIMEOUT 120000
+
+#define MAX_PROFILES 32
+#define MAX_EVENTS 256
+
+/******************************************************************************
+ * How one kind of client behaves
+ ******************************************************************************/
+struct Profile {
+	char name[32];
+	unsigned weight;
+	unsigned pace;		/* ms between bytes typed, 0 for a line at once */
+	unsigned hold;		/* ms to sit idle after connecting */
+	unsigned tries;		/* logins per session */
+	int burst;		/* send it all at once, without waiting for prompts */
+	int quit;		/* close after the last password, without waiting */
+	unsigned long long sessions;
+};
+
+/* The usual suspects, from the Mirai source */
+static const char *credentials[][2] = {
+	{"root", "xc3511"}, {"root", "vizxv"}, {"root", "admin"}, {"admin", "admin"},
+	{"root", "888888"}, {"root", "xmhdipc"}, {"root", "default"}, {"root", "juantech"},
+	{"root", "123456"}, {"root", "54321"}, {"support", "support"}, {"root", ""},
+	{"admin", "password"}, {"root", "root"}, {"root", "12345"}, {"user", "user"},
+	{"admin", ""}, {"root", "pass"}, {"admin", "admin1234"}, {"root", "1111"},
+};
+#define CREDENTIAL_COUNT (sizeof(credentials) / sizeof(credentials[0]))
+
+enum {
+	C_IDLE,		/* no session */
+	C_CONNECTING,
+	C_HOLD,		/* connected, but sitting there */
+	C_WAIT_LOGIN,
+	C_TYPE_LOGIN,
+	C_WAIT_PASSWORD,
+	C_TYPE_PASSWORD,
+	C_WAIT_VERDICT,
+};
+
+/* Telnet's in-band commands */
+enum {
+	TN_SE = 240, TN_SB = 250, TN_WILL = 251, TN_WONT = 252,
+	TN_DO = 253, TN_DONT = 254, TN_IAC = 255,
+	TN_NAWS = 31,
+};
+
+struct Client {
+	struct Timer timer;
+	int fd;
+	int state;
+	const struct Profile *profile;
+	uint64_t started;	/* us */
+	uint64_t deadline;	/* ms */
+	unsigned tries;
+	unsigned credential;
+	char typing[520];	/* what's being typed, and how far we've got */
+	size_t typing_length;
+	size_t typed;
+	int telnet;		/* where we are in a command: 0, or the bytes seen */
+	unsigned char command;
+	char seen[64];		/* the most recent text from the server */
+	size_t seen_length;
+};
+
+struct Worker {
+	pthread_t handle;
+	int joined;	/* the main thread has seen it finish */
+	int epfd;
+	struct Wheel wheel;
+	uint64_t now;
+	unsigned seed;
+	struct Client *clients;
+	unsigned count;
+	unsigned long long sessions;
+	unsigned long long credentials;	/* in the sessions that finished */
+	unsigned long long connect_failed;
+	unsigned long long closed;	/* by the server, before we were done */
+	unsigned long long timeouts;
+	struct Histogram latency;
+	unsigned long long profile_sessions[MAX_PROFILES];
+};
+
+static struct {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	struct Profile profiles[MAX_PROFILES];
+	unsigned profile_count;
+	unsigned total_weight;
+	unsigned long long max_sessions;	/* 0 for no limit */
+	atomic_ullong started;
+	atomic_int stop;
+} config;
+
+static uint64_t clock_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void client_start(struct Worker *w, struct Client *c);
+
+static void client_timer(struct Worker *w, struct Client *c, uint64_t when) {
+	wheel_add(&w->wheel, &c->timer, when);
+}
+
+static void client_send(struct Client *c, const void *buf, size_t length) {
+	/* these are all tiny, and the socket buffer is empty, so a short send
+	 * means the connection's in trouble and the read will say so */
+	if (send(c->fd, buf, length, MSG_NOSIGNAL) < 0)
+		;
+}
+
+/******************************************************************************
+ * End the session, and start another in its place
+ ******************************************************************************/
+static void client_end(struct Worker *w, struct Client *c, int ok) {
+	if (ok) {
+		histogram_record(&w->latency, clock_us() - c->started);
+		w->sessions++;
+		w->credentials += c->tries;
+		w->profile_sessions[c->profile - config.profiles]++;
+	}
+	wheel_cancel(&w->wheel, &c->timer);
+	close(c->fd);
+	c->fd = -1;
+	c->state = C_IDLE;
+	client_start(w, c);
+}
+
+/******************************************************************************
+ * Type the next bit of what we're typing: all of it, or a byte at a time
+ ******************************************************************************/
+static void client_type(struct Worker *w, struct Client *c) {
+	size_t n = c->profile->pace ? 1 : c->typing_length - c->typed;
+
+	client_send(c, c->typing + c->typed, n);
+	c->typed += n;
+	if (c->typed < c->typing_length) {
+		client_timer(w, c, w->now + c->profile->pace);
+		return;
+	}
+
+	client_timer(w, c, c->deadline);
+	if (c->state == C_TYPE_LOGIN) {
+		c->state = C_WAIT_PASSWORD;
+		return;
+	}
+	c->tries++;
+	if (c->profile->quit && c->tries >= c->profile->tries) {
+		client_end(w, c, 1);
+		return;
+	}
+	c->state = C_WAIT_VERDICT;
+}
+
+static void client_begin_typing(struct Worker *w, struct Client *c, int state) {
+	const char *text = credentials[c->credential][state == C_TYPE_PASSWORD];
+	size_t length = strlen(text);
+
+	memcpy(c->typing, text, length);
+	memcpy(c->typing + length, "\r\n", 2);
+	c->typing_length = length + 2;
+	c->typed = 0;
+	c->state = state;
+	c->seen_length = 0;
+	client_type(w, c);
+}
+
+/******************************************************************************
+ * Connected: either sit there, fire everything off at once, or wait for
+ * the prompt
+ ******************************************************************************/
+static void client_connected(struct Worker *w, struct Client *c) {
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = c;
+	epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+
+	if (c->profile->burst) {
+		size_t d = 0;
+		unsigned i;
+
+		for (i = 0; i < c->profile->tries; i++) {
+			const char **cred = credentials[(c->credential + i) % CREDENTIAL_COUNT];
+			d += snprintf(c->typing + d, sizeof(c->typing) - d, "%s\r\n%s\r\n", cred[0], cred[1]);
+		}
+		client_send(c, c->typing, d);
+		c->tries = c->profile->tries;
+		if (c->profile->quit) {
+			client_end(w, c, 1);
+			return;
+		}
+		c->state = C_WAIT_VERDICT;
+		client_timer(w, c, c->deadline);
+		return;
+	}
+	c->state = C_WAIT_LOGIN;
+	client_timer(w, c, c->deadline);
+}
+
+/******************************************************************************
+ * Answer the server's options the way Mirai does: agree to whatever it
+ * will do, offer the window size, and refuse everything else
+ ******************************************************************************/
+static void client_option(struct Client *c, unsigned char command, unsigned char option) {
+	unsigned char reply[16];
+	size_t d = 0;
+
+	reply[d++] = TN_IAC;
+	if (command == TN_DO && option == TN_NAWS) {
+		static const unsigned char naws[] = {TN_IAC, TN_SB, TN_NAWS, 0, 80, 0, 24, TN_IAC, TN_SE};
+		reply[d++] = TN_WILL;
+		reply[d++] = option;
+		memcpy(reply + d, naws, sizeof(naws));
+		d += sizeof(naws);
+	} else if (command == TN_DO) {
+		reply[d++] = TN_WONT;
+		reply[d++] = option;
+	} else if (command == TN_WILL) {
+		reply[d++] = TN_DO;
+		reply[d++] = option;
+	} else
+		return;
+	client_send(c, reply, d);
+}
+
+/******************************************************************************
+ * Run what the server sent through a small telnet parser, keeping the
+ * last few bytes of text to look for prompts in
+ ******************************************************************************/
+static void client_parse(struct Client *c, const unsigned char *px, size_t length) {
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		unsigned char b = px[i];
+
+		switch (c->telnet) {
+		case 0:
+			if (b == TN_IAC) {
+				c->telnet = 1;
+				continue;
+			}
+			if (c->seen_length == sizeof(c->seen) - 1) {
+				memmove(c->seen, c->seen + 32, c->seen_length - 32);
+				c->seen_length -= 32;
+			}
+			c->seen[c->seen_length++] = b ? b : ' ';
+			c->seen[c->seen_length] = '\0';
+			continue;
+		case 1:
+			if (b == TN_SB)
+				c->telnet = 3;
+			else if (b >= TN_WILL && b <= TN_DONT) {
+				c->command = b;
+				c->telnet = 2;
+			} else
+				c->telnet = 0;
+			continue;
+		case 2:
+			client_option(c, c->command, b);
+			c->telnet = 0;
+			continue;
+		case 3:	/* skipping a subnegotiation */
+			if (b == TN_IAC)
+				c->telnet = 4;
+			continue;
+		case 4:
+			c->telnet = (b == TN_SE) ? 0 : 3;
+			continue;
+		}
+	}
+}
+
+static int client_saw(struct Client *c, const char *text) {
+	return c->seen_length && strstr(c->seen, text) != NULL;
+}
+
+static void client_readable(struct Worker *w, struct Client *c) {
+	unsigned char buf[4096];
+
+	for (;;) {
+		ssize_t len = recv(c->fd, buf, sizeof(buf), 0);
+
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (len <= 0) {
+			/* the server hangs up after the last "Login incorrect" */
+			int done = (c->state == C_WAIT_VERDICT && c->tries >= c->profile->tries);
+			if (!done)
+				w->closed++;
+			client_end(w, c, done);
+			return;
+		}
+		client_parse(c, buf, len);
+	}
+
+	switch (c->state) {
+	case C_WAIT_LOGIN:
+		if (client_saw(c, "login: "))
+			client_begin_typing(w, c, C_TYPE_LOGIN);
+		break;
+	case C_WAIT_PASSWORD:
+		if (client_saw(c, "assword: "))
+			client_begin_typing(w, c, C_TYPE_PASSWORD);
+		break;
+	case C_WAIT_VERDICT:
+		if (!client_saw(c, "incorrect"))
+			break;
+		if (c->tries >= c->profile->tries) {
+			client_end(w, c, 1);
+			break;
+		}
+		/* the retry prompt comes with the verdict */
+		c->credential = (c->credential + 1) % CREDENTIAL_COUNT;
+		if (client_saw(c, "login: "))
+			client_begin_typing(w, c, C_TYPE_LOGIN);
+		else
+			c->state = C_WAIT_LOGIN;
+		break;
+	}
+}
+
+static void client_writable(struct Worker *w, struct Client *c) {
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+		w->connect_failed++;
+		client_end(w, c, 0);
+		return;
+	}
+	if (c->profile->hold) {
+		struct epoll_event ev;
+
+		ev.events = EPOLLRDHUP;
+		ev.data.ptr = c;
+		epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+		c->state = C_HOLD;
+		client_timer(w, c, w->now + c->profile->hold);
+		return;
+	}
+	client_connected(w, c);
+}
+
+static void client_expire(struct Timer *timer, void *arg) {
+	struct Worker *w = (struct Worker *)arg;
+	struct Client *c = container_of(timer, struct Client, timer);
+
+	switch (c->state) {
+	case C_HOLD:
+		client_connected(w, c);
+		break;
+	case C_TYPE_LOGIN:
+	case C_TYPE_PASSWORD:
+		client_type(w, c);
+		break;
+	case C_IDLE:
+		client_start(w, c);
+		break;
+	default:
+		w->timeouts++;
+		client_end(w, c, 0);
+		break;
+	}
+}
+
+static const struct Profile *pick_profile(struct Worker *w) {
+	unsigned n = rand_r(&w->seed) % config.total_weight;
+	unsigned i;
+
+	for (i = 0; i < config.profile_count - 1; i++) {
+		if (n < config.profiles[i].weight)
+			break;
+		n -= config.profiles[i].weight;
+	}
+	return &config.profiles[i];
+}
+
+/******************************************************************************
+ * Start a new session in this slot, unless we're done. If we can't even
+ * get a socket, try again in a bit.
+ ******************************************************************************/
+static void client_start(struct Worker *w, struct Client *c) {
+	struct epoll_event ev;
+
+	if (atomic_load(&config.stop))
+		return;
+	if (config.max_sessions
+		&& atomic_fetch_add(&config.started, 1) >= config.max_sessions)
+		return;
+
+	memset((char *)c + sizeof(c->timer), 0, sizeof(*c) - sizeof(c->timer));
+	c->timer.handler = client_expire;
+	c->profile = pick_profile(w);
+	c->credential = rand_r(&w->seed) % CREDENTIAL_COUNT;
+	c->started = clock_us();
+	c->deadline = w->now + SESSION_TIMEOUT;
+
+	c->fd = socket(config.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (c->fd < 0) {
+		c->state = C_IDLE;
+		client_timer(w, c, w->now + 100);
+		return;
+	}
+	if (connect(c->fd, (struct sockaddr *)&config.addr, config.addrlen) < 0 && errno != EINPROGRESS) {
+		w->connect_failed++;
+		close(c->fd);
+		c->fd = -1;
+		c->state = C_IDLE;
+		client_timer(w, c, w->now + 100);
+		return;
+	}
+	c->state = C_CONNECTING;
+	ev.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = c;
+	epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+	client_timer(w, c, c->deadline);
+}
+
+static void *worker_thread(void *v_worker) {
+	struct Worker *w = (struct Worker *)v_worker;
+	struct epoll_event events[MAX_EVENTS];
+	unsigned i;
+
+	w->now = clock_us() / 1000;
+	wheel_init(&w->wheel, w->now);
+	for (i = 0; i < w->count; i++) {
+		w->clients[i].fd = -1;
+		client_start(w, &w->clients[i]);
+	}
+
+	while (!atomic_load(&config.stop)) {
+		uint64_t next = wheel_next(&w->wheel);
+		int timeout = 100;
+		int count;
+		int j;
+
+		if (next != UINT64_MAX && next < w->now + 100)
+			timeout = next > w->now ? (int)(next - w->now) : 0;
+		count = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+		w->now = clock_us() / 1000;
+		for (j = 0; j < count; j++) {
+			struct Client *c = events[j].data.ptr;
+
+			if (c->state == C_IDLE)
+				continue;
+			if (c->state == C_CONNECTING)
+				client_writable(w, c);
+			else if (c->state == C_HOLD)
+				client_readable(w, c);
+			else if (events[j].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+				client_readable(w, c);
+		}
+		wheel_advance(&w->wheel, w->now, w);
+
+		/* with a session limit, we're done when every slot is empty */
+		if (config.max_sessions && atomic_load(&config.started) >= config.max_sessions) {
+			for (i = 0; i < w->count; i++) {
+				if (w->clients[i].state != C_IDLE)
+					break;
+			}
+			if (i == w->count)
+				break;
+		}
+	}
+	for (i = 0; i < w->count; i++) {
+		if (w->clients[i].fd >= 0)
+			close(w->clients[i].fd);
+	}
+	return NULL;
+}
+
+/******************************************************************************
+ * A scenario line is a name, a weight, and options:
+ *	pace=MS		between bytes typed (0, a line at once)
+ *	hold=MS		idle after connecting, before anything else (0)
+ *	tries=N		logins per session, up to 16 (1)
+ *	burst		everything at once, without waiting for prompts
+ *	quit		hang up straight after the last password, which is
+ *			quick but doesn't check the server saw it
+ ******************************************************************************/
+static int load_scenario(const char *filename) {
+	FILE *fp = fopen(filename, "r");
+	char line[512];
+	unsigned lineno = 0;
+
+	if (fp == NULL) {
+		fprintf(stderr, "loadgen: %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		struct Profile *p = &config.profiles[config.profile_count];
+		char *tok;
+		char *save;
+
+		lineno++;
+		if (strchr(line, '#'))
+			*strchr(line, '#') = '\0';
+		tok = strtok_r(line, " \t\r\n", &save);
+		if (tok == NULL)
+			continue;
+		if (config.profile_count == MAX_PROFILES) {
+			fprintf(stderr, "loadgen: %s:%u: too many profiles\n", filename, lineno);
+			goto fail;
+		}
+		memset(p, 0, sizeof(*p));
+		snprintf(p->name, sizeof(p->name), "%s", tok);
+		p->tries = 1;
+		tok = strtok_r(NULL, " \t\r\n", &save);
+		if (tok == NULL || (p->weight = strtoul(tok, 0, 0)) == 0) {
+			fprintf(stderr, "loadgen: %s:%u: expected a weight\n", filename, lineno);
+			goto fail;
+		}
+		while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+			if (strncmp(tok, "pace=", 5) == 0)
+				p->pace = strtoul(tok + 5, 0, 0);
+			else if (strncmp(tok, "hold=", 5) == 0)
+				p->hold = strtoul(tok + 5, 0, 0);
+			else if (strncmp(tok, "tries=", 6) == 0 && strtoul(tok + 6, 0, 0) >= 1
+				&& strtoul(tok + 6, 0, 0) <= 16)
+				p->tries = strtoul(tok + 6, 0, 0);
+			else if (strcmp(tok, "burst") == 0)
+				p->burst = 1;
+			else if (strcmp(tok, "quit") == 0)
+				p->quit = 1;
+			else {
+				fprintf(stderr, "loadgen: %s:%u: unknown option %s\n", filename, lineno, tok);
+				goto fail;
+			}
+		}
+		config.total_weight += p->weight;
+		config.profile_count++;
+	}
+	fclose(fp);
+	if (config.profile_count == 0) {
+		fprintf(stderr, "loadgen: %s: no profiles\n", filename);
+		return -1;
+	}
+	return 0;
+fail:
+	fclose(fp);
+	return -1;
+}
+
+/* The server's resident size, and its peak, in kB, from /proc */
+static void server_rss(int pid, unsigned long *rss, unsigned long *peak) {
+	char filename[64];
+	char line[256];
+	FILE *fp;
+
+	*rss = *peak = 0;
+	snprintf(filename, sizeof(filename), "/proc/%d/status", pid);
+	fp = fopen(filename, "r");
+	if (fp == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "VmRSS:", 6) == 0)
+			*rss = strtoul(line + 6, 0, 10);
+		else if (strncmp(line, "VmHWM:", 6) == 0)
+			*peak = strtoul(line + 6, 0, 10);
+	}
+	fclose(fp);
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage:\n loadgen [-t threads] [-c concurrent] [-d seconds] [-n sessions]\n"
+		"\t[-f scenario] [-p server-pid] [host [port]]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	unsigned threads = 4;
+	unsigned concurrent = 100;
+	unsigned duration = 10;
+	const char *scenario = NULL;
+	const char *host = "127.0.0.1";
+	const char *port = "23";
+	int pid = 0;
+	struct addrinfo hints, *ai;
+	struct Worker *workers;
+	struct Client *clients;
+	unsigned long long counts[HIST_BUCKETS + 1];
+	unsigned long long sessions = 0, creds = 0, failed = 0, closed = 0, timeouts = 0;
+	uint64_t start, elapsed;
+	double secs;
+	int opt;
+	int err;
+	unsigned i, j;
+
+	while ((opt = getopt(argc, argv, "t:c:d:n:f:p:h")) != -1) {
+		switch (opt) {
+		case 't': threads = strtoul(optarg, 0, 0); break;
+		case 'c': concurrent = strtoul(optarg, 0, 0); break;
+		case 'd': duration = strtoul(optarg, 0, 0); break;
+		case 'n': config.max_sessions = strtoull(optarg, 0, 0); break;
+		case 'f': scenario = optarg; break;
+		case 'p': pid = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if (optind < argc)
+		host = argv[optind++];
+	if (optind < argc)
+		port = argv[optind++];
+	if (optind < argc || threads < 1 || concurrent < 1)
+		usage();
+	if (threads > concurrent)
+		threads = concurrent;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	err = getaddrinfo(host, port, &hints, &ai);
+	if (err) {
+		fprintf(stderr, "loadgen: %s: %s\n", host, gai_strerror(err));
+		return 1;
+	}
+	memcpy(&config.addr, ai->ai_addr, ai->ai_addrlen);
+	config.addrlen = ai->ai_addrlen;
+	freeaddrinfo(ai);
+
+	if (scenario) {
+		if (load_scenario(scenario) < 0)
+			return 1;
+	} else {
+		struct Profile *p = &config.profiles[0];
+		snprintf(p->name, sizeof(p->name), "burst");
+		p->weight = 1;
+		p->tries = 1;
+		p->burst = 1;
+		config.profile_count = 1;
+		config.total_weight = 1;
+	}
+
+	workers = calloc(threads, sizeof(workers[0]));
+	clients = calloc(concurrent, sizeof(clients[0]));
+	if (workers == NULL || clients == NULL) {
+		fprintf(stderr, "loadgen: out of memory\n");
+		return 1;
+	}
+	start = clock_us();
+	for (i = 0, j = 0; i < threads; i++) {
+		struct Worker *w = &workers[i];
+
+		w->count = concurrent / threads + (i < concurrent % threads);
+		w->clients = clients + j;
+		j += w->count;
+		w->seed = (unsigned)start ^ (i * 2654435761u);
+		w->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (w->epfd < 0 || pthread_create(&w->handle, 0, worker_thread, w) != 0) {
+			fprintf(stderr, "loadgen: could not start thread: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+
+	/* run until the time's up, or every worker has run out of sessions */
+	for (;;) {
+		usleep(10000);
+		if (clock_us() - start >= (uint64_t)duration * 1000000)
+			break;
+		for (i = 0; i < threads; i++) {
+			if (!workers[i].joined && pthread_tryjoin_np(workers[i].handle, NULL) != 0)
+				break;
+			workers[i].joined = 1;
+		}
+		if (i == threads)
+			break;
+	}
+	atomic_store(&config.stop, 1);
+	elapsed = clock_us() - start;
+	for (i = 0; i < threads; i++) {
+		if (!workers[i].joined)
+			pthread_join(workers[i].handle, NULL);
+	}
+
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < threads; i++) {
+		struct Worker *w = &workers[i];
+
+		histogram_merge(counts, &w->latency);
+		sessions += w->sessions;
+		creds += w->credentials;
+		failed += w->connect_failed;
+		closed += w->closed;
+		timeouts += w->timeouts;
+		for (j = 0; j < config.profile_count; j++)
+			config.profiles[j].sessions += w->profile_sessions[j];
+	}
+	secs = elapsed / 1e6;
+
+	printf("loadgen: %u threads, %u concurrent, %.1f s\n", threads, concurrent, secs);
+	printf("sessions      %llu (%.1f/s)\n", sessions, sessions / secs);
+	printf("credentials   %llu (%.1f/s)\n", creds, creds / secs);
+	printf("latency       p50 %.2f ms, p99 %.2f ms, p99.9 %.2f ms\n",
+		histogram_quantile(counts, 0.5) / 1e3,
+		histogram_quantile(counts, 0.99) / 1e3,
+		histogram_quantile(counts, 0.999) / 1e3);
+	printf("failed        %llu connect, %llu closed early, %llu timed out\n", failed, closed, timeouts);
+	if (config.profile_count > 1) {
+		for (j = 0; j < config.profile_count; j++)
+			printf("  %-12s%llu\n", config.profiles[j].name, config.profiles[j].sessions);
+	}
+	if (pid) {
+		unsigned long rss, peak;
+		server_rss(pid, &rss, &peak);
+		printf("server rss    %lu kB (peak %lu kB)\n", rss, peak);
+	}
+	return 0;
+}
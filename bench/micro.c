@@ -0,0 +1,309 @@
+/******************************************************************************
+ * Microbenchmarks for the byte-level paths: the NVT parser, escaping, and
+ * record formatting. Each runs over a corpus modelled on what bots send
+ * for long enough to time, and reports the time per byte (and per record),
+ * and how many heap allocations each record took, which should be none.
+ *
+ *	micro [-s seconds-per-test] [test ...]
+ *
+ * Allocations are counted by interposing malloc() and friends onto glibc's
+ * own, so this is glibc-only, like the rest.
+ ******************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nvt.h"
+#include "format.h"
+#include "record.h"
+
+/******************************************************************************
+ * Allocation counting
+ ******************************************************************************/
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long long allocations;
+
+void *malloc(size_t size) {
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+	allocations++;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+/******************************************************************************
+ * Corpora. Each is one bot's side of a session, repeated to fill a buffer.
+ ******************************************************************************/
+#define IAC "\xff"
+#define CORPUS_SIZE 65536
+
+struct Corpus {
+	const char *name;
+	const char *sample;
+	size_t length;
+};
+
+#define SAMPLE(name, text) {name, text, sizeof(text) - 1}
+
+static const struct Corpus corpora[] = {
+	/* a scanner that ignores the negotiation and just types */
+	SAMPLE("plain",
+		"root\r\nxc3511\r\nadmin\r\nadmin\r\nroot\r\nvizxv\r\nsupport\r\nsupport\r\n"),
+	/* Mirai-style: answers every option before and between the lines */
+	SAMPLE("iac",
+		IAC "\xfd\x03" IAC "\xfd\x01" IAC "\xfb\x1f" IAC "\xfc\x18"
+		"root\r\n" IAC "\xfe\x01" IAC "\xfc\x03" "xc3511\r\n"
+		IAC "\xfd\x03" IAC "\xfd\x01" "admin\r\n" IAC "\xfc\x18" "admin\r\n"),
+	/* a real telnet client: window size and terminal type, and a NUL
+	 * after each return */
+	SAMPLE("subneg",
+		IAC "\xfb\x1f" IAC "\xfa\x1f\x00\x50\x00\x18" IAC "\xf0"
+		IAC "\xfb\x18" IAC "\xfa\x18\x00" "XTERM-256COLOR" IAC "\xf0"
+		IAC "\xfa\x1f\x00\x84\x00\x32" IAC "\xf0"
+		"root\r\0" "123456\r\0"
+		IAC "\xfa\x18\x00" "VT100" IAC "\xf0" "admin\r\0" "password\r\0"),
+};
+#define CORPUS_COUNT (sizeof(corpora) / sizeof(corpora[0]))
+
+static size_t fill(unsigned char *buf, size_t size, const char *sample, size_t length) {
+	size_t d = 0;
+
+	while (d + length <= size) {
+		memcpy(buf + d, sample, length);
+		d += length;
+	}
+	return d;
+}
+
+static double clock_s(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Keeps the compiler from optimising the work away */
+static volatile size_t sink;
+
+static double run_seconds = 0.5;
+
+struct Result {
+	double seconds;
+	unsigned long long bytes;
+	unsigned long long records;
+	unsigned long long allocations;
+};
+
+static void report(const char *test, const char *corpus, const struct Result *r) {
+	printf("%-10s %-8s %8.3f ns/byte %9.1f MB/s %8.1f ns/record %6.2f allocs/record\n",
+		test, corpus,
+		r->seconds * 1e9 / r->bytes,
+		r->bytes / r->seconds / 1e6,
+		r->records ? r->seconds * 1e9 / r->records : 0.0,
+		r->records ? (double)r->allocations / r->records : 0.0);
+}
+
+/******************************************************************************
+ * The parser, driven the way the event loop drives it: into the line
+ * buffer until it says the line's done, with the echo going into a small
+ * buffer that's thrown away each time round.
+ ******************************************************************************/
+static unsigned long long parse_buffer(const unsigned char *px, size_t length) {
+	unsigned char out[256];
+	char line[256];
+	unsigned long long lines = 0;
+	size_t offset = 0;
+	int state = 0;
+	int line_length = 0;
+
+	while (offset < length) {
+		struct NvtEcho echo = {out, 0, sizeof(out)};
+		int done = 0;
+
+		offset += nvt_parse(&state, line, sizeof(line), &line_length,
+			px + offset, length - offset, &echo, &done, NULL);
+		sink += echo.length;
+		if (done) {
+			sink += line_length;
+			line_length = 0;
+			lines++;
+		}
+	}
+	return lines;
+}
+
+static void bench_nvt(void) {
+	static unsigned char buf[CORPUS_SIZE];
+	unsigned i;
+
+	for (i = 0; i < CORPUS_COUNT; i++) {
+		size_t length = fill(buf, sizeof(buf), corpora[i].sample, corpora[i].length);
+		struct Result r = {0};
+		unsigned long long before;
+		double start;
+
+		parse_buffer(buf, length);	/* warm up */
+		before = allocations;
+		start = clock_s();
+		do {
+			r.records += parse_buffer(buf, length);
+			r.bytes += length;
+			r.seconds = clock_s() - start;
+		} while (r.seconds < run_seconds);
+		r.allocations = allocations - before;
+		report("nvt", corpora[i].name, &r);
+	}
+}
+
+/******************************************************************************
+ * Escaping: ordinary credentials, and the binary junk some bots send
+ ******************************************************************************/
+static void bench_escape(void) {
+	static const char *plain[] = {
+		"root", "xc3511", "admin", "vizxv", "support", "888888", "Administrator",
+		"default", "juantech", "user", "password", "7ujMko0admin", "Zte521",
+	};
+	char binary[64][32];
+	char dst[ESCAPED_MAX(32)];
+	unsigned i, j;
+
+	for (i = 0; i < 64; i++) {
+		for (j = 0; j < sizeof(binary[i]); j++)
+			binary[i][j] = (char)(i * 31 + j * 7);
+	}
+
+	for (i = 0; i < 2; i++) {
+		struct Result r = {0};
+		unsigned long long before = allocations;
+		double start = clock_s();
+
+		do {
+			for (j = 0; j < 64; j++) {
+				const char *str = i ? binary[j] : plain[j % 13];
+				size_t len = i ? sizeof(binary[j]) : strlen(plain[j % 13]);
+
+				sink += print_string(dst, str, len);
+				r.bytes += len;
+				r.records++;
+			}
+			r.seconds = clock_s() - start;
+		} while (r.seconds < run_seconds);
+		r.allocations = allocations - before;
+		report("escape", i ? "binary" : "plain", &r);
+	}
+}
+
+/******************************************************************************
+ * Formatting records the way the log writer does, per output format. The
+ * time moves on a millisecond a record, so the timestamp cache sees a new
+ * second every thousand.
+ ******************************************************************************/
+static void bench_record(void) {
+	static const char *names[] = {"csv", "csv-time", "binary"};
+	static char buf[RECORD_MAX * 64];
+	struct LogRecord recs[16];
+	unsigned i, j;
+
+	memset(recs, 0, sizeof(recs));
+	for (i = 0; i < 16; i++) {
+		struct LogRecord *rec = &recs[i];
+		static const unsigned char v4[12] = {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+
+		rec->type = LOG_CSV;
+		memcpy(rec->addr, v4, sizeof(v4));
+		rec->addr[12] = 192;
+		rec->addr[13] = 0;
+		rec->addr[14] = 2;
+		rec->addr[15] = (unsigned char)(i * 13);
+		rec->port = 40000 + i;
+		rec->session = i;
+		rec->login_length = snprintf(rec->login, sizeof(rec->login), "%s", i & 1 ? "admin" : "root");
+		rec->password_length = snprintf(rec->password, sizeof(rec->password), "%s%u",
+			i & 2 ? "xc35" : "pass\x01", i);
+	}
+
+	for (i = 0; i < 3; i++) {
+		struct RecordClock clock;
+		struct Result r = {0};
+		unsigned long long before;
+		uint64_t time = 1790000000000ULL;
+		double start;
+
+		record_clock_init(&clock);
+		before = allocations;
+		start = clock_s();
+		do {
+			size_t d = 0;
+
+			for (j = 0; j < 64; j++) {
+				struct LogRecord *rec = &recs[j % 16];
+
+				rec->time = time++;
+				if (i == 2)
+					d += record_format_binary((unsigned char *)buf + d, rec);
+				else
+					d += record_format_text(buf + d, rec, i ? &clock : NULL);
+			}
+			sink += d;
+			r.bytes += d;
+			r.records += 64;
+			r.seconds = clock_s() - start;
+		} while (r.seconds < run_seconds);
+		r.allocations = allocations - before;
+		report("record", names[i], &r);
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} tests[] = {
+	{"nvt", bench_nvt},
+	{"escape", bench_escape},
+	{"record", bench_record},
+};
+#define TEST_COUNT (sizeof(tests) / sizeof(tests[0]))
+
+int main(int argc, char *argv[]) {
+	int selected = 0;
+	int i;
+	unsigned t;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			run_seconds = atof(argv[++i]);
+			continue;
+		}
+		for (t = 0; t < TEST_COUNT; t++) {
+			if (strcmp(argv[i], tests[t].name) == 0)
+				break;
+		}
+		if (t == TEST_COUNT) {
+			fprintf(stderr, "usage:\n micro [-s seconds] [nvt] [escape] [record]\n");
+			return 1;
+		}
+		selected |= 1 << t;
+	}
+	if (selected == 0)
+		selected = (1 << TEST_COUNT) - 1;
+
+	/* the output is timed in ns/byte of input, except for records,
+	 * which are per byte of output */
+	for (t = 0; t < TEST_COUNT; t++) {
+		if (selected & (1 << t))
+			tests[t].run();
+	}
+	return 0;
+}
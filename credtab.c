@@ -0,0 +1,186 @@
+/******************************************************************************
+ * Credential counting table. See credtab.h.
+ ******************************************************************************/
+#include "credtab.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Don't let probe chains get long: refuse new keys past this load */
+#define CRED_LOAD(size) ((size) / 4 * 3)
+
+/******************************************************************************
+ * FNV-1a over the key. Pairs are short and this is off the hot path for
+ * anything but brand new ones, so nothing cleverer is needed.
+ ******************************************************************************/
+static uint64_t cred_hash(const char *login, size_t login_length,
+	const char *password, size_t password_length, const unsigned char *addr) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < login_length; i++)
+		h = (h ^ (unsigned char)login[i]) * 0x100000001b3ULL;
+	h = (h ^ 0x100) * 0x100000001b3ULL; /* can't be a byte of either */
+	for (i = 0; i < password_length; i++)
+		h = (h ^ (unsigned char)password[i]) * 0x100000001b3ULL;
+	if (addr) {
+		for (i = 0; i < 16; i++)
+			h = (h ^ addr[i]) * 0x100000001b3ULL;
+	}
+	return h ? h : 1;
+}
+
+int credtab_init(struct CredTable *table, size_t size, int by_addr) {
+	size_t n = 16;
+
+	while (n < size)
+		n *= 2;
+	memset(table, 0, sizeof(*table));
+	table->entries = calloc(n, sizeof(table->entries[0]));
+	if (table->entries == NULL)
+		return -1;
+	table->mask = n - 1;
+	table->by_addr = by_addr;
+	return 0;
+}
+
+/******************************************************************************
+ * Find the slot for a key: either the entry that has it, or the empty slot
+ * where it would go
+ ******************************************************************************/
+static struct CredEntry *cred_find(const struct CredTable *table, uint64_t hash,
+	const char *login, size_t login_length,
+	const char *password, size_t password_length, const unsigned char *addr) {
+	size_t i = hash & table->mask;
+
+	for (;;) {
+		struct CredEntry *e = &table->entries[i];
+
+		if (e->hash == 0)
+			return e;
+		if (e->hash == hash
+			&& e->login_length == login_length
+			&& e->password_length == password_length
+			&& memcmp(e->key, login, login_length) == 0
+			&& memcmp(e->key + login_length, password, password_length) == 0
+			&& (addr == NULL || memcmp(e->addr, addr, 16) == 0))
+			return e;
+		i = (i + 1) & table->mask;
+	}
+}
+
+static struct CredEntry *cred_insert(struct CredTable *table, struct CredEntry *e, uint64_t hash,
+	const char *login, size_t login_length,
+	const char *password, size_t password_length, const unsigned char *addr) {
+	if (table->count >= CRED_LOAD(table->mask + 1))
+		return NULL;
+	e->key = malloc(login_length + password_length + 1);
+	if (e->key == NULL)
+		return NULL;
+	memcpy(e->key, login, login_length);
+	memcpy(e->key + login_length, password, password_length);
+	e->hash = hash;
+	e->login_length = (unsigned char)login_length;
+	e->password_length = (unsigned char)password_length;
+	if (addr)
+		memcpy(e->addr, addr, 16);
+	table->count++;
+	return e;
+}
+
+struct CredEntry *credtab_add(struct CredTable *table, const char *login, size_t login_length,
+	const char *password, size_t password_length, const unsigned char addr[16], uint64_t time) {
+	const unsigned char *a = table->by_addr ? addr : NULL;
+	uint64_t hash;
+	struct CredEntry *e;
+
+	if (login_length > 255)
+		login_length = 255;
+	if (password_length > 255)
+		password_length = 255;
+
+	hash = cred_hash(login, login_length, password, password_length, a);
+	e = cred_find(table, hash, login, login_length, password, password_length, a);
+	if (e->hash == 0) {
+		e = cred_insert(table, e, hash, login, login_length, password, password_length, a);
+		if (e == NULL)
+			return NULL;
+	}
+	if (e->count == 0)
+		e->first = time;
+	e->count++;
+	e->last = time;
+	return e;
+}
+
+int credtab_flag(struct CredTable *table, const char *login, const char *password, unsigned flags) {
+	size_t login_length = strlen(login);
+	size_t password_length = strlen(password);
+	uint64_t hash = cred_hash(login, login_length, password, password_length, NULL);
+	struct CredEntry *e;
+
+	e = cred_find(table, hash, login, login_length, password, password_length, NULL);
+	if (e->hash == 0) {
+		e = cred_insert(table, e, hash, login, login_length, password, password_length, NULL);
+		if (e == NULL)
+			return -1;
+	}
+	e->flags |= flags;
+	return 0;
+}
+
+unsigned credtab_flags(const struct CredTable *table, const char *login, size_t login_length,
+	const char *password, size_t password_length) {
+	uint64_t hash;
+	struct CredEntry *e;
+
+	if (login_length > 255 || password_length > 255)
+		return 0;
+	hash = cred_hash(login, login_length, password, password_length, NULL);
+	e = cred_find(table, hash, login, login_length, password, password_length, NULL);
+	return e->hash ? e->flags : 0;
+}
+
+/******************************************************************************
+ * Emit the counts, then rebuild the table without the idle entries. Counts
+ * are only ever reset here, so an entry that has none now has seen nothing
+ * for a whole interval. Open addressing can't just empty a slot, so the
+ * survivors are rehashed into a fresh array.
+ ******************************************************************************/
+void credtab_flush(struct CredTable *table,
+	int (*emit)(const struct CredEntry *entry, void *arg), void *arg) {
+	struct CredEntry *old = table->entries;
+	struct CredEntry *fresh;
+	size_t size = table->mask + 1;
+	size_t i;
+
+	fresh = calloc(size, sizeof(fresh[0]));
+	if (fresh == NULL) {
+		/* out of memory: just emit, and evict next time */
+		for (i = 0; i < size; i++) {
+			if (old[i].count && emit(&old[i], arg) == 0)
+				old[i].count = 0;
+		}
+		return;
+	}
+
+	table->count = 0;
+	for (i = 0; i < size; i++) {
+		struct CredEntry *e = &old[i];
+		size_t j;
+
+		if (e->hash == 0)
+			continue;
+		if (e->count == 0 && e->flags == 0) {
+			free(e->key);
+			continue;
+		}
+		if (e->count && emit(e, arg) == 0)
+			e->count = 0;
+		for (j = e->hash & table->mask; fresh[j].hash; j = (j + 1) & table->mask)
+			;
+		fresh[j] = *e;
+		table->count++;
+	}
+	table->entries = fresh;
+	free(old);
+}
@@ -0,0 +1,65 @@
+#ifndef CREDTAB_H
+#define CREDTAB_H
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************************************************************
+ * A table of login/password pairs, optionally per source address, with how
+ * often and when each was seen. Each event loop has one of its own, so there
+ * is no locking. It's open addressing with linear probing over a power-of-
+ * two array; the key bytes live in a separate allocation per entry, which
+ * happens only the first time a pair is seen.
+ *
+ * Entries can also carry flags, such as the pairs print_passwords() is to
+ * leave out, or the ones that get into the shell. Those are never evicted.
+ ******************************************************************************/
+enum {
+	CRED_SUPPRESS = 1,	/* not worth printing */
+	CRED_ACCEPT = 2,	/* let in, to the fake shell (-a) */
+};
+
+struct CredEntry {
+	uint64_t hash;		/* 0 for an empty slot */
+	uint64_t first;		/* ms since the epoch, since the last flush */
+	uint64_t last;
+	unsigned count;
+	unsigned char flags;
+	unsigned char login_length;
+	unsigned char password_length;
+	unsigned char addr[16];	/* all zero unless keyed by address */
+	char *key;		/* login then password */
+};
+
+struct CredTable {
+	struct CredEntry *entries;
+	size_t mask;
+	size_t count;		/* slots in use */
+	int by_addr;		/* include the address in the key */
+};
+
+int credtab_init(struct CredTable *table, size_t size, int by_addr);
+
+/******************************************************************************
+ * Count one sighting. Returns the entry, or NULL if the table is too full to
+ * take a new pair, in which case the caller should log it the usual way.
+ ******************************************************************************/
+struct CredEntry *credtab_add(struct CredTable *table, const char *login, size_t login_length,
+	const char *password, size_t password_length, const unsigned char addr[16], uint64_t time);
+
+/* Add a pair with the given flags, and no count */
+int credtab_flag(struct CredTable *table, const char *login, const char *password, unsigned flags);
+
+/* Returns the flags for a pair (never keyed by address), or 0 if it isn't there */
+unsigned credtab_flags(const struct CredTable *table, const char *login, size_t login_length,
+	const char *password, size_t password_length);
+
+/******************************************************************************
+ * Go through every entry with a count, calling 'emit' for it. If 'emit'
+ * returns 0 the count is reset, otherwise it's kept for next time (because
+ * the log is full, say). Entries that have seen nothing since the last
+ * flush are evicted, so the table only holds what's active.
+ ******************************************************************************/
+void credtab_flush(struct CredTable *table,
+	int (*emit)(const struct CredEntry *entry, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,136 @@
+/******************************************************************************
+ * 
+ * TELNETLOGGER-DECODE
+ * 
+ * Turns the binary log written by 'telnetlogger -F bin' back into the same
+ * text that 'telnetlogger -F txt' would have written.
+ * 
+ *	telnetlogger-decode [-T] [file ...]
+ * 
+ * With no files, reads from stdin. With -T, lines start with the record's
+ * timestamp, as with 'telnetlogger -T'.
+ * 
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "record.h"
+
+/******************************************************************************
+ * Decode one stream. Records are decoded out of a buffer that's refilled as
+ * it empties, so a record may straddle two reads.
+ ******************************************************************************/
+static int decode_file(FILE *fp, const char *filename, struct RecordClock *clock) {
+	static unsigned char buf[65536];
+	static char line[RECORD_MAX];
+	static unsigned char capture[RECORD_CAPTURE_MAX];
+	size_t offset = 0;
+	size_t length = 0;
+	int header = 0;
+
+	for (;;) {
+		size_t count;
+
+		/* slide what's left to the front, and top up */
+		memmove(buf, buf + offset, length - offset);
+		length -= offset;
+		offset = 0;
+		count = fread(buf + length, 1, sizeof(buf) - length, fp);
+		length += count;
+		if (count == 0 && length == 0)
+			break;
+
+		if (!header) {
+			if (length < RECORD_HEADER_SIZE) {
+				if (count == 0)
+					goto truncated;
+				continue;
+			}
+			if (memcmp(buf, RECORD_MAGIC, 4) != 0) {
+				fprintf(stderr, "%s: not a telnetlogger binary log\n", filename);
+				return -1;
+			}
+			if (buf[4] != RECORD_VERSION) {
+				fprintf(stderr, "%s: unknown version %u\n", filename, buf[4]);
+				return -1;
+			}
+			offset = RECORD_HEADER_SIZE;
+			header = 1;
+		}
+
+		for (;;) {
+			struct LogRecord rec;
+			int x;
+
+			/* a segment that wasn't closed cleanly ends in zeroes */
+			if (length - offset >= 2 && buf[offset] == 0 && buf[offset + 1] == 0)
+				return 0;
+
+			rec.capture = capture;
+			x = record_parse_binary(&rec, buf + offset, length - offset);
+			if (x == 0)
+				break;
+			if (x < 0) {
+				fprintf(stderr, "%s: corrupt record\n", filename);
+				return -1;
+			}
+			offset += x;
+			fwrite(line, 1, record_format_text(line, &rec, clock), stdout);
+		}
+
+		if (count == 0) {
+			if (offset < length)
+				goto truncated;
+			break;
+		}
+	}
+	return 0;
+
+truncated:
+	fprintf(stderr, "%s: truncated record at end of file\n", filename);
+	return -1;
+}
+
+/******************************************************************************
+ ******************************************************************************/
+int main(int argc, char *argv[]) {
+	struct RecordClock cache;
+	struct RecordClock *clock = NULL;
+	int files = 0;
+	int result = 0;
+	int i;
+
+	record_clock_init(&cache);
+	for (i = 1; i < argc; i++) {
+		FILE *fp;
+
+		if (strcmp(argv[i], "-T") == 0) {
+			clock = &cache;
+			continue;
+		}
+		if (argv[i][0] == '-' && argv[i][1] != '\0') {
+			fprintf(stderr, "usage:\n telnetlogger-decode [-T] [file ...]\n");
+			return 1;
+		}
+		files++;
+		if (strcmp(argv[i], "-") == 0) {
+			if (decode_file(stdin, "<stdin>", clock) < 0)
+				result = 1;
+			continue;
+		}
+		fp = fopen(argv[i], "rb");
+		if (fp == NULL) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			result = 1;
+			continue;
+		}
+		if (decode_file(fp, argv[i], clock) < 0)
+			result = 1;
+		fclose(fp);
+	}
+	if (files == 0 && decode_file(stdin, "<stdin>", clock) < 0)
+		result = 1;
+	return result;
+}
@@ -0,0 +1,162 @@
+/******************************************************************************
+ * Formatting kernels for the output records. These run once for every byte
+ * we log, so they work on buffers rather than through stdio.
+ ******************************************************************************/
+#include "format.h"
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/******************************************************************************
+ * Blacklist some bad characters to avoid the most obvious attempts of 
+ * entering bad passwords designed to hack the system (shell injection,
+ * HTML injection, SQL injection). A byte is passed through if it is
+ * printable (in the "C" locale), and isn't one of  \ < ' space " ,
+ * Anything else is written as \xNN.
+ ******************************************************************************/
+#define SAFE(c) ((c) > 0x20 && (c) < 0x7f && (c) != '\\' && (c) != '<' \
+	&& (c) != '\'' && (c) != '\"' && (c) != ',')
+#define SAFE4(c) SAFE(c), SAFE(c + 1), SAFE(c + 2), SAFE(c + 3)
+#define SAFE16(c) SAFE4(c), SAFE4(c + 4), SAFE4(c + 8), SAFE4(c + 12)
+#define SAFE64(c) SAFE16(c), SAFE16(c + 16), SAFE16(c + 32), SAFE16(c + 48)
+
+static const unsigned char safe_table[256] = {
+	SAFE64(0), SAFE64(64), SAFE64(128), SAFE64(192)
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/******************************************************************************
+ * Most usernames and passwords need no escaping at all, so with SSE2 we
+ * check 16 bytes at a time and copy whole runs of safe bytes in one go,
+ * only dropping down to the table for the bytes that need it.
+ ******************************************************************************/
+size_t print_string(char *dst, const char *str, size_t len) {
+	const unsigned char *src = (const unsigned char *)str;
+	size_t i = 0;
+	size_t d = 0;
+
+#if defined(__SSE2__)
+	const __m128i space = _mm_set1_epi8(0x20);
+	const __m128i del = _mm_set1_epi8(0x7f);
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i lt = _mm_set1_epi8('<');
+	const __m128i quote = _mm_set1_epi8('\'');
+	const __m128i dquote = _mm_set1_epi8('\"');
+	const __m128i comma = _mm_set1_epi8(',');
+
+	while (i + 16 <= len) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i ok;
+		__m128i bad;
+		unsigned mask;
+
+		/* bytes 0x80 and above are negative, so fail the first test */
+		ok = _mm_and_si128(_mm_cmpgt_epi8(v, space), _mm_cmplt_epi8(v, del));
+		bad = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, backslash), _mm_cmpeq_epi8(v, lt)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+				_mm_or_si128(_mm_cmpeq_epi8(v, dquote), _mm_cmpeq_epi8(v, comma))));
+		mask = _mm_movemask_epi8(_mm_andnot_si128(bad, ok));
+
+		if (mask == 0xFFFF) {
+			_mm_storeu_si128((__m128i *)(dst + d), v);
+			i += 16;
+			d += 16;
+		} else {
+			/* copy the safe run, then escape the byte that ended it */
+			unsigned run = __builtin_ctz(~mask);
+			unsigned char c;
+
+			memcpy(dst + d, src + i, run);
+			i += run;
+			d += run;
+			c = src[i++];
+			dst[d++] = '\\';
+			dst[d++] = 'x';
+			dst[d++] = hex_digits[c >> 4];
+			dst[d++] = hex_digits[c & 0xF];
+		}
+	}
+#endif
+
+	for (; i < len; i++) {
+		unsigned char c = src[i];
+		if (safe_table[c])
+			dst[d++] = c;
+		else {
+			dst[d++] = '\\';
+			dst[d++] = 'x';
+			dst[d++] = hex_digits[c >> 4];
+			dst[d++] = hex_digits[c & 0xF];
+		}
+	}
+	return d;
+}
+
+/******************************************************************************
+ * Almost all the scanners we see are IPv4, and inet_ntop() is surprisingly
+ * slow at it, so those get formatted by hand.
+ ******************************************************************************/
+static size_t format_octet(char *dst, unsigned v) {
+	if (v >= 100) {
+		dst[0] = '0' + v / 100;
+		dst[1] = '0' + (v / 10) % 10;
+		dst[2] = '0' + v % 10;
+		return 3;
+	} else if (v >= 10) {
+		dst[0] = '0' + v / 10;
+		dst[1] = '0' + v % 10;
+		return 2;
+	} else {
+		dst[0] = '0' + v;
+		return 1;
+	}
+}
+
+size_t format_addr(char *dst, const unsigned char addr[16]) {
+	static const unsigned char v4mapped[12] = {0,0,0,0, 0,0,0,0, 0,0,0xff,0xff};
+
+	if (memcmp(addr, v4mapped, 12) == 0) {
+		size_t d = 0;
+		unsigned i;
+
+		for (i = 12; i < 16; i++) {
+			d += format_octet(dst + d, addr[i]);
+			dst[d++] = '.';
+		}
+		dst[--d] = '\0';
+		return d;
+	}
+
+	if (inet_ntop(AF_INET6, addr, dst, FORMAT_ADDR_MAX) == NULL) {
+		dst[0] = '\0';
+		return 0;
+	}
+	return strlen(dst);
+}
+
+size_t format_error(char *dst, unsigned err) {
+	const char *text;
+	size_t len;
+
+	switch (err) {
+	case ECONNRESET: text = "TCP connection reset"; break;
+	case ECONNREFUSED: text = "Connection refused"; break;
+	case ETIMEDOUT: text = "Timed out"; break;
+	case ECONNABORTED: text = "Connection aborted"; break;
+	case EACCES: text = "Access denied"; break;
+	case EADDRINUSE: text = "Port already in use"; break;
+	case 11: text = "Timed out"; break;
+	case 0: text = "TCP connection closed"; break;
+	default:
+		return snprintf(dst, FORMAT_ERROR_MAX, "err#%u", err);
+	}
+	len = strlen(text);
+	memcpy(dst, text, len);
+	return len;
+}
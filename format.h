@@ -0,0 +1,35 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+#include <stddef.h>
+
+/******************************************************************************
+ * The most a field can grow when escaped: every byte may become "\xNN"
+ ******************************************************************************/
+#define ESCAPED_MAX(len) ((len) * 4)
+
+/******************************************************************************
+ * Escape a username or password into 'dst', which must have room for
+ * ESCAPED_MAX(len) bytes. Returns the length of the escaped string, which
+ * is not nul-terminated.
+ ******************************************************************************/
+size_t print_string(char *dst, const char *str, size_t len);
+
+/******************************************************************************
+ * Format a 16-byte binary address the way getnameinfo(NI_NUMERICHOST) would,
+ * except that IPv4-mapped addresses come out as plain dotted quads. 'dst'
+ * must have room for FORMAT_ADDR_MAX bytes. Returns the length written,
+ * not counting the nul-terminator.
+ ******************************************************************************/
+#define FORMAT_ADDR_MAX 46
+size_t format_addr(char *dst, const unsigned char addr[16]);
+
+/******************************************************************************
+ * Describe a socket error the way the stderr log always has, "TCP
+ * connection reset" and so on, or "err#NN" for the ones without a name.
+ * 'dst' must have room for FORMAT_ERROR_MAX bytes. Returns the length,
+ * not counting any nul-terminator.
+ ******************************************************************************/
+#define FORMAT_ERROR_MAX 32
+size_t format_error(char *dst, unsigned err);
+
+#endif
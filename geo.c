@@ -0,0 +1,146 @@
+/******************************************************************************
+ * Looking up ASNs and countries. See geo.h.
+ ******************************************************************************/
+#include "geo.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static size_t align8(size_t x) {
+	return (x + 7) & ~(size_t)7;
+}
+
+void geo_layout(const struct GeoHeader *header, struct GeoLayout *layout) {
+	size_t d = align8(sizeof(*header));
+
+	layout->v4_index = d;
+	d = align8(d + (GEO_INDEX + 1) * sizeof(uint32_t));
+	layout->v4_start = d;
+	d = align8(d + (size_t)header->v4_count * sizeof(uint32_t));
+	layout->v4_value = d;
+	d = align8(d + (size_t)header->v4_count * sizeof(uint32_t));
+	layout->v6_index = d;
+	d = align8(d + (GEO_INDEX + 1) * sizeof(uint32_t));
+	layout->v6_start = d;
+	d = align8(d + (size_t)header->v6_count * sizeof(uint64_t));
+	layout->v6_value = d;
+	d = align8(d + (size_t)header->v6_count * sizeof(uint32_t));
+	layout->values = d;
+	layout->size = d + (size_t)header->value_count * sizeof(struct GeoValue);
+}
+
+/******************************************************************************
+ * Only the header and the ends of the indexes are checked here. Checking
+ * every range would read the whole file in, so geo_lookup() instead keeps
+ * whatever it finds within bounds.
+ ******************************************************************************/
+int geo_open(struct GeoDb *db, const char *path) {
+	const struct GeoHeader *header;
+	struct GeoLayout layout;
+	struct stat st;
+	const char *map;
+	int fd;
+
+	memset(db, 0, sizeof(*db));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(*header)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	header = (const struct GeoHeader *)map;
+	if (memcmp(header->magic, GEO_MAGIC, 4) != 0 || header->order != GEO_ORDER
+		|| header->version != GEO_VERSION || header->v4_count == 0
+		|| header->v6_count == 0 || header->value_count == 0)
+		goto invalid;
+	geo_layout(header, &layout);
+	if (layout.size > (size_t)st.st_size)
+		goto invalid;
+
+	db->map = map;
+	db->size = st.st_size;
+	db->v4_index = (const uint32_t *)(map + layout.v4_index);
+	db->v4_start = (const uint32_t *)(map + layout.v4_start);
+	db->v4_value = (const uint32_t *)(map + layout.v4_value);
+	db->v6_index = (const uint32_t *)(map + layout.v6_index);
+	db->v6_start = (const uint64_t *)(map + layout.v6_start);
+	db->v6_value = (const uint32_t *)(map + layout.v6_value);
+	db->values = (const struct GeoValue *)(map + layout.values);
+	db->v4_count = header->v4_count;
+	db->v6_count = header->v6_count;
+	db->value_count = header->value_count;
+	if (db->v4_index[GEO_INDEX] >= db->v4_count || db->v6_index[GEO_INDEX] >= db->v6_count)
+		goto invalid;
+	return 0;
+
+invalid:
+	munmap((void *)map, st.st_size);
+	memset(db, 0, sizeof(*db));
+	errno = EINVAL;
+	return -1;
+}
+
+void geo_close(struct GeoDb *db) {
+	if (db->map)
+		munmap((void *)db->map, db->size);
+	memset(db, 0, sizeof(*db));
+}
+
+/******************************************************************************
+ * The last range starting at or before 'key', between 'lo' and 'hi'. The
+ * index entry for a /16 is the range its first address is in, so the one
+ * wanted is never before it, nor after the next /16's.
+ ******************************************************************************/
+#define GEO_SEARCH(start, key, lo, hi) do {				\
+		while (lo < hi) {					\
+			uint32_t mid = lo + (hi - lo + 1) / 2;		\
+			if (start[mid] <= key)				\
+				lo = mid;				\
+			else						\
+				hi = mid - 1;				\
+		}							\
+	} while (0)
+
+static const unsigned char mapped_prefix[12] = {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+
+const struct GeoValue *geo_lookup(const struct GeoDb *db, const unsigned char addr[16]) {
+	uint32_t lo, hi, value;
+
+	if (memcmp(addr, mapped_prefix, 12) == 0) {
+		uint32_t key = (uint32_t)addr[12] << 24 | addr[13] << 16 | addr[14] << 8 | addr[15];
+
+		lo = db->v4_index[key >> 16];
+		hi = db->v4_index[(key >> 16) + 1];
+		if (hi >= db->v4_count || lo > hi)
+			return &db->values[0];
+		GEO_SEARCH(db->v4_start, key, lo, hi);
+		value = db->v4_value[lo];
+	} else {
+		uint64_t key = 0;
+		unsigned i;
+
+		for (i = 0; i < 8; i++)
+			key = key << 8 | addr[i];
+		lo = db->v6_index[key >> 48];
+		hi = db->v6_index[(key >> 48) + 1];
+		if (hi >= db->v6_count || lo > hi)
+			return &db->values[0];
+		GEO_SEARCH(db->v6_start, key, lo, hi);
+		value = db->v6_value[lo];
+	}
+	return &db->values[value < db->value_count ? value : 0];
+}
@@ -0,0 +1,92 @@
+#ifndef GEO_H
+#define GEO_H
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************************************************************
+ * The ASN and country database for -g. It's built offline by geogen, from
+ * RouteViews and MaxMind dumps, into a file that's just mapped at startup:
+ * there is nothing to parse, and nothing is read until a lookup touches it.
+ *
+ * The prefixes have been flattened into ranges that don't overlap and
+ * between them cover every address, each with the ASN and country of the
+ * longest prefix it falls in (or none). A lookup is then a search for the
+ * last range starting at or before the address. The first 16 bits of the
+ * address index straight into the ranges, the way the first step of
+ * DIR-24-8 does, which leaves a binary search of the few ranges under that
+ * /16, all on one or two cache lines. IPv6 is looked up by its first 64
+ * bits, so prefixes longer than /64 count as /64.
+ *
+ * The file, in the byte order of whoever built it:
+ *
+ *	struct GeoHeader
+ *	u32 v4_index[GEO_INDEX+1]	first range under each /16, then the last
+ *	u32 v4_start[v4_count]		where each IPv4 range starts, ascending
+ *	u32 v4_value[v4_count]		its index into values[]
+ *	u32 v6_index[GEO_INDEX+1]	the same for IPv6,
+ *	u64 v6_start[v6_count]		on the first 64 bits
+ *	u32 v6_value[v6_count]
+ *	struct GeoValue values[value_count]	values[0] is "don't know"
+ *
+ * each array starting on an 8-byte boundary.
+ ******************************************************************************/
+#define GEO_MAGIC "TGEO"
+#define GEO_VERSION 1
+#define GEO_ORDER 0x01020304u	/* to catch a file from a machine of the other order */
+#define GEO_INDEX 65536
+
+struct GeoHeader {
+	char magic[4];
+	uint32_t order;
+	uint32_t version;
+	uint32_t v4_count;
+	uint32_t v6_count;
+	uint32_t value_count;
+	uint64_t reserved;
+};
+
+struct GeoValue {
+	uint32_t asn;		/* 0 if we don't know */
+	char country[2];	/* ISO 3166 code, or zeroes */
+	uint16_t reserved;
+};
+
+/* Where each array is, as byte offsets from the start of the file */
+struct GeoLayout {
+	size_t v4_index, v4_start, v4_value;
+	size_t v6_index, v6_start, v6_value;
+	size_t values;
+	size_t size;		/* of the whole file */
+};
+
+void geo_layout(const struct GeoHeader *header, struct GeoLayout *layout);
+
+/******************************************************************************
+ * A database, mapped
+ ******************************************************************************/
+struct GeoDb {
+	const void *map;
+	size_t size;
+	const uint32_t *v4_index;
+	const uint32_t *v4_start;
+	const uint32_t *v4_value;
+	const uint32_t *v6_index;
+	const uint64_t *v6_start;
+	const uint32_t *v6_value;
+	const struct GeoValue *values;
+	uint32_t v4_count;
+	uint32_t v6_count;
+	uint32_t value_count;
+};
+
+/******************************************************************************
+ * Map a database file, and check that it's whole. Returns -1 and sets errno
+ * on failure, EINVAL if it isn't one we can use.
+ ******************************************************************************/
+int geo_open(struct GeoDb *db, const char *path);
+void geo_close(struct GeoDb *db);
+
+/* The ASN and country of a 16-byte address, IPv4 being IPv4-mapped */
+const struct GeoValue *geo_lookup(const struct GeoDb *db, const unsigned char addr[16]);
+
+#endif
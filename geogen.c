@@ -0,0 +1,534 @@
+/******************************************************************************
+ *
+ * GEOGEN
+ *
+ * Builds the ASN and country database for 'telnetlogger -g' (see geo.h)
+ * out of any of these, told apart by their first line:
+ *
+ *	RouteViews prefix-to-AS files (routeviews-rv2-*.pfx2as, and rv6),
+ *	    the ASNs
+ *	MaxMind GeoLite2-ASN-Blocks-IPv4.csv and -IPv6.csv, the same
+ *	MaxMind GeoLite2-Country-Blocks-IPv4.csv and -IPv6.csv, the
+ *	    countries, which need GeoLite2-Country-Locations-en.csv too
+ *
+ *	geogen routeviews-rv2-20261014-1200.pfx2as GeoLite2-Country-*.csv > telnetlogger.geo
+ *
+ * Where more than one file gives the ASN for an address, or the country,
+ * the longest prefix wins.
+ *
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "geo.h"
+
+#define MAX_LINE 4096
+#define MAX_FIELDS 8
+
+/* A prefix, as its first and last key: the IPv4 address, or the first 64
+ * bits of the IPv6 one */
+struct Prefix {
+	uint64_t first;
+	uint64_t last;
+	uint32_t value;		/* an ASN, or a country code's two letters */
+};
+
+struct Prefixes {
+	struct Prefix *list;
+	size_t count;
+	size_t size;
+};
+
+/* What a flattened range has, from 'start' up to the next one's */
+struct Range {
+	uint64_t start;
+	uint32_t value;
+};
+
+struct Ranges {
+	struct Range *list;
+	size_t count;
+	size_t size;
+};
+
+struct Location {
+	unsigned long id;
+	uint32_t country;
+};
+
+enum {
+	FILE_PFX2AS,
+	FILE_ASN,
+	FILE_COUNTRY,
+	FILE_LOCATIONS,
+};
+
+static struct Prefixes asns[2];		/* IPv4, IPv6 */
+static struct Prefixes countries[2];
+static struct Location *locations;
+static size_t location_count;
+static size_t location_size;
+
+static void *grow(void *list, size_t *size, size_t count, size_t item) {
+	if (count < *size)
+		return list;
+	*size = *size ? *size * 2 : 1024;
+	list = realloc(list, *size * item);
+	if (list == NULL) {
+		fprintf(stderr, "geogen: out of memory\n");
+		exit(1);
+	}
+	return list;
+}
+
+/******************************************************************************
+ * Split a CSV line in place, MaxMind style: fields may be in double quotes,
+ * with "" for a quote. Returns how many fields there were.
+ ******************************************************************************/
+static unsigned split_csv(char *line, char **fields, unsigned max) {
+	unsigned n = 0;
+	char *s = line;
+
+	while (n < max) {
+		char *d = s;
+
+		fields[n++] = s;
+		if (*s == '"') {
+			fields[n - 1] = d = ++s;
+			while (*s && !(s[0] == '"' && s[1] != '"')) {
+				if (s[0] == '"')
+					s++;
+				*d++ = *s++;
+			}
+			if (*s == '"')
+				s++;
+		} else {
+			while (*s && *s != ',')
+				s++;
+			d = s;
+		}
+		if (*s != ',') {
+			*d = '\0';
+			break;
+		}
+		s++;
+		*d = '\0';
+	}
+	return n;
+}
+
+/******************************************************************************
+ * An address and prefix length into a family (0 or 1) and a Prefix. IPv6
+ * prefixes longer than /64 are treated as /64.
+ ******************************************************************************/
+static int parse_prefix(const char *addr, unsigned long length, struct Prefix *p) {
+	unsigned char bytes[16];
+	uint64_t key = 0;
+	unsigned bits;
+	unsigned i;
+	int family;
+
+	if (inet_pton(AF_INET, addr, bytes) == 1) {
+		family = 0;
+		bits = 32;
+		for (i = 0; i < 4; i++)
+			key = key << 8 | bytes[i];
+	} else if (inet_pton(AF_INET6, addr, bytes) == 1) {
+		family = 1;
+		bits = 64;
+		for (i = 0; i < 8; i++)
+			key = key << 8 | bytes[i];
+		if (length > 64)
+			length = 64;
+	} else
+		return -1;
+	if (length < 1 || length > bits)
+		return -1;
+
+	p->first = key & ~((UINT64_C(1) << (bits - length)) - 1) & (UINT64_MAX >> (64 - bits));
+	p->last = p->first | ((UINT64_C(1) << (bits - length)) - 1);
+	return family;
+}
+
+/* 'a.b.c.d/len' */
+static int parse_network(char *network, struct Prefix *p) {
+	char *slash = strchr(network, '/');
+	char *end;
+	unsigned long length;
+
+	if (slash == NULL)
+		return -1;
+	*slash = '\0';
+	length = strtoul(slash + 1, &end, 10);
+	if (*end != '\0')
+		return -1;
+	return parse_prefix(network, length, p);
+}
+
+static void add(struct Prefixes *prefixes, const struct Prefix *p) {
+	prefixes->list = grow(prefixes->list, &prefixes->size, prefixes->count, sizeof(*p));
+	prefixes->list[prefixes->count++] = *p;
+}
+
+static int compare_locations(const void *a, const void *b) {
+	const struct Location *x = a, *y = b;
+	return (x->id > y->id) - (x->id < y->id);
+}
+
+static uint32_t find_location(unsigned long id) {
+	struct Location key;
+	struct Location *found;
+
+	key.id = id;
+	found = bsearch(&key, locations, location_count, sizeof(key), compare_locations);
+	return found ? found->country : 0;
+}
+
+static int file_kind(const char *line) {
+	if (strncmp(line, "geoname_id,", 11) == 0)
+		return FILE_LOCATIONS;
+	if (strncmp(line, "network,autonomous_system_number", 32) == 0)
+		return FILE_ASN;
+	if (strncmp(line, "network,geoname_id", 18) == 0)
+		return FILE_COUNTRY;
+	return FILE_PFX2AS;
+}
+
+/******************************************************************************
+ * Read one file, of the kind its first line says it is. Locations are only
+ * read with 'want_locations', and everything else only without, so that
+ * they can all be read before the countries that need them. Lines that
+ * don't make sense are counted and skipped.
+ ******************************************************************************/
+static int read_file(const char *filename, int want_locations) {
+	char line[MAX_LINE];
+	char *fields[MAX_FIELDS];
+	unsigned long number = 0;
+	unsigned long bad = 0;
+	int kind = -1;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		perror(filename);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		struct Prefix p;
+		int family = -1;
+		unsigned n;
+
+		line[strcspn(line, "\r\n")] = '\0';
+		if (number++ == 0) {
+			kind = file_kind(line);
+			if ((kind == FILE_LOCATIONS) != want_locations)
+				break;
+			if (kind != FILE_PFX2AS)
+				continue;
+		}
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+
+		switch (kind) {
+		case FILE_PFX2AS:
+		{
+			/* address, length, and the origin AS, or several of them
+			 * with '_' or ',' between, of which we take the first */
+			char *addr = strtok(line, " \t");
+			char *length = strtok(NULL, " \t");
+			char *asn = strtok(NULL, " \t");
+
+			if (addr && length && asn) {
+				family = parse_prefix(addr, strtoul(length, 0, 10), &p);
+				p.value = (uint32_t)strtoul(asn, 0, 10);
+			}
+			if (family >= 0 && p.value)
+				add(&asns[family], &p);
+		}
+			break;
+		case FILE_ASN:
+			n = split_csv(line, fields, MAX_FIELDS);
+			if (n >= 2 && (family = parse_network(fields[0], &p)) >= 0) {
+				p.value = (uint32_t)strtoul(fields[1], 0, 10);
+				if (p.value)
+					add(&asns[family], &p);
+			}
+			break;
+		case FILE_COUNTRY:
+			/* where it is, or failing that, where it's registered */
+			n = split_csv(line, fields, MAX_FIELDS);
+			if (n >= 3 && (family = parse_network(fields[0], &p)) >= 0) {
+				p.value = find_location(strtoul(fields[1], 0, 10));
+				if (p.value == 0)
+					p.value = find_location(strtoul(fields[2], 0, 10));
+				if (p.value)
+					add(&countries[family], &p);
+			}
+			break;
+		case FILE_LOCATIONS:
+			/* some are continents, with no country */
+			n = split_csv(line, fields, MAX_FIELDS);
+			family = (n >= 5) ? 0 : -1;
+			if (n >= 5 && strlen(fields[4]) == 2) {
+				locations = grow(locations, &location_size, location_count, sizeof(locations[0]));
+				locations[location_count].id = strtoul(fields[0], 0, 10);
+				locations[location_count].country = (unsigned char)fields[4][0] << 8
+					| (unsigned char)fields[4][1];
+				location_count++;
+			}
+			break;
+		}
+		if (family < 0)
+			bad++;
+	}
+	fclose(fp);
+	if (bad)
+		fprintf(stderr, "%s: skipped %lu lines that made no sense\n", filename, bad);
+	return 0;
+}
+
+/******************************************************************************
+ * Flatten prefixes into ranges, the longest prefix winning. Sorted by first
+ * address, and the longest last among those starting at the same place,
+ * each prefix is either inside the one before or after it; a stack holds
+ * the ones we're inside of.
+ ******************************************************************************/
+static int compare_prefixes(const void *a, const void *b) {
+	const struct Prefix *x = a, *y = b;
+
+	if (x->first != y->first)
+		return (x->first > y->first) - (x->first < y->first);
+	return (x->last < y->last) - (x->last > y->last);
+}
+
+static void emit(struct Ranges *ranges, uint64_t start, uint32_t value) {
+	if (ranges->count && ranges->list[ranges->count - 1].value == value)
+		return;
+	if (ranges->count && ranges->list[ranges->count - 1].start == start) {
+		ranges->list[ranges->count - 1].value = value;
+		if (ranges->count > 1 && ranges->list[ranges->count - 2].value == value)
+			ranges->count--;
+		return;
+	}
+	ranges->list = grow(ranges->list, &ranges->size, ranges->count, sizeof(ranges->list[0]));
+	ranges->list[ranges->count].start = start;
+	ranges->list[ranges->count].value = value;
+	ranges->count++;
+}
+
+static void flatten(struct Prefixes *prefixes, uint64_t max, struct Ranges *ranges) {
+	struct Prefix **stack = malloc((prefixes->count + 1) * sizeof(stack[0]));
+	size_t depth = 0;
+	uint64_t at = 0;	/* everything before this has been emitted */
+	int done = 0;		/* or everything has */
+	size_t i;
+
+	if (stack == NULL) {
+		fprintf(stderr, "geogen: out of memory\n");
+		exit(1);
+	}
+	qsort(prefixes->list, prefixes->count, sizeof(prefixes->list[0]), compare_prefixes);
+	emit(ranges, 0, 0);
+	for (i = 0; i <= prefixes->count; i++) {
+		struct Prefix *p = (i < prefixes->count) ? &prefixes->list[i] : NULL;
+
+		/* finish the ones that end before this starts */
+		while (depth && (p == NULL || stack[depth - 1]->last < p->first)) {
+			struct Prefix *top = stack[--depth];
+
+			if (!done && at <= top->last) {
+				emit(ranges, at, top->value);
+				done = (top->last == max);
+				at = top->last + 1;
+			}
+		}
+		if (p == NULL)
+			break;
+		/* what's between, up to this one */
+		if (!done && at < p->first)
+			emit(ranges, at, depth ? stack[depth - 1]->value : 0);
+		if (!done && at <= p->first)
+			at = p->first;
+		stack[depth++] = p;
+	}
+	if (!done)
+		emit(ranges, at, 0);
+	free(stack);
+}
+
+/******************************************************************************
+ * Put the ASN ranges and the country ranges together, giving each distinct
+ * pair of them an entry in 'values'
+ ******************************************************************************/
+#define VALUE_SLOTS (1 << 20)
+
+static struct GeoValue *values;
+static size_t value_count;
+static size_t value_size;
+static uint32_t *value_slots;
+
+static uint32_t value_of(uint32_t asn, uint32_t country) {
+	uint32_t h = (asn * 2654435761u ^ country * 40503u) & (VALUE_SLOTS - 1);
+
+	if (asn == 0 && country == 0)
+		return 0;
+	for (;;) {
+		uint32_t v = value_slots[h];
+
+		if (v == 0)
+			break;
+		if (values[v].asn == asn && (uint32_t)((unsigned char)values[v].country[0] << 8
+				| (unsigned char)values[v].country[1]) == country)
+			return v;
+		h = (h + 1) & (VALUE_SLOTS - 1);
+	}
+	if (value_count == VALUE_SLOTS / 2) {
+		fprintf(stderr, "geogen: more than %u ASN and country pairs\n", VALUE_SLOTS / 2);
+		exit(1);
+	}
+	values = grow(values, &value_size, value_count, sizeof(values[0]));
+	memset(&values[value_count], 0, sizeof(values[0]));
+	values[value_count].asn = asn;
+	values[value_count].country[0] = (char)(country >> 8);
+	values[value_count].country[1] = (char)country;
+	value_slots[h] = (uint32_t)value_count;
+	return (uint32_t)value_count++;
+}
+
+static void merge(const struct Ranges *a, const struct Ranges *c, struct Ranges *out) {
+	size_t i = 0;
+	size_t j = 0;
+
+	/* both start at 0 */
+	while (i < a->count || j < c->count) {
+		uint64_t start;
+
+		if (j == c->count || (i < a->count && a->list[i].start < c->list[j].start))
+			start = a->list[i++].start;
+		else if (i == a->count || c->list[j].start < a->list[i].start)
+			start = c->list[j++].start;
+		else {
+			start = a->list[i++].start;
+			j++;
+		}
+		emit(out, start, value_of(a->list[i - 1].value, c->list[j - 1].value));
+	}
+}
+
+/******************************************************************************
+ * Writing the file out
+ ******************************************************************************/
+static void put(const void *data, size_t length, size_t *offset, size_t at) {
+	static const char zeroes[8];
+
+	if (at < *offset || at - *offset > sizeof(zeroes)
+		|| fwrite(zeroes, 1, at - *offset, stdout) != at - *offset
+		|| fwrite(data, 1, length, stdout) != length) {
+		perror("geogen: stdout");
+		exit(1);
+	}
+	*offset = at + length;
+}
+
+static void put_index(const struct Ranges *r, unsigned shift, size_t *offset, size_t at) {
+	static uint32_t index[GEO_INDEX + 1];
+	size_t i = 0;
+	uint64_t h;
+
+	for (h = 0; h < GEO_INDEX; h++) {
+		while (i + 1 < r->count && r->list[i + 1].start <= h << shift)
+			i++;
+		index[h] = (uint32_t)i;
+	}
+	index[GEO_INDEX] = (uint32_t)(r->count - 1);
+	put(index, sizeof(index), offset, at);
+}
+
+static void put_ranges(const struct Ranges *r, int wide, size_t *offset, size_t at_start,
+	size_t at_value) {
+	size_t i;
+
+	for (i = 0; i < r->count; i++) {
+		if (wide) {
+			uint64_t start = r->list[i].start;
+			put(&start, sizeof(start), offset, at_start + i * sizeof(start));
+		} else {
+			uint32_t start = (uint32_t)r->list[i].start;
+			put(&start, sizeof(start), offset, at_start + i * sizeof(start));
+		}
+	}
+	for (i = 0; i < r->count; i++)
+		put(&r->list[i].value, sizeof(uint32_t), offset, at_value + i * sizeof(uint32_t));
+}
+
+int main(int argc, char *argv[]) {
+	struct Ranges asn_ranges[2] = {{0}};
+	struct Ranges country_ranges[2] = {{0}};
+	struct Ranges ranges[2] = {{0}};
+	struct GeoHeader header;
+	struct GeoLayout layout;
+	size_t offset = 0;
+	int family;
+	int i;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage:\n geogen file.pfx2as|GeoLite2-*.csv ... > telnetlogger.geo\n");
+		return 1;
+	}
+	for (i = 1; i < argc; i++) {
+		if (read_file(argv[i], 1) < 0)
+			return 1;
+	}
+	qsort(locations, location_count, sizeof(locations[0]), compare_locations);
+	for (i = 1; i < argc; i++) {
+		if (read_file(argv[i], 0) < 0)
+			return 1;
+	}
+	if (asns[0].count + asns[1].count + countries[0].count + countries[1].count == 0) {
+		fprintf(stderr, "geogen: no prefixes found%s\n",
+			location_count ? "" : " (countries need the locations file too)");
+		return 1;
+	}
+
+	value_slots = calloc(VALUE_SLOTS, sizeof(value_slots[0]));
+	if (value_slots == NULL) {
+		fprintf(stderr, "geogen: out of memory\n");
+		return 1;
+	}
+	values = grow(values, &value_size, 0, sizeof(values[0]));
+	memset(&values[0], 0, sizeof(values[0]));
+	value_count = 1;
+	for (family = 0; family < 2; family++) {
+		uint64_t max = family ? UINT64_MAX : UINT32_MAX;
+
+		flatten(&asns[family], max, &asn_ranges[family]);
+		flatten(&countries[family], max, &country_ranges[family]);
+		merge(&asn_ranges[family], &country_ranges[family], &ranges[family]);
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, GEO_MAGIC, 4);
+	header.order = GEO_ORDER;
+	header.version = GEO_VERSION;
+	header.v4_count = (uint32_t)ranges[0].count;
+	header.v6_count = (uint32_t)ranges[1].count;
+	header.value_count = (uint32_t)value_count;
+	geo_layout(&header, &layout);
+
+	put(&header, sizeof(header), &offset, 0);
+	put_index(&ranges[0], 16, &offset, layout.v4_index);
+	put_ranges(&ranges[0], 0, &offset, layout.v4_start, layout.v4_value);
+	put_index(&ranges[1], 48, &offset, layout.v6_index);
+	put_ranges(&ranges[1], 1, &offset, layout.v6_start, layout.v6_value);
+	put(values, value_count * sizeof(values[0]), &offset, layout.values);
+	if (fflush(stdout) != 0) {
+		perror("geogen: stdout");
+		return 1;
+	}
+
+	fprintf(stderr, "geogen: %zu IPv4 ranges, %zu IPv6, %zu ASN and country pairs, %zu bytes\n",
+		ranges[0].count, ranges[1].count, value_count, layout.size);
+	return 0;
+}
@@ -0,0 +1,96 @@
+/******************************************************************************
+ * Latency histograms. See histogram.h.
+ ******************************************************************************/
+#include "histogram.h"
+#include <stdio.h>
+
+void histogram_merge(unsigned long long *counts, struct Histogram *h) {
+	unsigned i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		counts[i] += stat_get(&h->buckets[i]);
+	counts[HIST_BUCKETS] += stat_get(&h->sum);
+}
+
+/* The first value past bucket 'i' */
+static uint64_t histogram_upper(unsigned i) {
+	unsigned group = i / HIST_SUB;
+	unsigned sub = i % HIST_SUB;
+	unsigned shift;
+
+	if (group == 0)
+		return i + 1;
+	shift = group - 1;
+	return (uint64_t)(HIST_SUB + sub + 1) << shift;
+}
+
+uint64_t histogram_quantile(const unsigned long long *counts, double q) {
+	unsigned long long total = 0;
+	unsigned long long rank;
+	unsigned long long seen = 0;
+	unsigned i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		total += counts[i];
+	if (total == 0)
+		return 0;
+	rank = (unsigned long long)(q * total);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += counts[i];
+		if (seen > rank)
+			break;
+	}
+	return histogram_upper(i < HIST_BUCKETS ? i : HIST_BUCKETS - 1);
+}
+
+static size_t append(size_t size, size_t d, int n) {
+	if (n < 0 || (size_t)n >= size - d)
+		return size;
+	return d + n;
+}
+
+size_t histogram_render(char *dst, size_t size, size_t d, const char *name,
+	const char *help, const unsigned long long *counts) {
+	static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+	unsigned long long total = 0;
+	unsigned long long below = 0;
+	unsigned i;
+	unsigned k;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		total += counts[i];
+
+	if (d >= size)
+		return size;
+	d = append(size, d, snprintf(dst + d, size - d,
+		"# HELP %s %s\n# TYPE %s histogram\n", name, help, name));
+
+	/* the boundaries are the powers of two, where whole groups of
+	 * buckets end */
+	i = 0;
+	for (k = HIST_SUB_BITS; k < HIST_MAX_BITS && d < size; k++) {
+		for (; i < (k - HIST_SUB_BITS + 1) * HIST_SUB; i++)
+			below += counts[i];
+		d = append(size, d, snprintf(dst + d, size - d,
+			"%s_bucket{le=\"%g\"} %llu\n", name, (double)((uint64_t)1 << k) / 1e6, below));
+	}
+	if (d >= size)
+		return size;
+	d = append(size, d, snprintf(dst + d, size - d,
+		"%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.6f\n%s_count %llu\n",
+		name, total, name, (double)counts[HIST_BUCKETS] / 1e6, name, total));
+
+	/* and the quantiles, to the precision of a bucket */
+	if (d >= size)
+		return size;
+	d = append(size, d, snprintf(dst + d, size - d,
+		"# HELP %s_quantile Quantiles of %s, to within a bucket.\n"
+		"# TYPE %s_quantile gauge\n", name, name, name));
+	for (k = 0; k < sizeof(quantiles) / sizeof(quantiles[0]) && d < size; k++) {
+		uint64_t value = histogram_quantile(counts, quantiles[k]);
+
+		d = append(size, d, snprintf(dst + d, size - d,
+			"%s_quantile{quantile=\"%g\"} %g\n", name, quantiles[k], (double)value / 1e6));
+	}
+	return d;
+}
@@ -0,0 +1,60 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+#include <stddef.h>
+#include <stdint.h>
+#include "metrics.h"
+
+/******************************************************************************
+ * A log-linear histogram, in the style of HDR histograms: each power of two
+ * is split into HIST_SUB buckets, so every bucket is within 1/HIST_SUB of
+ * the values in it, across the whole range. Values are microseconds, and
+ * anything over HIST_MAX_BITS worth (about 12 days) goes in the last bucket.
+ *
+ * Like the other counters, each histogram has a single writer, so recording
+ * is an index calculation and a relaxed load and store. Histograms with the
+ * same layout are merged by adding them up bucket by bucket.
+ ******************************************************************************/
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct Histogram {
+	atomic_ullong buckets[HIST_BUCKETS];
+	atomic_ullong sum;
+};
+
+static inline unsigned histogram_index(uint64_t value) {
+	unsigned top;
+
+	if (value < HIST_SUB)
+		return (unsigned)value;
+	if (value >> HIST_MAX_BITS)
+		return HIST_BUCKETS - 1;
+	top = 63 - __builtin_clzll(value);
+	return (top - HIST_SUB_BITS + 1) * HIST_SUB
+		+ (unsigned)((value >> (top - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static inline void histogram_record(struct Histogram *h, uint64_t value) {
+	stat_add(&h->buckets[histogram_index(value)], 1);
+	stat_add(&h->sum, value);
+}
+
+/* Add 'h' into 'counts', HIST_BUCKETS of them then the sum */
+void histogram_merge(unsigned long long *counts, struct Histogram *h);
+
+/* The value below which fraction 'q' of a merged histogram lies, rounded up
+ * to the end of its bucket. 0 if the histogram is empty. */
+uint64_t histogram_quantile(const unsigned long long *counts, double q);
+
+/******************************************************************************
+ * Append a merged histogram to a metrics page, as a Prometheus histogram
+ * in seconds (with a bucket for each power of two) and gauges for some
+ * quantiles, which use the finer buckets. Returns the new length of the
+ * page, like the other metrics.
+ ******************************************************************************/
+size_t histogram_render(char *dst, size_t size, size_t d, const char *name,
+	const char *help, const unsigned long long *counts);
+
+#endif
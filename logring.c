@@ -0,0 +1,365 @@
+/******************************************************************************
+ * The output path. Event loops drop records into a lock-free ring, and a
+ * dedicated writer thread formats them and writes them out in large
+ * write()s, so that nobody on the connection-handling side ever waits on
+ * stdout or on a lock.
+ ******************************************************************************/
+#include "logring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <time.h>
+
+/* How many records we take from one ring before looking at the next */
+#define LOG_BATCH 256
+
+/* How many records we time per write, at most */
+#define LOG_PENDING 1024
+
+/******************************************************************************
+ * The writer sleeps on an eventfd when it runs out of work. 'sleeping' tells
+ * producers whether they need to kick it, so that in the busy case publishing
+ * a record is never a system call.
+ ******************************************************************************/
+struct LogWriter {
+	_Alignas(64) atomic_int sleeping;
+	atomic_int stopping;
+	int efd;
+	int fd;
+	int hold;			/* wait for EOF on this before writing, or -1 */
+	int format;
+	struct SegmentLog *segments;	/* if not NULL, used instead of 'fd' */
+	struct RecordClock clock;
+	struct LogRing **rings;
+	unsigned ring_count;
+	pthread_t handle;
+	unsigned long long reported_drops;
+	struct Histogram *latency;
+	const struct GeoDb *geo;	/* -g, for the records' addresses */
+	unsigned pending;		/* records in 'buf', when timing them */
+	uint64_t queued[LOG_PENDING];	/* and when each was committed */
+	size_t events_length;
+	char events[16384];		/* LOG_EVENT records, for stderr */
+	size_t length;
+	char buf[131072];
+};
+
+
+static uint64_t clock_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/******************************************************************************
+ ******************************************************************************/
+struct LogRing *log_ring_create(size_t count, int policy) {
+	struct LogRing *ring;
+	size_t i;
+
+	if (count == 0 || (count & (count - 1)) != 0)
+		return NULL;
+
+	ring = aligned_alloc(64, sizeof(*ring));
+	if (ring == NULL)
+		return NULL;
+	memset(ring, 0, sizeof(*ring));
+	ring->slots = calloc(count, sizeof(ring->slots[0]));
+	if (ring->slots == NULL) {
+		free(ring);
+		return NULL;
+	}
+	for (i = 0; i < count; i++)
+		atomic_init(&ring->slots[i].seq, i);
+	ring->mask = count - 1;
+	ring->policy = policy;
+	return ring;
+}
+
+/******************************************************************************
+ * A slot is free for the producer at position 'pos' when its sequence
+ * number equals 'pos'. If it is still 'pos - size', the writer hasn't got
+ * to it yet and the ring is full.
+ ******************************************************************************/
+static struct LogRecord *log_claim(struct LogRing *ring, int policy) {
+	size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	for (;;) {
+		struct LogSlot *slot = &ring->slots[pos & ring->mask];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				slot->pos = pos;
+				return &slot->rec;
+			}
+		} else if (diff < 0) {
+			if (policy == LOG_FULL_DROP) {
+				atomic_fetch_add_explicit(&ring->drops, 1, memory_order_relaxed);
+				return NULL;
+			}
+			sched_yield();
+			pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		} else
+			pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	}
+}
+
+struct LogRecord *log_reserve(struct LogRing *ring) {
+	return log_claim(ring, ring->policy);
+}
+
+struct LogRecord *log_try_reserve(struct LogRing *ring) {
+	return log_claim(ring, LOG_FULL_DROP);
+}
+
+void log_commit(struct LogRing *ring, struct LogRecord *rec) {
+	struct LogSlot *slot = (struct LogSlot *)((char*)rec - offsetof(struct LogSlot, rec));
+	struct LogWriter *writer = ring->writer;
+
+	if (writer && writer->latency)
+		slot->queued = clock_us();
+	atomic_store_explicit(&slot->seq, slot->pos + 1, memory_order_release);
+
+	/* pairs with the fence in the writer before it goes to sleep: either
+	 * we see it sleeping, or it sees our record */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (writer && atomic_load_explicit(&writer->sleeping, memory_order_relaxed)) {
+		uint64_t one = 1;
+		if (write(writer->efd, &one, sizeof(one)) < 0)
+			; /* it's already been kicked */
+	}
+}
+
+/******************************************************************************
+ * Write out everything in the writer's buffer
+ ******************************************************************************/
+static void log_written(struct LogWriter *writer) {
+	uint64_t now;
+	unsigned i;
+
+	writer->length = 0;
+	if (writer->pending == 0)
+		return;
+	now = clock_us();
+	for (i = 0; i < writer->pending; i++)
+		histogram_record(writer->latency, now - writer->queued[i]);
+	writer->pending = 0;
+}
+
+static void write_all(int fd, const char *buf, size_t length) {
+	size_t offset = 0;
+
+	while (offset < length) {
+		ssize_t len = write(fd, buf + offset, length - offset);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			break; /* nowhere to put it, so lose it */
+		}
+		offset += len;
+	}
+}
+
+static void log_flush_events(struct LogWriter *writer) {
+	write_all(STDERR_FILENO, writer->events, writer->events_length);
+	writer->events_length = 0;
+}
+
+static void log_flush(struct LogWriter *writer) {
+	if (writer->events_length)
+		log_flush_events(writer);
+
+	if (writer->segments) {
+		if (writer->length)
+			segment_write(writer->segments, writer->buf, writer->length);
+		log_written(writer);
+		return;
+	}
+
+	write_all(writer->fd, writer->buf, writer->length);
+	log_written(writer);
+}
+
+/******************************************************************************
+ * Take the record at 'tail', if it has been published
+ ******************************************************************************/
+static int log_drain_one(struct LogRing *ring, struct LogWriter *writer) {
+	struct LogSlot *slot = &ring->slots[ring->tail & ring->mask];
+	size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+	if (seq != ring->tail + 1)
+		return 0;
+	if (slot->rec.type == LOG_EVENT) {
+		if (writer->events_length + RECORD_EVENT_MAX > sizeof(writer->events))
+			log_flush_events(writer);
+		writer->events_length += record_format_text(writer->events + writer->events_length,
+				&slot->rec, NULL);
+		goto done;
+	}
+	if (writer->length + RECORD_MAX > sizeof(writer->buf) || writer->pending == LOG_PENDING)
+		log_flush(writer);
+	if (writer->latency)
+		writer->queued[writer->pending++] = slot->queued;
+	if (writer->geo && (slot->rec.type == LOG_CSV || slot->rec.type == LOG_IP
+			|| slot->rec.type == LOG_CAPTURE)) {
+		const struct GeoValue *value = geo_lookup(writer->geo, slot->rec.addr);
+
+		slot->rec.asn = value->asn;
+		memcpy(slot->rec.country, value->country, 2);
+		slot->rec.flags |= RECORD_FLAG_GEO;
+	}
+	if (writer->format == FORMAT_BINARY)
+		writer->length += record_format_binary((unsigned char*)writer->buf + writer->length, &slot->rec);
+	else
+		writer->length += record_format_text(writer->buf + writer->length, &slot->rec,
+				writer->format == FORMAT_TEXT_TIME ? &writer->clock : NULL);
+done:
+	/* a capture's bytes were handed over with the record; and the slot
+	 * goes back with no flags, capture or local port, so producers that
+	 * don't use them needn't clear them */
+	if (slot->rec.capture) {
+		free(slot->rec.capture);
+		slot->rec.capture = NULL;
+	}
+	slot->rec.flags = 0;
+	slot->rec.local_port = 0;
+	atomic_store_explicit(&slot->seq, ring->tail + ring->mask + 1, memory_order_release);
+	ring->tail++;
+	return 1;
+}
+
+static int log_ring_empty(struct LogRing *ring) {
+	struct LogSlot *slot = &ring->slots[ring->tail & ring->mask];
+	return atomic_load_explicit(&slot->seq, memory_order_acquire) != ring->tail + 1;
+}
+
+/******************************************************************************
+ * The writer thread. Drain everything that's there, from every ring, flush
+ * it in one go, then sleep until a producer kicks us.
+ ******************************************************************************/
+static void *log_writer_thread(void *v_writer) {
+	struct LogWriter *writer = (struct LogWriter *)v_writer;
+
+	if (writer->hold >= 0) {
+		char c;
+		ssize_t n;
+
+		do
+			n = read(writer->hold, &c, 1);
+		while (n > 0 || (n < 0 && errno == EINTR));
+		close(writer->hold);
+	}
+
+	for (;;) {
+		unsigned long long drops = 0;
+		uint64_t count;
+		int timeout = -1;
+		int stopping = atomic_load(&writer->stopping);
+		int busy;
+		unsigned i;
+
+		do {
+			busy = 0;
+			for (i = 0; i < writer->ring_count; i++) {
+				unsigned n;
+				for (n = 0; n < LOG_BATCH && log_drain_one(writer->rings[i], writer); n++)
+					;
+				busy |= (n == LOG_BATCH);
+			}
+		} while (busy);
+		log_flush(writer);
+
+		for (i = 0; i < writer->ring_count; i++)
+			drops += atomic_load_explicit(&writer->rings[i]->drops, memory_order_relaxed);
+		if (drops != writer->reported_drops) {
+			fprintf(stderr, "log,dropped %llu records, ring full\n",
+				drops - writer->reported_drops);
+			writer->reported_drops = drops;
+		}
+
+		/* told to stop before that lot, so it was the last of it */
+		if (stopping) {
+			if (writer->segments)
+				segment_close(writer->segments);
+			break;
+		}
+
+		/* segments need syncing and rotating even when nothing comes in */
+		if (writer->segments)
+			timeout = segment_tick(writer->segments);
+
+		atomic_store(&writer->sleeping, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		for (i = 0; i < writer->ring_count; i++) {
+			if (!log_ring_empty(writer->rings[i]))
+				break;
+		}
+		if (i == writer->ring_count) {
+			struct pollfd pfd = {writer->efd, POLLIN, 0};
+			if (poll(&pfd, 1, timeout) > 0 && read(writer->efd, &count, sizeof(count)) < 0)
+				; /* interrupted: just look again */
+		}
+		atomic_store(&writer->sleeping, 0);
+	}
+	return NULL;
+}
+
+/******************************************************************************
+ ******************************************************************************/
+int log_writer_start(struct LogRing **rings, unsigned count, int fd, int hold,
+	struct SegmentLog *segments, int format, struct Histogram *latency,
+	const struct GeoDb *geo) {
+	struct LogWriter *writer;
+	unsigned i;
+
+	writer = aligned_alloc(64, sizeof(*writer));
+	if (writer == NULL)
+		return -1;
+	memset(writer, 0, sizeof(*writer));
+	writer->efd = eventfd(0, EFD_CLOEXEC);
+	if (writer->efd < 0) {
+		free(writer);
+		return -1;
+	}
+	writer->fd = fd;
+	writer->hold = hold;
+	writer->segments = segments;
+	writer->format = format;
+	writer->latency = latency;
+	writer->geo = geo;
+	record_clock_init(&writer->clock);
+	writer->rings = rings;
+	writer->ring_count = count;
+	for (i = 0; i < count; i++)
+		rings[i]->writer = writer;
+
+	if (pthread_create(&writer->handle, 0, log_writer_thread, writer) != 0) {
+		for (i = 0; i < count; i++)
+			rings[i]->writer = NULL;
+		close(writer->efd);
+		free(writer);
+		return -1;
+	}
+	return 0;
+}
+
+void log_writer_stop(struct LogRing *ring) {
+	struct LogWriter *writer = ring->writer;
+	uint64_t one = 1;
+
+	atomic_store(&writer->stopping, 1);
+	if (write(writer->efd, &one, sizeof(one)) < 0)
+		; /* it's awake anyway */
+	pthread_join(writer->handle, NULL);
+}
@@ -0,0 +1,86 @@
+#ifndef LOGRING_H
+#define LOGRING_H
+#include <stddef.h>
+#include <stdatomic.h>
+#include "record.h"
+#include "segment.h"
+#include "histogram.h"
+#include "geo.h"
+
+/******************************************************************************
+ * What producers do when the ring is full
+ ******************************************************************************/
+enum {
+	LOG_FULL_DROP,	/* throw the record away, and count it */
+	LOG_FULL_BLOCK,	/* wait for the writer to make room */
+};
+
+/******************************************************************************
+ * A bounded multi-producer, single-consumer ring of records. Each slot has
+ * a sequence number that says whose turn it is: producers claim a slot by
+ * bumping 'head', fill it in without any lock, and publish it by bumping
+ * the slot's sequence; the writer thread does the reverse at 'tail'.
+ ******************************************************************************/
+struct LogSlot {
+	atomic_size_t seq;
+	size_t pos;
+	uint64_t queued;	/* microseconds, when it was committed */
+	struct LogRecord rec;
+};
+
+struct LogRing {
+	_Alignas(64) atomic_size_t head;
+	_Alignas(64) size_t tail;
+	_Alignas(64) atomic_ullong drops;
+	size_t mask;
+	int policy;
+	struct LogWriter *writer;
+	struct LogSlot *slots;
+};
+
+/******************************************************************************
+ * Create a ring for 'count' records, which must be a power of two
+ ******************************************************************************/
+struct LogRing *log_ring_create(size_t count, int policy);
+
+/******************************************************************************
+ * Claim a slot for a record. Returns the record to fill in, to be handed
+ * back with log_commit(), or NULL if the ring is full and the policy is to
+ * drop. The record's 'flags' are 0 and its 'capture' NULL unless the
+ * producer sets them; 'capture' is memory from malloc() that the writer
+ * frees once the record is written out.
+ ******************************************************************************/
+struct LogRecord *log_reserve(struct LogRing *ring);
+void log_commit(struct LogRing *ring, struct LogRecord *rec);
+
+/* The same, but drops when the ring is full whatever the policy, for
+ * records like LOG_EVENT that aren't worth stalling a loop for */
+struct LogRecord *log_try_reserve(struct LogRing *ring);
+
+/******************************************************************************
+ * Start the thread that drains the rings to 'fd', or to 'segments' if that
+ * isn't NULL, in the given FORMAT_xxx. There is usually one ring per event
+ * loop, so that producers never share one. Output is buffered and flushed
+ * whenever the rings run dry, so bursts go out in large writes. If
+ * 'latency' isn't NULL, records are timed from being committed to being
+ * written out, into that histogram. LOG_EVENT records go to stderr instead,
+ * as text, in writes of their own. A binary stream's header isn't written
+ * here, since a stream we take over from another process already has one.
+ * If 'geo' isn't NULL, the records with an address get its ASN and country
+ * from there, looked up here so that the event loops never wait on it.
+ * If 'hold' isn't -1, nothing is written until it reads end-of-file, which
+ * is how a process taking over 'fd' waits for the one before it to finish
+ * with it; records wait in the rings meanwhile, and 'hold' is closed.
+ ******************************************************************************/
+int log_writer_start(struct LogRing **rings, unsigned count, int fd, int hold,
+	struct SegmentLog *segments, int format, struct Histogram *latency,
+	const struct GeoDb *geo);
+
+/******************************************************************************
+ * Stop the writer that drains 'ring', once it has written out everything
+ * in all of its rings, closing the segment files if there are any. Nothing
+ * may be producing records by then.
+ ******************************************************************************/
+void log_writer_stop(struct LogRing *ring);
+
+#endif
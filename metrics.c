@@ -0,0 +1,181 @@
+/******************************************************************************
+ * The metrics endpoint. See metrics.h. This is deliberately dumb: one
+ * request at a time, whatever was asked for, and the connection closed
+ * after the answer. Scrapes come every few seconds, not thousands a second.
+ ******************************************************************************/
+#define _GNU_SOURCE
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* The largest page we'll render */
+#define METRICS_MAX (256 * 1024)
+
+struct Metrics {
+	int fd;
+	size_t (*render)(char *dst, size_t size, void *arg);
+	void *arg;
+	char *page;
+};
+
+static int metrics_listen(const char *where) {
+	int fd;
+
+	if (where[0] == '/') {
+		struct sockaddr_un addr;
+
+		if (strlen(where) >= sizeof(addr.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, where);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -1;
+		unlink(where);
+		if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+			goto fail;
+	} else {
+		struct sockaddr_in addr;
+		const char *colon = strchr(where, ':');
+		char host[INET_ADDRSTRLEN];
+		unsigned long port;
+		int yes = 1;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (colon) {
+			if ((size_t)(colon - where) >= sizeof(host)) {
+				errno = EINVAL;
+				return -1;
+			}
+			memcpy(host, where, colon - where);
+			host[colon - where] = '\0';
+			if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+				errno = EINVAL;
+				return -1;
+			}
+			where = colon + 1;
+		}
+		port = strtoul(where, 0, 0);
+		if (port < 1 || port > 65535) {
+			errno = EINVAL;
+			return -1;
+		}
+		addr.sin_port = htons((unsigned short)port);
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		/* so that on a reload, the new process can listen while the old
+		 * one finishes; a Unix socket is just unlinked from under it */
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+		if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+			goto fail;
+	}
+	if (listen(fd, 16) < 0)
+		goto fail;
+	return fd;
+fail:
+	{
+		int err = errno;
+		close(fd);
+		errno = err;
+	}
+	return -1;
+}
+
+/******************************************************************************
+ * Answer one request. We don't care what was asked for, but we read it
+ * first, so that closing doesn't reset the connection under the reply.
+ ******************************************************************************/
+static void metrics_serve(struct Metrics *m, int fd) {
+	struct timeval tv = {1, 0};
+	char request[4096];
+	char header[160];
+	size_t length;
+	size_t offset;
+	int header_length;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (recv(fd, request, sizeof(request), 0) <= 0)
+		return;
+
+	length = m->render(m->page, METRICS_MAX, m->arg);
+	header_length = snprintf(header, sizeof(header),
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n"
+		"Connection: close\r\n"
+		"\r\n", length);
+	if (send(fd, header, header_length, MSG_NOSIGNAL) != header_length)
+		return;
+	for (offset = 0; offset < length; ) {
+		ssize_t n = send(fd, m->page + offset, length - offset, MSG_NOSIGNAL);
+		if (n <= 0)
+			return;
+		offset += n;
+	}
+}
+
+static void *metrics_thread(void *v_metrics) {
+	struct Metrics *m = (struct Metrics *)v_metrics;
+
+	for (;;) {
+		int fd = accept4(m->fd, NULL, NULL, SOCK_CLOEXEC);
+
+		if (fd < 0) {
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+				usleep(100000);
+			continue;
+		}
+		metrics_serve(m, fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+int metrics_start(const char *where, size_t (*render)(char *dst, size_t size, void *arg), void *arg) {
+	struct Metrics *m;
+	pthread_t handle;
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL)
+		return -1;
+	m->page = malloc(METRICS_MAX);
+	if (m->page == NULL) {
+		free(m);
+		return -1;
+	}
+	m->render = render;
+	m->arg = arg;
+	m->fd = metrics_listen(where);
+	if (m->fd < 0) {
+		int err = errno;
+		free(m->page);
+		free(m);
+		errno = err;
+		return -1;
+	}
+	if (pthread_create(&handle, 0, metrics_thread, m) != 0) {
+		close(m->fd);
+		free(m->page);
+		free(m);
+		return -1;
+	}
+	pthread_detach(handle);
+	return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <stddef.h>
+#include <stdatomic.h>
+
+/******************************************************************************
+ * Counters that one thread updates and another reads. Each event loop keeps
+ * its own, on cache lines of their own, so updating one is a plain load and
+ * store: no lock, no locked instruction, and no line shared between CPUs.
+ * They're only added up when somebody asks for them.
+ ******************************************************************************/
+static inline void stat_add(atomic_ullong *counter, unsigned long long n) {
+	atomic_store_explicit(counter,
+		atomic_load_explicit(counter, memory_order_relaxed) + n,
+		memory_order_relaxed);
+}
+
+static inline void stat_set(atomic_ullong *counter, unsigned long long n) {
+	atomic_store_explicit(counter, n, memory_order_relaxed);
+}
+
+static inline unsigned long long stat_get(atomic_ullong *counter) {
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/******************************************************************************
+ * Serve metrics over HTTP, in the Prometheus text format, from a thread of
+ * its own. 'where' is a path for a Unix socket if it starts with '/', and
+ * otherwise a TCP port, optionally after an IPv4 address (127.0.0.1 if not
+ * given). Each request calls 'render' to fill in the page, which returns
+ * the length it used, at most 'size'. Returns -1 if we can't listen.
+ ******************************************************************************/
+int metrics_start(const char *where, size_t (*render)(char *dst, size_t size, void *arg), void *arg);
+
+#endif
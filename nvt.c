@@ -0,0 +1,154 @@
+/******************************************************************************
+ * The NVT (telnet) input state machine. This used to live in recv_nvt_line(),
+ * which fed it one recv() per byte. It now works on whatever buffer the
+ * caller drained from the socket, so that one read can carry a whole line.
+ ******************************************************************************/
+#include "nvt.h"
+
+/******************************************************************************
+ * Append one or two bytes of echo
+ ******************************************************************************/
+static void echo_append(struct NvtEcho *echo, const char *str, size_t len) {
+	size_t i;
+
+	if (echo == NULL)
+		return;
+	for (i = 0; i < len; i++)
+		echo->buf[echo->length++] = str[i];
+}
+
+/* Keep a data byte, if there's room for it */
+static void capture_append(struct NvtEcho *capture, unsigned char c) {
+	if (capture && capture->length < capture->max)
+		capture->buf[capture->length++] = c;
+}
+
+/******************************************************************************
+ * State 0 reads a line with echo (the login), state 1 without (the password),
+ * state 2 is after an IAC, states 3-6 are waiting for the option byte after
+ * WILL/WON'T/DO/DON'T, and states 20/21 are inside a subnegotiation.
+ ******************************************************************************/
+size_t nvt_parse(int *in_state, char *buf, int sizeof_buf, int *line_length,
+	const unsigned char *px, size_t length, struct NvtEcho *echo, int *is_done,
+	struct NvtEcho *capture) {
+	int offset = *line_length;
+	int state = *in_state;
+	int done = 0;
+	size_t i;
+
+	for (i = 0; i < length && !done; i++) {
+		unsigned char c = px[i];
+
+		/* Don't start on a byte whose echo might not fit */
+		if (echo && echo->length + NVT_ECHO_MAX > echo->max)
+			break;
+
+		/* Handle the NVT state-machine */
+		switch (state) {
+		case 0:
+		case 1:
+			if (c != 0xFF)
+				capture_append(capture, c);
+			if (c == 0xFF) {
+				state = 2;
+			} else if (c == 0) {
+			} else if (c == '\n') {
+			} else if (c == '\r') {
+				done = NVT_LINE;
+				break;
+			} else if (c == '\x7f') {
+				if (offset) {
+					offset--;
+					if (state == 0)
+						echo_append(echo, "\b \b", 3);
+				}
+				break;
+			} else {
+				/************************************************************
+				 * This is where we append the byte onto our username/password
+				 ************************************************************/
+				if (offset + 1 < sizeof_buf)
+					buf[offset++] = c;
+				else
+					done = NVT_OVERFLOW;
+				if (state == 0) {
+					if (c <= 26) {
+						char zz[2];
+
+						zz[0] = '^';
+						zz[1] = c + 'A' - 1;
+						echo_append(echo, zz, 2);
+					} else
+						echo_append(echo, (const char*)&c, 1);
+				}
+				if ((c == 3 /*ctrl-c*/ || c == 4 /*ctrl-d*/) && !done)
+					done = NVT_LINE;
+			}
+			break;
+		case 2: /* IAC escape */
+			switch (c) {
+			case 250: /* subneg */
+				state = 20;
+				break;
+			case 251: /* will */
+				state = 3;
+				break;
+			case 252: /* won't */
+				state = 4;
+				break;
+			case 253: /* do */
+				state = 5;
+				break;
+			case 254: /* don't */
+				state = 6;
+				break;
+			case 255:
+				capture_append(capture, 0xFF);
+				if (offset + 1 < sizeof_buf)
+					buf[offset++] = 0xFF;
+				state = 0;
+				break;
+			default:
+				state = 0;
+				break;
+			}
+			break;
+		case 20: /*sub neg start */
+			switch (c) {
+			case 0xff: /*iac*/
+				state = 21;
+				break;
+			default:
+				/* do nothing */
+				break;
+			}
+			break;
+		case 21:
+			switch (c) {
+			case 240:
+				state = 0;
+				break;
+			default:
+				state = 20; /* go back to subnegotiation */
+				break;
+			}
+			break;
+		case 3: /* will */
+		case 4: /* won't */
+		case 5: /* do */
+		case 6: /* don't */
+			state = 0;
+			break;
+		default:
+			/* unknown state, can only be a bug: start over */
+			state = 0;
+			break;
+		}
+	}
+
+	/* save the state across multiple calls */
+	*line_length = offset;
+	*in_state = state;
+	*is_done = done;
+	return i;
+}
@@ -0,0 +1,53 @@
+#ifndef NVT_H
+#define NVT_H
+#include <stddef.h>
+
+/******************************************************************************
+ * The most echo output a single input byte can produce ("\b \b" for a
+ * backspace). The parser stops short of the end of the echo buffer so
+ * that it never has to split one.
+ ******************************************************************************/
+#define NVT_ECHO_MAX 3
+
+/******************************************************************************
+ * Where the parser puts the characters it echoes back to the other side.
+ * The caller sends 'buf[0..length]' when parsing is done, then resets
+ * 'length'.
+ ******************************************************************************/
+struct NvtEcho {
+	unsigned char *buf;
+	size_t length;
+	size_t max;
+};
+
+/******************************************************************************
+ * What '*is_done' says about a finished line: that it ended the normal way,
+ * or that it was cut off because the next byte wouldn't fit in 'line'. The
+ * byte that didn't fit is lost, and the parser carries on with a new line.
+ ******************************************************************************/
+enum {
+	NVT_LINE = 1,
+	NVT_OVERFLOW = 2,
+};
+
+/******************************************************************************
+ * Parse NVT input from a buffer, until the <return> that ends the line, while
+ * stepping over any option negotiation along the way. The NVT state and the
+ * partial line are saved in 'state' and 'line_length', so parsing can resume
+ * on the next buffer. No I/O is done here.
+ *
+ * Returns the number of bytes consumed. If that is less than 'length', either
+ * the line is complete ('*is_done' is set, to NVT_LINE or NVT_OVERFLOW; the
+ * rest of the buffer belongs to whatever comes next) or the echo buffer
+ * filled up.
+ *
+ * If 'capture' isn't NULL, every data byte goes there too, as it was sent:
+ * returns, NULs and deletes included, only the option negotiation taken
+ * out. Unlike the echo, a full capture buffer doesn't stop the parser; the
+ * bytes that don't fit are just lost.
+ ******************************************************************************/
+size_t nvt_parse(int *state, char *line, int sizeof_line, int *line_length,
+	const unsigned char *px, size_t length, struct NvtEcho *echo, int *is_done,
+	struct NvtEcho *capture);
+
+#endif
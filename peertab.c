@@ -0,0 +1,154 @@
+/******************************************************************************
+ * Per-address admission table. See peertab.h.
+ ******************************************************************************/
+#include "peertab.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+int peertab_init(struct PeerTable *table, size_t size,
+	unsigned rate, unsigned burst, unsigned max_active) {
+	size_t sets = 1;
+	size_t i;
+
+	while (sets * PEER_WAYS < size)
+		sets *= 2;
+	memset(table, 0, sizeof(*table));
+	table->sets = aligned_alloc(64, sets * sizeof(table->sets[0]));
+	if (table->sets == NULL)
+		return -1;
+	memset(table->sets, 0, sets * sizeof(table->sets[0]));
+	for (i = 0; i < sets; i++)
+		atomic_flag_clear(&table->sets[i].lock);
+	table->mask = sets - 1;
+	table->seed = (uint64_t)time(0) << 20 ^ (uint64_t)getpid();
+	table->rate = rate;
+	table->burst = burst;
+	table->max_active = max_active;
+	return 0;
+}
+
+/******************************************************************************
+ * The key is the address, except that an IPv6 host can pick any address in
+ * its /64, so for IPv6 only the /64 counts. IPv4 arrives as ::ffff:a.b.c.d.
+ ******************************************************************************/
+static void peer_key(unsigned char key[16], const unsigned char addr[16]) {
+	static const unsigned char mapped[12] = {0,0,0,0, 0,0,0,0, 0,0,0xFF,0xFF};
+
+	memcpy(key, addr, 16);
+	if (memcmp(addr, mapped, sizeof(mapped)) != 0)
+		memset(key + 8, 0, 8);
+}
+
+static struct PeerSet *peer_set(struct PeerTable *table, const unsigned char key[16]) {
+	uint64_t a, b, h;
+
+	memcpy(&a, key, 8);
+	memcpy(&b, key + 8, 8);
+	h = (a ^ table->seed) * 0x9E3779B97F4A7C15ULL;
+	h = (h ^ b ^ h >> 29) * 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 32;
+	return &table->sets[h & table->mask];
+}
+
+static void peer_lock(struct PeerSet *set) {
+	while (atomic_flag_test_and_set_explicit(&set->lock, memory_order_acquire))
+		;
+}
+
+static void peer_unlock(struct PeerSet *set) {
+	atomic_flag_clear_explicit(&set->lock, memory_order_release);
+}
+
+static struct PeerEntry *peer_find(struct PeerSet *set, const unsigned char key[16]) {
+	unsigned i;
+
+	for (i = 0; i < PEER_WAYS; i++) {
+		struct PeerEntry *e = &set->ways[i];
+		if (e->last && memcmp(e->addr, key, 16) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+/******************************************************************************
+ * The entry to give a new address: an empty one, else the least recently
+ * seen with no sessions open, else the least recently seen. Evicting one
+ * with sessions open forgets them, which only makes us more lenient.
+ ******************************************************************************/
+static struct PeerEntry *peer_victim(struct PeerSet *set) {
+	struct PeerEntry *idle = NULL;
+	struct PeerEntry *oldest = NULL;
+	unsigned i;
+
+	for (i = 0; i < PEER_WAYS; i++) {
+		struct PeerEntry *e = &set->ways[i];
+
+		if (e->last == 0)
+			return e;
+		if (e->active == 0 && (idle == NULL || e->last < idle->last))
+			idle = e;
+		if (oldest == NULL || e->last < oldest->last)
+			oldest = e;
+	}
+	return idle ? idle : oldest;
+}
+
+int peertab_admit(struct PeerTable *table, const unsigned char addr[16], uint64_t now) {
+	unsigned char key[16];
+	struct PeerSet *set;
+	struct PeerEntry *e;
+	uint64_t full = (uint64_t)table->burst * 1000;
+	int result = PEER_OK;
+
+	if (now == 0)
+		now = 1;
+	peer_key(key, addr);
+	set = peer_set(table, key);
+
+	peer_lock(set);
+	e = peer_find(set, key);
+	if (e == NULL) {
+		e = peer_victim(set);
+		memcpy(e->addr, key, 16);
+		e->tokens = (uint32_t)full;
+		e->active = 0;
+	} else if (now > e->last) {
+		/* 'rate' connections a second is 'rate' thousandths a millisecond */
+		uint64_t add = (now - e->last) * table->rate;
+
+		if (add > full - e->tokens)
+			e->tokens = (uint32_t)full;
+		else
+			e->tokens += (uint32_t)add;
+	}
+	e->last = now;
+
+	if (table->max_active && e->active >= table->max_active)
+		result = PEER_BUSY;
+	else if (table->rate && e->tokens < 1000)
+		result = PEER_RATE;
+	else {
+		if (table->rate)
+			e->tokens -= 1000;
+		e->active++;
+	}
+	peer_unlock(set);
+	return result;
+}
+
+void peertab_release(struct PeerTable *table, const unsigned char addr[16]) {
+	unsigned char key[16];
+	struct PeerSet *set;
+	struct PeerEntry *e;
+
+	peer_key(key, addr);
+	set = peer_set(table, key);
+
+	peer_lock(set);
+	e = peer_find(set, key);
+	if (e && e->active)
+		e->active--;
+	peer_unlock(set);
+}
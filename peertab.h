@@ -0,0 +1,64 @@
+#ifndef PEERTAB_H
+#define PEERTAB_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/******************************************************************************
+ * Per-address admission: a token bucket for the connection rate, and a
+ * count of sessions still open, for each source address. SO_REUSEPORT
+ * spreads one address's connections over every event loop, so there is one
+ * table for all of them.
+ *
+ * It's a fixed-size, set-associative table: an address can only live in
+ * one set of PEER_WAYS entries, each set has a spinlock of its own, and
+ * when a set is full the least recently seen entry is evicted (preferring
+ * ones with no open sessions). Nothing is allocated after startup, and an
+ * admission is a hash, a lock nobody else is likely to hold, and a scan of
+ * a couple of cache lines.
+ ******************************************************************************/
+#define PEER_WAYS 4
+
+enum {
+	PEER_OK,	/* go ahead, and call peertab_release() when done */
+	PEER_RATE,	/* connecting faster than the rate allows */
+	PEER_BUSY,	/* too many sessions open already */
+};
+
+struct PeerEntry {
+	unsigned char addr[16];
+	uint64_t last;		/* ms, when tokens were last topped up; 0 if empty */
+	uint32_t tokens;	/* thousandths of a connection */
+	uint32_t active;	/* sessions open */
+};
+
+struct PeerSet {
+	_Alignas(64) atomic_flag lock;
+	struct PeerEntry ways[PEER_WAYS];
+};
+
+struct PeerTable {
+	struct PeerSet *sets;
+	size_t mask;
+	uint64_t seed;
+	unsigned rate;		/* connections per second, 0 for no limit */
+	unsigned burst;		/* connections allowed at once, above the rate */
+	unsigned max_active;	/* sessions open at once, 0 for no limit */
+};
+
+/******************************************************************************
+ * 'size' is the number of addresses to track, rounded up to a power of two
+ ******************************************************************************/
+int peertab_init(struct PeerTable *table, size_t size,
+	unsigned rate, unsigned burst, unsigned max_active);
+
+/******************************************************************************
+ * Whether a connection just accepted from 'addr' can go ahead. 'now' is a
+ * monotonic time in milliseconds.
+ ******************************************************************************/
+int peertab_admit(struct PeerTable *table, const unsigned char addr[16], uint64_t now);
+
+/* A session admitted with PEER_OK has closed */
+void peertab_release(struct PeerTable *table, const unsigned char addr[16]);
+
+#endif
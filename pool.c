@@ -0,0 +1,61 @@
+/******************************************************************************
+ * Fixed-size object pool. See pool.h.
+ ******************************************************************************/
+#include "pool.h"
+#include <string.h>
+#include <sys/mman.h>
+
+/* Slabs are this big, unless one object is bigger than that */
+#define SLAB_SIZE (256 * 1024)
+
+void pool_init(struct Pool *pool, size_t size, unsigned max) {
+	memset(pool, 0, sizeof(*pool));
+	if (size < sizeof(void*))
+		size = sizeof(void*);
+	pool->size = (size + 63) & ~(size_t)63;
+	pool->slab_size = (pool->size > SLAB_SIZE) ? pool->size : SLAB_SIZE;
+	pool->max = max;
+}
+
+/******************************************************************************
+ * Map a new slab. Slabs come straight from mmap() so that they don't
+ * fragment the heap, and aren't touched until objects are handed out.
+ ******************************************************************************/
+static int pool_grow(struct Pool *pool) {
+	void *slab;
+
+	slab = mmap(NULL, pool->slab_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slab == MAP_FAILED)
+		return -1;
+	pool->next = slab;
+	pool->end = (char*)slab + pool->slab_size - (pool->slab_size % pool->size);
+	return 0;
+}
+
+void *pool_alloc(struct Pool *pool) {
+	void *obj;
+
+	if (pool->max && pool->count >= pool->max)
+		return NULL;
+
+	if (pool->free) {
+		obj = pool->free;
+		pool->free = *(void**)obj;
+	} else {
+		if (pool->next == pool->end && pool_grow(pool) < 0)
+			return NULL;
+		obj = pool->next;
+		pool->next += pool->size;
+		pool->capacity++;
+	}
+	pool->count++;
+	memset(obj, 0, pool->size);
+	return obj;
+}
+
+void pool_free(struct Pool *pool, void *obj) {
+	*(void**)obj = pool->free;
+	pool->free = obj;
+	pool->count--;
+}
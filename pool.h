@@ -0,0 +1,34 @@
+#ifndef POOL_H
+#define POOL_H
+#include <stddef.h>
+
+/******************************************************************************
+ * A pool of fixed-size objects, carved out of large slabs that are never
+ * given back. Freed objects go on a free list and are handed out again
+ * first, so once the pool has grown to its working size, allocating and
+ * freeing are a couple of pointer moves. There's no locking: each thread
+ * has pools of its own. 'max' is a hard cap on how many objects can be out
+ * at once, so the memory used is bounded no matter what the traffic does.
+ ******************************************************************************/
+struct Pool {
+	size_t size;		/* object size, rounded up for alignment */
+	size_t slab_size;
+	unsigned max;		/* cap on objects in use, 0 for none */
+	unsigned count;		/* objects in use */
+	unsigned capacity;	/* objects carved from slabs so far */
+	void *free;		/* free list, linked through the objects */
+	char *next;		/* unused space in the newest slab */
+	char *end;
+};
+
+void pool_init(struct Pool *pool, size_t size, unsigned max);
+
+/******************************************************************************
+ * Get an object, zeroed. Returns NULL when 'max' objects are already in use,
+ * or we're out of memory.
+ ******************************************************************************/
+void *pool_alloc(struct Pool *pool);
+
+void pool_free(struct Pool *pool, void *obj);
+
+#endif
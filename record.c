@@ -0,0 +1,446 @@
+/******************************************************************************
+ * Serializing output records, as text or binary. The log writer uses this
+ * to write records out, and telnetlogger-decode uses it to turn binary logs
+ * back into text, so both produce exactly the same lines.
+ ******************************************************************************/
+#include "record.h"
+#include "format.h"
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+void record_clock_init(struct RecordClock *clock) {
+	clock->second = UINT64_MAX;
+	clock->length = 0;
+}
+
+/******************************************************************************
+ * Format the record's time. gmtime_r() and strftime() only run when the
+ * second changes.
+ ******************************************************************************/
+static size_t format_time(char *dst, struct RecordClock *clock, uint64_t time) {
+	uint64_t second = time / 1000;
+	unsigned ms = (unsigned)(time % 1000);
+	size_t d;
+
+	if (second != clock->second) {
+		time_t t = (time_t)second;
+		struct tm tm;
+
+		gmtime_r(&t, &tm);
+		clock->length = strftime(clock->text, sizeof(clock->text), "%Y-%m-%dT%H:%M:%S", &tm);
+		clock->second = second;
+	}
+
+	memcpy(dst, clock->text, clock->length);
+	d = clock->length;
+	dst[d++] = '.';
+	dst[d++] = '0' + ms / 100;
+	dst[d++] = '0' + ms / 10 % 10;
+	dst[d++] = '0' + ms % 10;
+	dst[d++] = 'Z';
+	return d;
+}
+
+static const unsigned char zero_addr[16];
+
+static size_t format_session(char *dst, uint64_t x) {
+	static const char hex[] = "0123456789abcdef";
+	unsigned i;
+
+	for (i = 0; i < 16; i++)
+		dst[i] = hex[(x >> (60 - 4 * i)) & 0xF];
+	return 16;
+}
+
+static size_t format_count(char *dst, unsigned x) {
+	char tmp[10];
+	size_t n = 0;
+	size_t d;
+
+	do {
+		tmp[n++] = '0' + x % 10;
+		x /= 10;
+	} while (x);
+	for (d = 0; d < n; d++)
+		dst[d] = tmp[n - 1 - d];
+	return n;
+}
+
+/* With more than one listener, a ',port' on the end says which it was */
+static size_t format_local_port(char *dst, const struct LogRecord *rec) {
+	if (rec->local_port == 0)
+		return 0;
+	dst[0] = ',';
+	return 1 + format_count(dst + 1, rec->local_port);
+}
+
+/* With -g, ',asn,country' on the very end, '0' and '--' if we don't know */
+static size_t format_geo(char *dst, const struct LogRecord *rec) {
+	size_t d = 0;
+
+	if (!(rec->flags & RECORD_FLAG_GEO))
+		return 0;
+	dst[d++] = ',';
+	d += format_count(dst + d, rec->asn);
+	dst[d++] = ',';
+	dst[d++] = rec->country[0] ? rec->country[0] : '-';
+	dst[d++] = rec->country[1] ? rec->country[1] : '-';
+	return d;
+}
+
+/******************************************************************************
+ * Format one record as text. This is what the print_xxx() functions used to
+ * do directly, under a mutex, with an fflush() after every line.
+ ******************************************************************************/
+size_t record_format_text(char *dst, const struct LogRecord *rec, struct RecordClock *clock) {
+	size_t d = 0;
+
+	if (clock && rec->type != LOG_AGG && rec->type != LOG_EVENT && rec->type != LOG_TOP) {
+		d += format_time(dst + d, clock, rec->time);
+		dst[d++] = ',';
+	}
+
+	switch (rec->type) {
+	case LOG_CSV:
+		d += format_addr(dst + d, rec->addr);
+		dst[d++] = ',';
+		d += print_string(dst + d, rec->login, rec->login_length);
+		dst[d++] = ',';
+		d += print_string(dst + d, rec->password, rec->password_length);
+		if (rec->flags & RECORD_FLAG_SESSION) {
+			dst[d++] = ',';
+			d += format_session(dst + d, rec->session);
+		}
+		d += format_local_port(dst + d, rec);
+		d += format_geo(dst + d, rec);
+		dst[d++] = '\n';
+		break;
+	case LOG_PASSWORDS:
+		/* pretty print the two fields */
+		d += print_string(dst + d, rec->login, rec->login_length);
+		dst[d++] = ' ';
+		d += print_string(dst + d, rec->password, rec->password_length);
+		dst[d++] = '\n';
+		break;
+	case LOG_IP:
+		d += format_addr(dst + d, rec->addr);
+		d += format_local_port(dst + d, rec);
+		d += format_geo(dst + d, rec);
+		dst[d++] = '\n';
+		break;
+	case LOG_AGG:
+	{
+		/* this has its own times, so no prefix, but they always get
+		 * formatted: as numbers they'd be no use to anyone */
+		struct RecordClock local;
+
+		if (clock == NULL) {
+			record_clock_init(&local);
+			clock = &local;
+		}
+		if (memcmp(rec->addr, zero_addr, 16) == 0)
+			dst[d++] = '*';
+		else
+			d += format_addr(dst + d, rec->addr);
+		dst[d++] = ',';
+		d += print_string(dst + d, rec->login, rec->login_length);
+		dst[d++] = ',';
+		d += print_string(dst + d, rec->password, rec->password_length);
+		dst[d++] = ',';
+		d += format_count(dst + d, rec->count);
+		dst[d++] = ',';
+		d += format_time(dst + d, clock, rec->first);
+		dst[d++] = ',';
+		d += format_time(dst + d, clock, rec->time);
+		dst[d++] = '\n';
+	}
+		break;
+	case LOG_EVENT:
+	{
+		static const char *names[] = {"connect,", "close,", "recv,", "overflow,", "budget,"};
+		static const char *budgets[BUDGET_COUNT] = {"time", "line", "rate"};
+		const char *name = names[rec->event <= EVENT_BUDGET ? rec->event : EVENT_RECV];
+		size_t len = strlen(name);
+
+		memcpy(dst + d, name, len);
+		d += len;
+		d += format_addr(dst + d, rec->addr);
+		if (rec->event == EVENT_RECV) {
+			dst[d++] = ',';
+			d += format_error(dst + d, rec->error);
+		} else if (rec->event == EVENT_BUDGET) {
+			const char *what = budgets[(unsigned)rec->error < BUDGET_COUNT ? rec->error : BUDGET_TIME];
+
+			dst[d++] = ',';
+			len = strlen(what);
+			memcpy(dst + d, what, len);
+			d += len;
+		}
+		dst[d++] = '\n';
+	}
+		break;
+	case LOG_TOP:
+	{
+		/* one of the most seen in the last -K interval: an address, or
+		 * a pair, which always has a login */
+		struct RecordClock local;
+
+		if (clock == NULL) {
+			record_clock_init(&local);
+			clock = &local;
+		}
+		if (rec->login_length == 0) {
+			memcpy(dst + d, "top,addr,", 9);
+			d += 9;
+			d += format_addr(dst + d, rec->addr);
+		} else {
+			memcpy(dst + d, "top,pair,", 9);
+			d += 9;
+			d += print_string(dst + d, rec->login, rec->login_length);
+			dst[d++] = ',';
+			d += print_string(dst + d, rec->password, rec->password_length);
+		}
+		dst[d++] = ',';
+		d += format_count(dst + d, rec->count);
+		dst[d++] = ',';
+		d += format_time(dst + d, clock, rec->first);
+		dst[d++] = ',';
+		d += format_time(dst + d, clock, rec->time);
+		dst[d++] = '\n';
+	}
+		break;
+	case LOG_CAPTURE:
+		memcpy(dst + d, "capture,", 8);
+		d += 8;
+		d += format_addr(dst + d, rec->addr);
+		dst[d++] = ',';
+		d += format_session(dst + d, rec->session);
+		dst[d++] = ',';
+		d += print_string(dst + d, (const char *)rec->capture, rec->capture_length);
+		d += format_local_port(dst + d, rec);
+		d += format_geo(dst + d, rec);
+		dst[d++] = '\n';
+		break;
+	}
+	return d;
+}
+
+/******************************************************************************
+ * Big-endian integers
+ ******************************************************************************/
+static void put_u16(unsigned char *dst, unsigned x) {
+	dst[0] = (unsigned char)(x >> 8);
+	dst[1] = (unsigned char)(x >> 0);
+}
+
+static void put_u64(unsigned char *dst, uint64_t x) {
+	unsigned i;
+	for (i = 0; i < 8; i++)
+		dst[i] = (unsigned char)(x >> (56 - 8 * i));
+}
+
+static void put_u32(unsigned char *dst, uint32_t x) {
+	put_u16(dst, x >> 16);
+	put_u16(dst + 2, x & 0xFFFF);
+}
+
+static uint32_t get_u32(const unsigned char *px) {
+	return (uint32_t)px[0] << 24 | px[1] << 16 | px[2] << 8 | px[3];
+}
+
+static unsigned get_u16(const unsigned char *px) {
+	return px[0] << 8 | px[1];
+}
+
+static uint64_t get_u64(const unsigned char *px) {
+	uint64_t x = 0;
+	unsigned i;
+	for (i = 0; i < 8; i++)
+		x = x << 8 | px[i];
+	return x;
+}
+
+size_t record_binary_header(unsigned char *dst) {
+	memcpy(dst, RECORD_MAGIC, 4);
+	dst[4] = RECORD_VERSION;
+	dst[5] = dst[6] = dst[7] = 0;
+	return RECORD_HEADER_SIZE;
+}
+
+/******************************************************************************
+ * Format one record as binary. The login and password go out raw, so there's
+ * no escaping here at all.
+ ******************************************************************************/
+size_t record_format_binary(unsigned char *dst, const struct LogRecord *rec) {
+	size_t login_length = rec->login_length > 255 ? 255 : rec->login_length;
+	size_t password_length = rec->password_length > 255 ? 255 : rec->password_length;
+	size_t d = 2;
+
+	dst[d++] = rec->type;
+	dst[d++] = rec->flags & (RECORD_FLAG_SESSION | RECORD_FLAG_GEO);
+	put_u64(dst + d, rec->time);
+	d += 8;
+	memcpy(dst + d, rec->addr, 16);
+	d += 16;
+	put_u16(dst + d, rec->port);
+	d += 2;
+	put_u64(dst + d, rec->session);
+	d += 8;
+	dst[d++] = (unsigned char)login_length;
+	memcpy(dst + d, rec->login, login_length);
+	d += login_length;
+	dst[d++] = (unsigned char)password_length;
+	memcpy(dst + d, rec->password, password_length);
+	d += password_length;
+
+	if (rec->type == LOG_AGG || rec->type == LOG_TOP) {
+		dst[d++] = RECORD_EXT_AGG;
+		dst[d++] = 12;
+		put_u32(dst + d, rec->count);
+		put_u64(dst + d + 4, rec->first);
+		d += 12;
+	}
+
+	if (rec->local_port) {
+		dst[d++] = RECORD_EXT_PORT;
+		dst[d++] = 2;
+		put_u16(dst + d, rec->local_port);
+		d += 2;
+	}
+
+	if (rec->flags & RECORD_FLAG_GEO) {
+		dst[d++] = RECORD_EXT_GEO;
+		dst[d++] = 6;
+		put_u32(dst + d, rec->asn);
+		dst[d + 4] = (unsigned char)rec->country[0];
+		dst[d + 5] = (unsigned char)rec->country[1];
+		d += 6;
+	}
+
+	if (rec->type == LOG_CAPTURE) {
+		const unsigned char *px = rec->capture;
+		size_t length = rec->capture_length > RECORD_CAPTURE_MAX
+			? RECORD_CAPTURE_MAX : rec->capture_length;
+		size_t offset;
+#ifdef HAVE_LZ4
+		/* worth it for anything longer than a few lines */
+		char packed[LZ4_COMPRESSBOUND(RECORD_CAPTURE_MAX)];
+		int n = 0;
+
+		if (length >= 64)
+			n = LZ4_compress_default((const char *)px, packed, (int)length, (int)length - 1);
+		if (n > 0) {
+			dst[3] |= RECORD_FLAG_LZ4;
+			px = (const unsigned char *)packed;
+			length = n;
+		}
+#endif
+		for (offset = 0; offset < length; ) {
+			size_t piece = length - offset > 255 ? 255 : length - offset;
+
+			dst[d++] = RECORD_EXT_CAPTURE;
+			dst[d++] = (unsigned char)piece;
+			memcpy(dst + d, px + offset, piece);
+			d += piece;
+			offset += piece;
+		}
+	}
+
+	put_u16(dst, (unsigned)d);
+	return d;
+}
+
+int record_parse_binary(struct LogRecord *rec, const unsigned char *px, size_t length) {
+	unsigned char *capture = rec->capture;
+	size_t record_length;
+	size_t d;
+#ifdef HAVE_LZ4
+	char packed[RECORD_BINARY_MAX];
+	size_t packed_length = 0;
+#endif
+
+	if (length < 2)
+		return 0;
+	record_length = get_u16(px);
+	if (record_length < RECORD_FIXED_SIZE + 2)
+		return -1;
+	if (length < record_length)
+		return 0;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->capture = capture;
+	d = 2;
+	rec->type = px[d++];
+	rec->flags = px[d++];
+	rec->time = get_u64(px + d);
+	d += 8;
+	memcpy(rec->addr, px + d, 16);
+	d += 16;
+	rec->port = get_u16(px + d);
+	d += 2;
+	rec->session = get_u64(px + d);
+	d += 8;
+
+	rec->login_length = px[d++];
+	if (d + rec->login_length + 1 > record_length)
+		return -1;
+	memcpy(rec->login, px + d, rec->login_length);
+	d += rec->login_length;
+
+	rec->password_length = px[d++];
+	if (d + rec->password_length > record_length)
+		return -1;
+	memcpy(rec->password, px + d, rec->password_length);
+	d += rec->password_length;
+
+	/* pick out the extensions we know, and skip the rest */
+	while (d + 2 <= record_length) {
+		unsigned tag = px[d];
+		size_t len = px[d + 1];
+
+		d += 2;
+		if (d + len > record_length)
+			return -1;
+		if (tag == RECORD_EXT_AGG && len >= 12) {
+			rec->count = (unsigned)get_u32(px + d);
+			rec->first = get_u64(px + d + 4);
+		}
+		if (tag == RECORD_EXT_PORT && len >= 2)
+			rec->local_port = get_u16(px + d);
+		if (tag == RECORD_EXT_GEO && len >= 6) {
+			rec->asn = get_u32(px + d);
+			rec->country[0] = (char)px[d + 4];
+			rec->country[1] = (char)px[d + 5];
+		}
+		if (tag == RECORD_EXT_CAPTURE && capture) {
+#ifdef HAVE_LZ4
+			if (rec->flags & RECORD_FLAG_LZ4) {
+				if (packed_length + len > sizeof(packed))
+					return -1;
+				memcpy(packed + packed_length, px + d, len);
+				packed_length += len;
+			} else
+#endif
+			if (rec->capture_length + len <= RECORD_CAPTURE_MAX) {
+				memcpy(capture + rec->capture_length, px + d, len);
+				rec->capture_length += len;
+			}
+		}
+		d += len;
+	}
+
+	if ((rec->flags & RECORD_FLAG_LZ4) && capture) {
+#ifdef HAVE_LZ4
+		int n = LZ4_decompress_safe(packed, (char *)capture, (int)packed_length, RECORD_CAPTURE_MAX);
+		if (n < 0)
+			return -1;
+		rec->capture_length = n;
+#else
+		return -1;
+#endif
+	}
+	return (int)record_length;
+}
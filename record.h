@@ -0,0 +1,182 @@
+#ifndef RECORD_H
+#define RECORD_H
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************************************************************
+ * The kinds of output record, one for each of the print_xxx() functions
+ ******************************************************************************/
+enum {
+	LOG_CSV,	/* host,login,password */
+	LOG_PASSWORDS,	/* login password */
+	LOG_IP,		/* host */
+	LOG_AGG,	/* host,login,password,count,first,last */
+	LOG_EVENT,	/* connect,host and the like, for stderr */
+	LOG_CAPTURE,	/* capture,host,session,bytes */
+	LOG_TOP,	/* top,addr,host,count,first,last or top,pair,login,password,... */
+};
+
+/******************************************************************************
+ * The session events of a LOG_EVENT record. These go to stderr as text,
+ * whatever the output format, the way they always have: 'connect,host',
+ * 'close,host', and 'recv,host,reason', the reason coming from 'error'.
+ * Then there's 'overflow,host' for a line too long to keep all of, and
+ * 'budget,host,what' for a session closed for going over one of its
+ * budgets (-B), 'what' being 'time', 'line' or 'rate'.
+ ******************************************************************************/
+enum {
+	EVENT_CONNECT,
+	EVENT_CLOSE,
+	EVENT_RECV,
+	EVENT_OVERFLOW,
+	EVENT_BUDGET,
+};
+
+/* What an EVENT_BUDGET record's session went over, in its 'error' */
+enum {
+	BUDGET_TIME,
+	BUDGET_LINE,
+	BUDGET_RATE,
+	BUDGET_COUNT
+};
+
+/******************************************************************************
+ * An output record, with the raw fields. Producers only copy the fields in
+ * here; all the escaping and formatting happens later in the writer thread.
+ ******************************************************************************/
+struct LogRecord {
+	unsigned char type;
+	unsigned short login_length;
+	unsigned short password_length;
+	uint64_t time;		/* milliseconds since the epoch */
+	uint64_t session;	/* session id */
+	unsigned char addr[16];	/* IPv4 addresses are IPv4-mapped */
+	unsigned short port;
+	unsigned short local_port;	/* the port it came in on, or 0 */
+	uint32_t asn;		/* with RECORD_FLAG_GEO, the address's AS, or 0 */
+	char country[2];	/* and its country, or zeroes */
+	unsigned count;		/* LOG_AGG, LOG_TOP: times seen, from 'first' to 'time' */
+	uint64_t first;
+	unsigned char event;	/* LOG_EVENT: EVENT_xxx */
+	int error;		/* LOG_EVENT: the errno of an EVENT_RECV */
+	unsigned char flags;	/* RECORD_FLAG_xxx */
+	unsigned char *capture;	/* LOG_CAPTURE: what the session sent */
+	unsigned capture_length;
+	char login[255];
+	char password[255];
+};
+
+/******************************************************************************
+ * The output formats: today's CSV-like text, the same with a timestamp in
+ * front, or the binary records below.
+ ******************************************************************************/
+enum {
+	FORMAT_TEXT,
+	FORMAT_TEXT_TIME,
+	FORMAT_BINARY,
+};
+
+/******************************************************************************
+ * The binary format. A stream starts with an 8-byte header: the magic
+ * "TLOG", a version byte, and three reserved bytes. Then come records, all
+ * integers big-endian:
+ *
+ *	u16	length of the whole record, including this field
+ *	u8	type (LOG_xxx)
+ *	u8	flags, RECORD_FLAG_xxx
+ *	u64	time, milliseconds since the epoch
+ *	u8[16]	peer address, IPv4 is IPv4-mapped
+ *	u16	peer port
+ *	u64	session id
+ *	u8	login length, then the raw login bytes
+ *	u8	password length, then the raw password bytes
+ *
+ * Anything after the password, up to 'length', is extension fields that
+ * readers should skip if they don't understand them. Each is a u8 tag, a
+ * u8 length, and that many bytes:
+ *
+ *	RECORD_EXT_AGG	u32 count, u64 first time (LOG_AGG and LOG_TOP
+ *			records)
+ *	RECORD_EXT_CAPTURE	the next piece of a LOG_CAPTURE record's bytes,
+ *			which are split over as many of these as they take
+ *	RECORD_EXT_PORT	u16 local port the connection came in on, when
+ *			listening on more than one
+ *	RECORD_EXT_GEO	u32 AS number, then the two letters of the country,
+ *			of the peer address, with -g; 0 and zeroes for
+ *			don't know
+ *
+ * The flags say that a LOG_CSV record's text ends with its session id
+ * (RECORD_FLAG_SESSION, set when sessions are being captured, so that the
+ * credentials can be matched up with the captures), that a capture's
+ * pieces add up to an LZ4 block rather than the bytes themselves
+ * (RECORD_FLAG_LZ4), or that the record has a RECORD_EXT_GEO
+ * (RECORD_FLAG_GEO).
+ ******************************************************************************/
+#define RECORD_MAGIC "TLOG"
+#define RECORD_VERSION 1
+#define RECORD_HEADER_SIZE 8
+#define RECORD_FIXED_SIZE (2 + 1 + 1 + 8 + 16 + 2 + 8)
+
+enum {
+	RECORD_EXT_AGG = 1,
+	RECORD_EXT_CAPTURE = 2,
+	RECORD_EXT_PORT = 3,
+	RECORD_EXT_GEO = 4,
+};
+
+enum {
+	RECORD_FLAG_SESSION = 1,
+	RECORD_FLAG_LZ4 = 2,
+	RECORD_FLAG_GEO = 4,
+};
+
+/* The most a LOG_CAPTURE record can hold */
+#define RECORD_CAPTURE_MAX 8192
+
+/* The most bytes a record can format to, in either format */
+#define RECORD_TIME_MAX 26
+#define RECORD_TEXT_MAX (RECORD_TIME_MAX + 46 + 4 * 255 + 1 + 4 * 255 + 2 \
+	+ 11 + 2 * RECORD_TIME_MAX + 4 * RECORD_CAPTURE_MAX + 6 + 14)
+#define RECORD_BINARY_MAX (RECORD_FIXED_SIZE + 1 + 255 + 1 + 255 + 2 + 12 + 2 + 2 + 2 + 6 \
+	+ RECORD_CAPTURE_MAX + 2 * ((RECORD_CAPTURE_MAX + 254) / 255 + 1))
+#define RECORD_MAX (RECORD_TEXT_MAX > RECORD_BINARY_MAX ? RECORD_TEXT_MAX : RECORD_BINARY_MAX)
+
+/* The most a LOG_EVENT record can format to */
+#define RECORD_EVENT_MAX (9 + 46 + 1 + 32 + 1)
+
+/******************************************************************************
+ * Text timestamps look like '2026-10-14T04:35:12.345Z', in UTC. Records
+ * come out in order, so nearly all of them fall in the same second as the
+ * one before; this remembers the formatted second, so that only the
+ * milliseconds need formatting for each record.
+ ******************************************************************************/
+struct RecordClock {
+	uint64_t second;
+	size_t length;
+	char text[24];
+};
+
+void record_clock_init(struct RecordClock *clock);
+
+/******************************************************************************
+ * Format a record into 'dst', which has room for RECORD_MAX bytes, and
+ * return the length. If 'clock' isn't NULL, text records start with the
+ * timestamp and a comma.
+ ******************************************************************************/
+size_t record_format_text(char *dst, const struct LogRecord *rec, struct RecordClock *clock);
+size_t record_format_binary(unsigned char *dst, const struct LogRecord *rec);
+
+/* Write the header that starts a binary stream */
+size_t record_binary_header(unsigned char *dst);
+
+/******************************************************************************
+ * Parse one binary record from the front of a buffer. Returns the number
+ * of bytes it took, 0 if the buffer doesn't hold a whole record yet, or -1
+ * if the data is corrupt. The bytes of a LOG_CAPTURE record go where
+ * 'rec->capture' points, which needs room for RECORD_CAPTURE_MAX of them;
+ * if it's NULL, they're skipped. A compressed capture that can't be
+ * uncompressed, because this was built without LZ4, counts as corrupt.
+ ******************************************************************************/
+int record_parse_binary(struct LogRecord *rec, const unsigned char *px, size_t length);
+
+#endif
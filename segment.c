@@ -0,0 +1,161 @@
+/******************************************************************************
+ * Preallocated, memory-mapped log segments. See segment.h.
+ ******************************************************************************/
+#define _GNU_SOURCE
+#include "segment.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Ages and sync intervals don't need better than a few ms */
+static uint64_t segment_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void segment_init(struct SegmentLog *log, const char *dir, size_t size,
+	unsigned max_age, unsigned sync_interval) {
+	memset(log, 0, sizeof(*log));
+	log->dir = dir;
+	log->suffix = ".log";
+	log->size = size;
+	log->max_age = (uint64_t)max_age * 1000;
+	log->sync_interval = (uint64_t)sync_interval * 1000;
+	log->fd = -1;
+}
+
+/******************************************************************************
+ * Create the file for a new segment, named for when it was started. The
+ * sequence number only matters when two are started in the same second.
+ ******************************************************************************/
+static int segment_create(struct SegmentLog *log) {
+	char path[4096];
+	char stamp[32];
+	time_t t = time(0);
+	struct tm tm;
+	unsigned tries;
+
+	gmtime_r(&t, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+	for (tries = 0; tries < 1000; tries++) {
+		int fd;
+
+		snprintf(path, sizeof(path), "%s/telnet-%s-%04u%s",
+			log->dir, stamp, log->sequence++ % 10000, log->suffix);
+		fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (fd >= 0 || errno != EEXIST)
+			return fd;
+	}
+	errno = EEXIST;
+	return -1;
+}
+
+int segment_open(struct SegmentLog *log) {
+	uint64_t now = segment_clock();
+	int fd;
+	int err;
+	void *map;
+
+	fd = segment_create(log);
+	if (fd < 0)
+		return -1;
+
+	/* Reserve all the blocks up front, so that appending never has to
+	 * allocate or change the size. Not every filesystem can. */
+	err = posix_fallocate(fd, 0, log->size);
+	if (err == EOPNOTSUPP || err == EINVAL)
+		err = ftruncate(fd, log->size) < 0 ? errno : 0;
+	if (err != 0) {
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	map = mmap(NULL, log->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	madvise(map, log->size, MADV_SEQUENTIAL);
+
+	log->fd = fd;
+	log->map = map;
+	log->offset = 0;
+	log->synced = 0;
+	log->opened = now;
+	log->last_sync = now;
+	if (log->header_length) {
+		memcpy(log->map, log->header, log->header_length);
+		log->offset = log->header_length;
+	}
+	return 0;
+}
+
+/******************************************************************************
+ * Finish the current segment: sync it, and cut off the unused tail so
+ * readers see only what was written.
+ ******************************************************************************/
+void segment_close(struct SegmentLog *log) {
+	if (log->fd < 0)
+		return;
+	munmap(log->map, log->size);
+	if (ftruncate(log->fd, log->offset) < 0)
+		fprintf(stderr, "log,segment truncate failed: %s\n", strerror(errno));
+	fdatasync(log->fd);
+	close(log->fd);
+	log->fd = -1;
+	log->map = NULL;
+}
+
+static void segment_sync(struct SegmentLog *log, uint64_t now) {
+	if (log->fd >= 0 && log->synced != log->offset) {
+		/* fdatasync() also writes back our dirty mapped pages, and since
+		 * the size never changes it has no metadata to write */
+		fdatasync(log->fd);
+		log->synced = log->offset;
+	}
+	log->last_sync = now;
+}
+
+void segment_write(struct SegmentLog *log, const char *buf, size_t length) {
+	if (log->fd >= 0 && log->offset + length > log->size)
+		segment_close(log);
+	if (log->fd < 0 && segment_open(log) < 0) {
+		fprintf(stderr, "log,%s: %s\n", log->dir, strerror(errno));
+		return; /* nowhere to put it, so lose it */
+	}
+	if (log->offset + length > log->size)
+		length = log->size - log->offset;
+	memcpy(log->map + log->offset, buf, length);
+	log->offset += length;
+}
+
+int segment_tick(struct SegmentLog *log) {
+	uint64_t now = segment_clock();
+	uint64_t next = UINT64_MAX;
+
+	if (log->fd >= 0 && log->max_age && now >= log->opened + log->max_age) {
+		segment_close(log);
+		/* the next one is opened by the next write, so an idle honeypot
+		 * doesn't leave a trail of empty segments */
+	}
+	if (log->sync_interval && now >= log->last_sync + log->sync_interval)
+		segment_sync(log, now);
+
+	if (log->fd >= 0 && log->max_age)
+		next = log->opened + log->max_age;
+	if (log->fd >= 0 && log->sync_interval && log->synced != log->offset
+			&& log->last_sync + log->sync_interval < next)
+		next = log->last_sync + log->sync_interval;
+	if (next == UINT64_MAX)
+		return -1;
+	return (int)(next - now);
+}
@@ -0,0 +1,58 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************************************************************
+ * Log output to a directory of segment files, instead of a file descriptor.
+ * Each segment is preallocated to its full size with fallocate() and
+ * mapped, so appending is a memcpy() at a cursor: no write() per batch, and
+ * no file-size metadata to sync. Segments are closed and a new one started
+ * when one fills up or gets too old, and the data is synced every so often
+ * rather than after every record. Only the writer thread touches this.
+ *
+ * A segment that is closed normally is truncated to the bytes written. If
+ * we crash, the tail of the last one is left as zeroes.
+ ******************************************************************************/
+struct SegmentLog {
+	const char *dir;
+	const char *suffix;	/* ".log" or ".bin" */
+	size_t size;		/* bytes per segment */
+	uint64_t max_age;	/* ms before starting a new one, 0 for never */
+	uint64_t sync_interval;	/* ms between syncs, 0 for never */
+	const unsigned char *header;	/* written at the start of each segment */
+	size_t header_length;
+	unsigned sequence;	/* to keep names unique */
+
+	int fd;			/* the current segment, or -1 */
+	char *map;
+	size_t offset;		/* the append cursor */
+	size_t synced;		/* how far the last sync got */
+	uint64_t opened;	/* when, monotonic ms */
+	uint64_t last_sync;
+};
+
+void segment_init(struct SegmentLog *log, const char *dir, size_t size,
+	unsigned max_age, unsigned sync_interval);
+
+/******************************************************************************
+ * Start the first segment, so that startup can report a bad directory.
+ * Returns -1 and sets errno on failure.
+ ******************************************************************************/
+int segment_open(struct SegmentLog *log);
+
+/******************************************************************************
+ * Append a batch of whole records. A batch is never split across segments:
+ * if it doesn't fit, the current segment is closed first.
+ ******************************************************************************/
+void segment_write(struct SegmentLog *log, const char *buf, size_t length);
+
+/******************************************************************************
+ * Do whatever sync or rotation is due. Returns the ms until the next thing
+ * is due, or -1 if nothing ever is.
+ ******************************************************************************/
+int segment_tick(struct SegmentLog *log);
+
+void segment_close(struct SegmentLog *log);
+
+#endif
@@ -0,0 +1,203 @@
+/******************************************************************************
+ * The fake shell. See shell.h. This runs in the event loop, so it works on
+ * buffers: a line in, what to send back out, and never a system call.
+ ******************************************************************************/
+#include "shell.h"
+#include <string.h>
+
+#include "shelltab.h"
+
+const struct ShellCommand *shell_lookup(const char *name, size_t length) {
+	const struct ShellCommand *c = &shell_table[shell_hash(name, length, SHELL_SEED) & (SHELL_SLOTS - 1)];
+
+	if (c->name == NULL || c->name_length != length || memcmp(c->name, name, length) != 0)
+		return NULL;
+	return c;
+}
+
+/* Append to the response, cutting it off if there's no room */
+static void append(char *dst, size_t size, size_t *d, const char *src, size_t length) {
+	if (length > size - *d)
+		length = size - *d;
+	memcpy(dst + *d, src, length);
+	*d += length;
+}
+
+#define APPEND(str) append(dst, size, d, str, sizeof(str) - 1)
+
+static int is_space(char c) {
+	return c == ' ' || c == '\t';
+}
+
+static int hex_digit(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/******************************************************************************
+ * 'echo', because bots check that they have a shell by echoing something
+ * odd and looking for it. Quotes are taken out, and with -e the backslash
+ * escapes are done. If the output is redirected, it goes nowhere.
+ ******************************************************************************/
+static void shell_echo(char *dst, size_t size, size_t *d, const char *args, size_t length) {
+	int escapes = 0;
+	int newline = 1;
+	size_t i = 0;
+	char quote = 0;
+
+	/* the options, which must come first */
+	while (i + 1 < length && args[i] == '-' && (args[i + 1] == 'e' || args[i + 1] == 'n')
+		&& (i + 2 == length || is_space(args[i + 2]))) {
+		if (args[i + 1] == 'e')
+			escapes = 1;
+		else
+			newline = 0;
+		for (i += 2; i < length && is_space(args[i]); i++)
+			;
+	}
+
+	if (memchr(args + i, '>', length - i))
+		return;
+
+	for (; i < length; i++) {
+		char c = args[i];
+
+		if (quote) {
+			if (c == quote) {
+				quote = 0;
+				continue;
+			}
+		} else if (c == '\'' || c == '"') {
+			quote = c;
+			continue;
+		}
+		if (c == '\\' && escapes && i + 1 < length) {
+			char next = args[++i];
+			int hi, lo;
+
+			switch (next) {
+			case 'n': c = '\n'; break;
+			case 'r': c = '\r'; break;
+			case 't': c = '\t'; break;
+			case '\\': c = '\\'; break;
+			case 'x':
+				if (i + 2 < length && (hi = hex_digit(args[i + 1])) >= 0
+						&& (lo = hex_digit(args[i + 2])) >= 0) {
+					c = (char)(hi << 4 | lo);
+					i += 2;
+					break;
+				}
+				/* fall through */
+			default:
+				append(dst, size, d, "\\", 1);
+				c = next;
+				break;
+			}
+		}
+		append(dst, size, d, &c, 1);
+	}
+	if (newline)
+		APPEND("\r\n");
+}
+
+/******************************************************************************
+ * One command, already trimmed
+ ******************************************************************************/
+static void shell_command(char *dst, size_t size, size_t *d, const char *cmd, size_t length,
+	int *is_exit) {
+	const struct ShellCommand *c;
+	int busybox = 0;
+	size_t name_length;
+
+	if (length >= 13 && memcmp(cmd, "/bin/busybox ", 13) == 0) {
+		cmd += 13;
+		length -= 13;
+		busybox = 1;
+	} else if (length >= 8 && memcmp(cmd, "busybox ", 8) == 0) {
+		cmd += 8;
+		length -= 8;
+		busybox = 1;
+	} else if ((length == 7 && memcmp(cmd, "busybox", 7) == 0)
+		|| (length == 12 && memcmp(cmd, "/bin/busybox", 12) == 0)) {
+		APPEND("BusyBox v1.19.4 (2014-03-27 15:11:52 CST) multi-call binary.\r\n");
+		return;
+	}
+	while (length && is_space(*cmd)) {
+		cmd++;
+		length--;
+	}
+	for (name_length = 0; name_length < length && !is_space(cmd[name_length]); name_length++)
+		;
+
+	if ((name_length == 4 && memcmp(cmd, "exit", 4) == 0)
+		|| (name_length == 6 && memcmp(cmd, "logout", 6) == 0)) {
+		*is_exit = 1;
+		return;
+	}
+	if (name_length == 4 && memcmp(cmd, "echo", 4) == 0) {
+		size_t i = name_length;
+
+		while (i < length && is_space(cmd[i]))
+			i++;
+		shell_echo(dst, size, d, cmd + i, length - i);
+		return;
+	}
+
+	c = shell_lookup(cmd, length);
+	if (c == NULL)
+		c = shell_lookup(cmd, name_length);
+	if (c) {
+		append(dst, size, d, c->text, c->text_length);
+	} else if (busybox) {
+		append(dst, size, d, cmd, name_length);
+		APPEND(": applet not found\r\n");
+	} else {
+		APPEND("sh: ");
+		append(dst, size, d, cmd, name_length);
+		APPEND(": not found\r\n");
+	}
+}
+
+int shell_run(char *dst, size_t size, size_t *written, const char *line, size_t length,
+	size_t *offset) {
+	int is_exit = 0;
+	size_t d = 0;
+
+	if (*offset == 0)
+		append(dst, size, &d, "\r\n", 2);
+
+	/* up to the next command that isn't empty */
+	while (*offset < length) {
+		const char *end = memchr(line + *offset, ';', length - *offset);
+		size_t part_end = end ? (size_t)(end - line) : length;
+		size_t start = *offset;
+		size_t stop = part_end;
+
+		while (start < stop && is_space(line[start]))
+			start++;
+		while (stop > start && is_space(line[stop - 1]))
+			stop--;
+		*offset = part_end + 1;
+		if (stop > start) {
+			shell_command(dst, size, &d, line + start, stop - start, &is_exit);
+			break;
+		}
+	}
+
+	if (is_exit) {
+		*written = d;
+		return SHELL_EXIT;
+	}
+	if (*offset < length) {
+		*written = d;
+		return SHELL_MORE;
+	}
+	append(dst, size, &d, SHELL_PROMPT, sizeof(SHELL_PROMPT) - 1);
+	*written = d;
+	return SHELL_DONE;
+}
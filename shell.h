@@ -0,0 +1,65 @@
+#ifndef SHELL_H
+#define SHELL_H
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************************************************************
+ * The fake shell that accepted logins (-a) drop into. It's just enough of
+ * a BusyBox ash for a bot to get on with its payload: each line is split
+ * at the ';'s, and each command answered from a table of canned responses
+ * (shell.cmds), apart from 'echo', 'exit', and '/bin/busybox APPLET', which
+ * need their arguments. Nothing is ever run.
+ *
+ * The table is a perfect hash, worked out when building by shellgen, so
+ * looking a command up is one hash and one compare.
+ ******************************************************************************/
+struct ShellCommand {
+	const char *name;	/* NULL for an empty slot */
+	const char *text;
+	unsigned short name_length;
+	unsigned short text_length;
+};
+
+/* FNV-1a, seeded, with a final mix so that the low bits depend on all of it.
+ * shellgen and the lookup must agree on this. */
+static inline uint32_t shell_hash(const char *key, size_t length, uint32_t seed) {
+	uint32_t h = 2166136261u ^ seed;
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 16777619u;
+	}
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	return h;
+}
+
+/* The canned command, or NULL if it isn't one */
+const struct ShellCommand *shell_lookup(const char *name, size_t length);
+
+/* What the shell says when a session first gets in, and its prompt */
+#define SHELL_BANNER "\r\n\r\nBusyBox v1.19.4 (2014-03-27 15:11:52 CST) built-in shell (ash)\r\n" \
+	"Enter 'help' for a list of built-in commands.\r\n\r\n# "
+#define SHELL_PROMPT "# "
+
+/******************************************************************************
+ * Answer a line one command at a time, so that each answer can go out
+ * before the next is worked out and a line of several doesn't have to fit
+ * in one buffer. '*offset' is where the next command starts, 0 to begin
+ * with, and is moved past it. The answer goes into 'dst', which has room
+ * for 'size' bytes; anything more is cut off, and '*written' is set to its
+ * length. The first starts after the echoed line, and the last ends with
+ * the next prompt.
+ ******************************************************************************/
+enum {
+	SHELL_MORE,	/* there are commands still to answer */
+	SHELL_DONE,	/* that was the last, and the prompt */
+	SHELL_EXIT,	/* the session should end instead of prompting again */
+};
+
+int shell_run(char *dst, size_t size, size_t *written, const char *line, size_t length,
+	size_t *offset);
+
+#endif
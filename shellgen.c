@@ -0,0 +1,119 @@
+/******************************************************************************
+ *
+ * SHELLGEN
+ *
+ * Builds the fake shell's command table (see shell.h). Reads shell.cmds,
+ * looks for a seed under which shell_hash() puts every command in a slot of
+ * its own, and writes the table out as C, for shell.c to include.
+ *
+ *	shellgen shell.cmds > shelltab.h
+ *
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shell.h"
+
+#define MAX_COMMANDS 1024
+#define MAX_SEEDS 1000000
+
+struct Entry {
+	char *name;
+	char *text;	/* as written in the file, C escapes and all */
+};
+
+static void put_name(const char *name) {
+	putchar('"');
+	for (; *name; name++) {
+		if (*name == '"' || *name == '\\')
+			putchar('\\');
+		putchar(*name);
+	}
+	putchar('"');
+}
+
+int main(int argc, char *argv[]) {
+	static struct Entry entries[MAX_COMMANDS];
+	static int slots_used[MAX_COMMANDS * 2];
+	char line[4096];
+	unsigned count = 0;
+	unsigned slots = 1;
+	unsigned seed;
+	unsigned i;
+	FILE *fp;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage:\n shellgen shell.cmds > shelltab.h\n");
+		return 1;
+	}
+	fp = fopen(argv[1], "r");
+	if (fp == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	/* a command, then optionally a tab and its response */
+	while (fgets(line, sizeof(line), fp)) {
+		char *tab;
+
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		if (count == MAX_COMMANDS) {
+			fprintf(stderr, "%s: more than %u commands\n", argv[1], MAX_COMMANDS);
+			return 1;
+		}
+		tab = strchr(line, '\t');
+		if (tab)
+			*tab++ = '\0';
+		entries[count].name = strdup(line);
+		entries[count].text = strdup(tab ? tab : "");
+		for (i = 0; i < count; i++) {
+			if (strcmp(entries[i].name, line) == 0) {
+				fprintf(stderr, "%s: '%s' is there twice\n", argv[1], line);
+				return 1;
+			}
+		}
+		count++;
+	}
+	fclose(fp);
+
+	/* at most half full, so that a seed that works is easy to find */
+	while (slots < count * 2)
+		slots *= 2;
+	for (seed = 0; seed < MAX_SEEDS; seed++) {
+		memset(slots_used, 0, sizeof(slots_used));
+		for (i = 0; i < count; i++) {
+			unsigned slot = shell_hash(entries[i].name, strlen(entries[i].name), seed) & (slots - 1);
+
+			if (slots_used[slot])
+				break;
+			slots_used[slot] = i + 1;
+		}
+		if (i == count)
+			break;
+	}
+	if (seed == MAX_SEEDS) {
+		fprintf(stderr, "%s: no perfect hash found\n", argv[1]);
+		return 1;
+	}
+
+	printf("/* Made from %s by shellgen: don't edit, edit that */\n", argv[1]);
+	printf("#define SHELL_SEED %uu\n", seed);
+	printf("#define SHELL_SLOTS %u\n", slots);
+	printf("#define SHELL_ENTRY(name, text) {name, text, sizeof(name) - 1, sizeof(text) - 1}\n");
+	printf("static const struct ShellCommand shell_table[SHELL_SLOTS] = {\n");
+	for (i = 0; i < slots; i++) {
+		struct Entry *e;
+
+		if (slots_used[i] == 0)
+			continue;
+		e = &entries[slots_used[i] - 1];
+		printf("\t[%u] = SHELL_ENTRY(", i);
+		put_name(e->name);
+		printf(", \"%s\"),\n", e->text);
+	}
+	printf("};\n");
+	return 0;
+}
@@ -10,11 +10,27 @@
  *
  *		* Removed Windows-components to reduce complexity
  *		* Reduced to CSV-like output to STDOUT
- *		* No timestamp in output
+ *		* Optional timestamp in output (-T)
+ *		* Event loop (epoll) instead of a thread per connection
+ *		* Optional io_uring engine, with 'make URING=1'
+ *		* Optional aggregation of repeated credentials (-A)
+ *		* Optional per-address rate and session limits (-r, -c)
+ *		* Metrics for Prometheus (-M)
+ *		* Session events through the log writer, with a verbosity level (-v)
+ *		* Optional capture of everything each session sends (-C)
+ *		* Optional fake shell for chosen credentials (-a)
+ *		* Several ports at once, each with its own banner profile (-l)
+ *		* Per-session budgets for time, line length and rate (-B)
+ *		* Draining on SIGTERM, reload by handing over to a new process on
+ *		  SIGHUP, and systemd socket activation and notification (-D)
+ *		* Optional ASN and country of each address, from a database (-g)
+ *		* Optional top-K sources and pairs in fixed memory (-K), and
+ *		  sampling of the full records (-N)
  * 
 ******************************************************************************/
 
 #define _CRT_SECURE_NO_WARNINGS 1
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -24,6 +40,14 @@
 #include <errno.h>
 #include <dlfcn.h>
 #include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #define WSAGetLastError() (errno)
 #define closesocket(fd) close(fd)
 #define WSA(err) (err)
@@ -35,26 +59,195 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <time.h>
 
+#include "nvt.h"
+#include "wheel.h"
+#include "logring.h"
+#include "format.h"
+#include "pool.h"
+#include "credtab.h"
+#include "peertab.h"
+#include "metrics.h"
+#include "histogram.h"
+#include "shell.h"
+#include "geo.h"
+#include "topk.h"
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
 /******************************************************************************
- * A mutex so multiple threads printing output don't conflict with
- * each other
+ * How long we wait for the other side to type something before giving up,
+ * and how long we stall between failed login attempts, in milliseconds.
+ * Both are timers on the wheel, which ticks every TICK_MS.
  ******************************************************************************/
-pthread_mutex_t output;
+#define RECV_TIMEOUT 60000
+#define RETRY_DELAY 2000
+#define TICK_MS 100
+
+/* How many records can be waiting for the log writer */
+#define LOG_RING_SIZE 4096
+
+/* How many distinct pairs each event loop counts with -A, before it just
+ * logs new ones as they come */
+#define CRED_TABLE_SIZE 16384
+
+/* With -K, how often the most seen are reported, by default, seconds */
+#define TOP_INTERVAL 60
+
+/* The default cap on concurrent sessions, split between the event loops.
+ * Each one takes about a kilobyte. */
+#define MAX_SESSIONS 16384
+
+/* The most event loop threads we'll run */
+#define MAX_THREADS 256
+
+/* How many epoll events we pull out of the kernel with each call */
+#define MAX_EVENTS 64
+
+/* Room kept free at the end of the output buffer for the next prompt, so
+ * that echo can't crowd it out. CANNED() checks that every prompt fits,
+ * the longest being the fake shell's banner. */
+#define OUT_RESERVE 128
+
+/* The io_uring engine: submission queue size, and how many receive buffers
+ * each loop shares between its sessions */
+#define URING_ENTRIES 1024
+#define URING_BUFS 4096
+
+/* How many source addresses the per-address limits keep track of */
+#define PEER_TABLE_SIZE 65536
+
+/* With '-P tarpit', how many connections over the limits each loop holds
+ * open without a word, and for how long */
+#define TARPIT_SLOTS 1024
+#define TARPIT_TIME 60000
+
+/* What to do with a connection over the per-address limits */
+enum {
+	PENALTY_CLOSE,
+	PENALTY_TARPIT,
+};
+
+/* What to do with a new connection when every session is in use */
+enum {
+	SHED_REFUSE,	/* close it */
+	SHED_BANNER,	/* tell it we're busy, then close it */
+	SHED_EVICT,	/* close the session that's been idle longest instead */
+	SHED_COUNT
+};
 
+/* The least a session must have been idle for SHED_EVICT to close it */
+#define EVICT_IDLE 1000
+
+/* With -s evict, idle sessions start being closed once a loop's sessions
+ * are more than PRESSURE_HIGH percent of its share of -m, until they're
+ * down to PRESSURE_LOW, at most PRESSURE_BATCH for each new connection */
+#define PRESSURE_HIGH 90
+#define PRESSURE_LOW 80
+#define PRESSURE_BATCH 8
+
+/* With a minimum rate (-B), every session gets this long for nothing, in
+ * milliseconds, and then each byte it sends buys it a little more */
+#define RATE_GRACE 10000
+
+/* With -a, how many pairs can be accepted, and how many commands the shell
+ * answers before it hangs up */
+#define SHELL_ACCEPT_MAX 16
+#define SHELL_COMMANDS_MAX 64
+
+/* With -C, a session's capture buffer starts this big, and doubles as
+ * needed up to the cap */
+#define CAPTURE_INITIAL 256
+
+/* The most ports we can listen on (-l), and which we do by default */
+#define LISTEN_MAX 16
+#define DEFAULT_PORT 23
+
+/* Listening sockets handed to us start at this descriptor, the systemd way */
+#define LISTEN_FDS_START 3
+
+/* How long sessions get to finish when we stop or hand over (-D), seconds,
+ * and how long a new process gets to start before we give up on it, ms */
+#define DRAIN_TIME 10
+#define HANDOFF_TIMEOUT 30000
+
+/* Where a new process finds the pipe to say it's ready on, and the one that
+ * says the old process is done with stdout (see handoff()) */
+#define HANDOFF_ENV "TELNETLOGGER_HANDOFF_FD"
+
+/* Sent to an event loop to wake it up, so that it sees it's to drain */
+#define SIGNAL_WAKE SIGUSR1
+
+/* Which engine runs the event loops */
+enum {
+	ENGINE_EPOLL,
+	ENGINE_URING,
+};
 
 /******************************************************************************
- * Arguments pass to each thread. Creating a thread only allows passing in
- * a single pointer, so we have to put everything we want passed to the
- * thread in a structure like this.
+ * Per-connection state. Each connection used to get a thread of its own,
+ * with this information on its stack; now the event loop keeps one of
+ * these for every connection and advances it as input arrives.
  ******************************************************************************/
-struct ThreadArgs {
-	pthread_t handle;
+enum {
+	PHASE_LOGIN,	/* waiting for the username */
+	PHASE_PASSWORD,	/* waiting for the password */
+	PHASE_DELAY,	/* stalling after "Login incorrect" */
+	PHASE_SHELL,	/* logged in, with -a: reading commands */
+};
+
+struct Session {
+	uint64_t id;	/* loop index in the top 16 bits, then a counter */
 	int fd;
-	struct sockaddr_in6 peer;
-	socklen_t peerlen;
-	char peername[256];
+	int phase;
+	int state;	/* NVT state, saved across reads */
+	int tries;
+	int commands;	/* answered in the shell */
+	unsigned short shell_offset;	/* where in 'login' the next command starts */
+	unsigned char shell_busy;	/* a line of commands not yet all answered */
+	struct Timer timer;	/* retry delay, or receive timeout */
+	uint64_t last_rx;	/* when we last heard from the peer */
+	uint64_t started;	/* microseconds, when accepted */
+	uint64_t prompted;	/* microseconds, when the current prompt went */
+	unsigned char heard;	/* anything received yet */
+	unsigned bytes_in;	/* received, for the -B rate */
+	struct Session *lru_prev;	/* the loop's sessions, by 'last_rx' */
+	struct Session *lru_next;
+	unsigned char addr[16];	/* peer address, IPv4 is IPv4-mapped */
+	unsigned short port;	/* peer port */
+	unsigned short local_port;	/* ours, for the records, with more than one -l */
+	unsigned char profile;	/* PROFILE_xxx, from the listener */
+	char login[256];
+	int login_length;
+	char password[256];
+	int password_length;
+	unsigned char in[256];	/* input not yet run through the parser */
+	unsigned short in_offset;
+	unsigned short in_length;
+	unsigned char out[256];	/* echo and prompts not yet sent */
+	unsigned short out_length;
+	unsigned char canned;	/* with -Z, a CANNED_xxx to send before 'out' */
+	unsigned char admitted;	/* counted in the per-address table */
+	unsigned char *capture;	/* with -C, what it's sent, or NULL for nothing yet */
+	unsigned short capture_length;
+	unsigned short capture_size;
+#ifdef HAVE_LIBURING
+	/* The io_uring engine only. The session can't be freed until the
+	 * kernel has given back every operation that points at it. */
+	unsigned char inflight;	/* operations in the kernel, and starved list */
+	unsigned char closed;
+	unsigned char recv_armed;	/* a recv is waiting for data */
+	unsigned char rx_ended;	/* saw EOF or an error, in rx_result */
+	unsigned char starving;	/* waiting on the starved list */
+	int rx_result;
+	unsigned short sending;	/* bytes of 'out' a send is working on */
+	unsigned char canned_sending;	/* a send of 'canned' is under way */
+	unsigned short rx_buf;	/* received buffer not yet parsed */
+	struct Session *starved;	/* next on the loop's starved list */
+#endif
 };
 
 
@@ -62,25 +255,30 @@ struct ThreadArgs {
  * Translate sockets error codes to helpful text for printing
  ******************************************************************************/
 static const char* error_msg(unsigned err) {
-	static char buf[256];
-	switch (err) {
-	case WSA(ECONNRESET): return "TCP connection reset";
-	case WSA(ECONNREFUSED): return "Connection refused";
-	case WSA(ETIMEDOUT): return "Timed out";
-	case WSA(ECONNABORTED): return "Connection aborted";
-	case WSA(EACCES): return "Access denied";
-	case WSA(EADDRINUSE): return "Port already in use";
-	case 11: return "Timed out";
-	case 0: return "TCP connection closed";
-	default:   
-		snprintf(buf, sizeof(buf), "err#%u", err);
-		return buf;
-	}
+	static __thread char buf[FORMAT_ERROR_MAX];
+
+	buf[format_error(buf, err)] = '\0';
+	return buf;
 }
 
 /******************************************************************************
- * Print to stderr. Right now, it's just a wrapper aroun fprintf(stderr), but
- * I do it this way so I can later add different DEBUG levels.
+ * How much goes to stderr (-v). Errors always do; notices are the limit
+ * and shedding reports; events are the connect, close and recv lines for
+ * every session, which is the most by far, and what you get by default.
+ ******************************************************************************/
+enum {
+	VERBOSE_ERROR,
+	VERBOSE_NOTICE,
+	VERBOSE_EVENT,
+};
+
+static int verbosity = VERBOSE_EVENT;
+
+/******************************************************************************
+ * Print to stderr. This is for errors, and is a wrapper around
+ * fprintf(stderr); NOTICE_MSG() is the same for notices, at -v 1 and up.
+ * Session events don't come through here, but through the log writer, see
+ * print_event().
  ******************************************************************************/
 int ERROR_MSG(const char *fmt, ...) {
 	va_list marker;
@@ -90,19 +288,30 @@ int ERROR_MSG(const char *fmt, ...) {
 	return -1;
 }
 
+int NOTICE_MSG(const char *fmt, ...) {
+	va_list marker;
+
+	if (verbosity < VERBOSE_NOTICE)
+		return 0;
+	va_start(marker, fmt);
+	vfprintf(stderr, fmt, marker);
+	va_end(marker);
+	return 0;
+}
+
 /******************************************************************************
  * On modern systems (Win7+, macOS, Linux, etc.), an "anyipv6" socket always
  * is backwards compatible with IPv4. So we create an IPv6 socket to handle
  * both versions simultaneously. This will inevitably fail on some system,
  * so eventually I'll have to write an IPv4 version of this function.
  ******************************************************************************/
-int create_ipv6_socket(int port) {
+int create_ipv6_socket(int port, int reuseport, int backlog) {
 	int fd;
 	int err;
 	struct sockaddr_in6 localaddr;
 
 	/* Create a generic socket. IPv6 includes IPv4 */
-	fd = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+	fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
 	if (fd <= 0) {
 		ERROR_MSG("socket(AF_INET6): could not create socket: %s\n",
 			error_msg(WSAGetLastError()));
@@ -134,6 +343,19 @@ int create_ipv6_socket(int port) {
 		}
 	}
 
+	/* Let each event loop have a listening socket of its own on the same
+	 * port, and have the kernel spread connections between them */
+	if (reuseport) {
+		int yes = 1;
+		err = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char*)&yes, sizeof(yes));
+		if (err != 0) {
+			ERROR_MSG("setsockopt(SO_REUSEPORT): %s\n",
+				error_msg(WSAGetLastError()));
+			closesocket(fd);
+			return -1;
+		}
+	}
+
 	/* Bind to local port. Again note that while I"m binding for IPv6, it's
 	 * also setting up a service for IPv4. */
 	memset(&localaddr, 0, sizeof(localaddr));
@@ -148,8 +370,9 @@ int create_ipv6_socket(int port) {
 		return -1;
 	}
 
-	/* Now the final initializaiton step */
-	err = listen(fd, 10);
+	/* Now the final initializaiton step. The kernel caps the backlog at
+	 * net.core.somaxconn, so that may need raising too */
+	err = listen(fd, backlog);
 	if (err < 0) {
 		ERROR_MSG("listen(%u): %s\n", port,
 			error_msg(WSAGetLastError()));
@@ -162,408 +385,3061 @@ int create_ipv6_socket(int port) {
 
 
 /******************************************************************************
- * Blacklist some bad characters to avoid the most obvious attempts of 
- * entering bad passwords designed to hack the system (shell injection,
- * HTML injection, SQL injection).
+ * Copy a length-encoded field into a record, truncating to fit
  ******************************************************************************/
-void print_string(FILE *fp, const char *str, int len) {
-	int i;
-	for (i = 0; i < len; i++) {
-		char c = str[i];
-		if (!isprint(c & 0xFF) || c == '\\' || c == '<' || c == '\'' || c == ' ' || c == '\"' || c == ',')
-			fprintf(fp, "\\x%02x", c & 0xFF);
-		else
-			fprintf(fp, "%c", c);
-	}
+static unsigned short log_field(char *dst, size_t sizeof_dst, const char *src, int len) {
+	if (len < 0)
+		len = 0;
+	if ((size_t)len > sizeof_dst)
+		len = sizeof_dst;
+	memcpy(dst, src, len);
+	return (unsigned short)len;
 }
 
 /******************************************************************************
- * Compares two strings, one nul-terminated, the other length encoded
+ * Fill in the parts of a record that say where and when. The time is the
+ * event loop's cached wall clock, not a fresh clock read per record.
  ******************************************************************************/
-int
-matches(const char *rhs, const char *lhs, int len)
-{
-	if (strlen(rhs) == len && memcmp(rhs, lhs, len) == 0)
-		return 1;
-	else
-		return 0;
+static void log_session(struct LogRecord *rec, uint64_t time, const struct Session *s) {
+	rec->time = time;
+	rec->session = s->id;
+	memcpy(rec->addr, s->addr, sizeof(rec->addr));
+	rec->port = s->port;
+	rec->local_port = s->local_port;
 }
 
 /******************************************************************************
 * Print the results.
 ******************************************************************************/
 void
-print_passwords(FILE *fp, const char *login, int login_len, const char *password, int password_len)
+print_passwords(struct LogRing *ring, const struct CredTable *creds,
+	const char *login, int login_len, const char *password, int password_len)
 {
-	if (fp == NULL)
-		return;
+	struct LogRecord *rec;
 
-	if (matches("shell", login, login_len) && matches("sh", password, password_len))
+	if (ring == NULL)
 		return;
-	if (matches("enable", login, login_len) && matches("system", password, password_len))
+
+	if (credtab_flags(creds, login, login_len, password, password_len) & CRED_SUPPRESS)
 		return;
 
-	/* pretty print the two fields */
-	pthread_mutex_lock(&output);
-	print_string(fp, login, login_len);
-	fprintf(fp, " ");
-	print_string(fp, password, password_len);
-	fprintf(fp, "\n");
-	fflush(fp);
-	pthread_mutex_unlock(&output);
+	rec = log_reserve(ring);
+	if (rec == NULL)
+		return;
+	rec->type = LOG_PASSWORDS;
+	rec->time = 0;
+	rec->session = 0;
+	memset(rec->addr, 0, sizeof(rec->addr));
+	rec->port = 0;
+	rec->login_length = log_field(rec->login, sizeof(rec->login), login, login_len);
+	rec->password_length = log_field(rec->password, sizeof(rec->password), password, password_len);
+	log_commit(ring, rec);
 }
 
 /******************************************************************************
  * Print which machines are connecting
  ******************************************************************************/
 void
-print_ip(FILE *fp, const char *hostname)
+print_ip(struct LogRing *ring, uint64_t time, const struct Session *s)
 {
-	if (fp == NULL)
+	struct LogRecord *rec;
+
+	if (ring == NULL)
+		return;
+
+	rec = log_reserve(ring);
+	if (rec == NULL)
+		return;
+	rec->type = LOG_IP;
+	log_session(rec, time, s);
+	log_commit(ring, rec);
+}
+
+
+/******************************************************************************
+ * Create a CSV formatted line with all the information on one line. This
+ * only queues the record; the writer thread formats and prints it, and
+ * that's where the address gets turned into text.
+ ******************************************************************************/
+void print_csv(struct LogRing *ring, uint64_t time, const struct Session *s, int flags) {
+	struct LogRecord *rec;
+
+	if (ring == NULL)
 		return;
 
-	pthread_mutex_lock(&output);
-	fprintf(fp, "%s\n", hostname);
-	fflush(fp);
-	pthread_mutex_unlock(&output);
+	rec = log_reserve(ring);
+	if (rec == NULL)
+		return;
+	rec->type = LOG_CSV;
+	rec->flags = flags;
+	log_session(rec, time, s);
+	rec->login_length = log_field(rec->login, sizeof(rec->login), s->login, s->login_length);
+	rec->password_length = log_field(rec->password, sizeof(rec->password), s->password, s->password_length);
+	log_commit(ring, rec);
 }
 
+/******************************************************************************
+ * With -C, everything the session sent, in one record for the writer. The
+ * buffer goes with it, so it's never copied; the writer frees it.
+ ******************************************************************************/
+static void print_capture(struct LogRing *ring, uint64_t time, struct Session *s) {
+	struct LogRecord *rec = NULL;
+
+	if (ring && s->capture_length)
+		rec = log_reserve(ring);
+	if (rec == NULL) {
+		free(s->capture);
+		s->capture = NULL;
+		return;
+	}
+	rec->type = LOG_CAPTURE;
+	log_session(rec, time, s);
+	rec->login_length = 0;
+	rec->password_length = 0;
+	rec->capture = s->capture;
+	rec->capture_length = s->capture_length;
+	s->capture = NULL;
+	log_commit(ring, rec);
+}
 
 /******************************************************************************
- * Create a CSV formatted line with all the information on one line.
+ * Report a session event, at -v 2. These go through the ring like the
+ * output, so that the loops never wait on stderr and lines from different
+ * threads never run into each other; but they never wait for room in it
+ * either, even with -q block.
  ******************************************************************************/
-void print_csv(FILE *fp, const char *hostname, const char *login, int login_len,
-	const char *password, int password_len) {
-	if (fp == NULL)
+static void print_event(struct LogRing *ring, const struct Session *s, int event, int err) {
+	struct LogRecord *rec;
+
+	if (ring == NULL || verbosity < VERBOSE_EVENT)
+		return;
+
+	rec = log_try_reserve(ring);
+	if (rec == NULL)
 		return;
+	rec->type = LOG_EVENT;
+	rec->event = event;
+	rec->error = err;
+	memcpy(rec->addr, s->addr, sizeof(rec->addr));
+	rec->port = s->port;
+	rec->session = s->id;
+	rec->time = 0;
+	log_commit(ring, rec);
+}
 
-	pthread_mutex_lock(&output);
+/******************************************************************************
+ * One line of counts for a pair seen since the last flush. Returns nonzero
+ * if the ring is full, so the table keeps the counts for next time.
+ ******************************************************************************/
+static int print_agg(const struct CredEntry *e, void *v_ring) {
+	struct LogRing *ring = (struct LogRing *)v_ring;
+	struct LogRecord *rec;
 
-	/* time-integer, time-formatted, username, password*/
-	fprintf(fp, "%s,", hostname);
-	print_string(fp, login, login_len);
-	fprintf(fp, ",");
-	print_string(fp, password, password_len);
-	fprintf(fp, "\n");
+	if (ring == NULL)
+		return 0;
 
-	fflush(fp);
-	pthread_mutex_unlock(&output);
+	rec = log_reserve(ring);
+	if (rec == NULL)
+		return -1;
+	rec->type = LOG_AGG;
+	rec->time = e->last;
+	rec->first = e->first;
+	rec->count = e->count;
+	rec->session = 0;
+	memcpy(rec->addr, e->addr, sizeof(rec->addr));
+	rec->port = 0;
+	rec->login_length = e->login_length;
+	memcpy(rec->login, e->key, e->login_length);
+	rec->password_length = e->password_length;
+	memcpy(rec->password, e->key + e->login_length, e->password_length);
+	log_commit(ring, rec);
+	return 0;
 }
 
 
 /******************************************************************************
- * Receive a line of NVT text, until the <return> character. While doing this
- * we may also have to participate in some NVT option negotiation.
- * This is the function that reads a username or password.
+ * What each event loop counts, for -M. Only the loop's own thread updates
+ * these, and the metrics thread adds them up when scraped; see metrics.h.
+ * Receive errors are counted by what error_msg() would call them. The
+ * histograms are of how long each part of a session took, in microseconds.
  ******************************************************************************/
-int recv_nvt_line(int fd, char *buf, int sizeof_buf, int flags, int *in_state) {
-	int offset = 0;
-	int state = *in_state;
-	int done = 0;
+enum {
+	STAT_ERR_CLOSED,
+	STAT_ERR_RESET,
+	STAT_ERR_OTHER,
+	STAT_ERR_COUNT
+};
 
-	while (!done) {
-		unsigned char c;
-		int len;
+enum {
+	LAT_FIRST_BYTE,	/* from accept to the first byte received */
+	LAT_LOGIN,	/* from the "login: " prompt to the end of the line */
+	LAT_PASSWORD,	/* from the "Password: " prompt to the end of the line */
+	LAT_SESSION,	/* from accept to close */
+	LAT_COUNT
+};
 
-		/* Receivine ONE byte at a time and process it. This is rather 
-		 * slow, but we don't care about speed */
-		len = recv(fd, (char*)&c, 1, flags);
-		if (len < 0) {
-			return -1;
-		}
-		if (len <= 0) {
-			if (offset == 0) {
-				*in_state = state;
-				return len;
-			} else
-				break;
-		}
+struct LoopStats {
+	atomic_ullong accepts;
+	atomic_ullong active;		/* sessions open now */
+	atomic_ullong bytes_in;
+	atomic_ullong bytes_out;
+	atomic_ullong credentials;	/* passwords seen, logged or counted */
+	atomic_ullong timeouts;
+	atomic_ullong errors[STAT_ERR_COUNT];
+	atomic_ullong shed[SHED_COUNT];	/* at the session limit, by -s policy */
+	atomic_ullong limited;		/* over the per-address limits */
+	atomic_ullong captured;		/* bytes, with -C */
+	atomic_ullong capture_full;	/* sessions that sent more than that */
+	atomic_ullong shells;		/* sessions let in, with -a */
+	atomic_ullong commands;		/* lines they typed there */
+	atomic_ullong overflows;	/* lines too long to keep */
+	atomic_ullong budget[BUDGET_COUNT];	/* sessions over a -B budget */
+	atomic_ullong evictions;	/* idle sessions closed under pressure */
+	atomic_ullong unsampled;	/* credentials not logged, with -N */
+	struct Histogram latency[LAT_COUNT];
+};
 
-		/* Handle the NVT state-machine */
-		switch (state) {
-		case 0:
-		case 1:
-			if (c == 0xFF) {
-				state = 2;
-			} else if (c == 0) {
-			} else if (c == '\n') {
-			} else if (c == '\r') {
-				done = 1;
-				break;
-			} else if (c == '\x7f') {
-				if (offset) {
-					offset--;
-					if (state == 0)
-						send(fd, "\b \b", 3, flags);
-				}
-				break;
-			} else {
-				/************************************************************
-				 * This is where we append the byte onto our username/password
-				 ************************************************************/
-				if (offset + 1 < sizeof_buf)
-					buf[offset++] = c;
-				else
-					done = 1;
-				if (state == 0) {
-					if (c <= 26) {
-						char zz[16];
-
-						zz[0] = '^';
-						zz[1] = c + 'A' - 1;
-						send(fd, zz, 2, flags);
-					} else
-						send(fd, &c, 1, flags);
-				}
-				if (c == 3 /*ctrl-c*/ || c == 4 /*ctrl-d*/)
-					done = 1;
-			}
-			break;
-		case 2: /* IAC escape */
-			switch (c) {
-			case 250: /* subneg */
-				state = 20;
-				break;
-			case 251: /* will */
-				state = 3;
-				break;
-			case 252: /* won't */
-				state = 4;
-				break;
-			case 253: /* do */
-				state = 5;
-				break;
-			case 254: /* don't */
-				state = 6;
-				break;
-			case 255:
-				if (offset + 1 < sizeof_buf)
-					buf[offset++] = 0xFF;
-				state = 0;
-				break;
-			default:
-				state = 0;
-				break;
-			}
-			break;
-		case 20: /*sub neg start */
-			switch (c) {
-			case 0xff: /*iac*/
-				state = 21;
-				break;
-			default:
-				/* do nothing */
-				break;
-			}
-			break;
-		case 21:
-			switch (c) {
-			case 240:
-				state = 0;
-				break;
-			default:
-				state = 20; /* go back to subnegotiation */
-				break;
-			}
-			break;
-		case 3: /* will */
-		case 4: /* won't */
-		case 5: /* do */
-		case 6: /* don't */
-			state = 0;
-			break;
-		default:
-			fprintf(stderr, "err,internal error,unknown state\n");
-			state = 0;
-			break;
-		}
-	}
+/******************************************************************************
+ * An event loop. Each one runs in a thread of its own, pinned to a CPU, and
+ * has its own listening sockets (one for each -l), epoll set, timer wheel,
+ * and log ring, so that the loops share nothing while handling connections.
+ * The epoll set holds the listening sockets and every connection, and the
+ * wheel holds a timer for each session. 'now' is the monotonic clock in
+ * milliseconds, read once every time epoll_wait() returns ('now_us' is the
+ * same in microseconds, for the latency histograms), and 'wallclock' the
+ * coarse real-time clock read at the same moment, for timestamping records.
+ ******************************************************************************/
+struct Loop {
+	pthread_t handle;
+	unsigned index;
+	int cpu;
+	int epfd;
+	struct Listener {
+		int fd;
+		unsigned short port;
+		unsigned char profile;	/* PROFILE_xxx */
+		unsigned char shared;	/* other loops accept on it too */
+		unsigned char borrowed;	/* and it's one of theirs, not ours to close */
+	} listeners[LISTEN_MAX];
+	unsigned listener_count;
+	int reservefd;	/* kept spare for when we run out */
+	int flags;
+	uint64_t now;
+	uint64_t now_us;
+	uint64_t wallclock;
+	struct Wheel wheel;
+	struct LogRing *log;
+	struct Pool sessions;
+	uint64_t next_id;	/* for session ids */
+	int shedding;		/* SHED_xxx, at the session limit */
+	unsigned long long shed_unreported;
+	uint64_t shed_reported;
+	struct Session *lru_head;	/* idle longest */
+	struct Session *lru_tail;	/* heard from most recently */
+	struct PeerTable *peers;	/* per-address limits, shared, or NULL */
+	int penalty;		/* PENALTY_xxx for connections over them */
+	unsigned long long limited;	/* connections over them */
+	uint64_t limited_reported;
+	struct Tarpit {
+		int fd;
+		uint64_t until;
+	} *tarpit;		/* a FIFO, since every entry is held as long */
+	unsigned tarpit_head;
+	unsigned tarpit_count;
+	struct Timer tarpit_timer;
+	struct CredTable creds;	/* pairs seen, with -A, and pairs to leave out */
+	struct Timer agg_timer;
+	unsigned agg_interval;	/* how often to flush the counts, or 0 */
+	struct TopK top_addrs;	/* the most seen, with -K, */
+	struct TopK top_pairs;
+	struct Timer top_timer;
+	unsigned top_interval;	/* how often to report them, or 0 */
+	uint64_t top_since;	/* wall clock, when they started counting */
+	unsigned sample;	/* log 1 in this many credentials, -N, or 0 */
+	uint64_t sample_state;	/* xorshift, for picking them */
+	unsigned capture_max;	/* bytes to capture from each session, -C, or 0 */
+	unsigned char shell;	/* some pairs get into the fake shell, -a */
+	unsigned budget_time;	/* -B: most a session can last, milliseconds, */
+	unsigned budget_line;	/* the most bytes of a line, */
+	unsigned budget_rate;	/* and the least bytes per second; 0 for none */
+	atomic_int draining;	/* set, and the loop woken, to stop it */
+	unsigned drain_time;	/* how long sessions then get, ms, -D */
+	uint64_t drain_until;	/* once draining, when it gives up on them */
+	struct Timer drain_timer;
+	sigset_t waitmask;	/* signals to wake up for while waiting */
+	int engine;
+	int zerocopy;	/* send canned responses without copying them, -Z */
+#ifdef HAVE_LIBURING
+	struct io_uring ring;
+	struct io_uring_buf_ring *bufs;	/* provided buffers for recv */
+	unsigned char *buf_data;
+	unsigned short *buf_length;
+	unsigned buf_free;		/* buffers the kernel can use */
+	char *canned;			/* the canned responses, registered */
+	struct Session *starved;	/* sessions whose recv ran out of buffers */
+#endif
+	/* last, and on lines of their own, so loops next to each other in
+	 * memory don't share them */
+	_Alignas(64) struct LoopStats stats;
+};
 
-	/* save the state across multiple calls */
-	*in_state = state;
-	return offset;
+static uint64_t clock_ms(clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Read the clocks, once each time the loop wakes up */
+static void loop_clock(struct Loop *loop) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	loop->now_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	loop->now = loop->now_us / 1000;
+	loop->wallclock = clock_ms(CLOCK_REALTIME_COARSE);
 }
 
 /******************************************************************************
- * This is a thread created whenever a connection is accepted, which is then
- * responsible for handling the connection with blocking calls, and eventually
- * cleanup when the connection ends. We set a recv timeout so that the 
- * connection won't stay alive indefinitely.
+ * Arm the session's timer for the time 'when', in milliseconds
  ******************************************************************************/
-void *handle_connection(void *v_args) {
-	struct ThreadArgs *args = (struct ThreadArgs *)v_args;
-	int fd = args->fd;
-	char login[256];
-	int login_length;
-	char password[256];
-	int password_length;
-	int state = 0;
-	char *hello;
-	int tries = 0;
-	int flags = 0;
+static void session_timer(struct Loop *loop, struct Session *s, uint64_t when) {
+	wheel_add(&loop->wheel, &s->timer, (when + TICK_MS - 1) / TICK_MS);
+}
 
-#ifdef MSG_NOSIGNAL
-	flags |= MSG_NOSIGNAL;
-#endif
+/******************************************************************************
+ * Everything we say that isn't echo, with the lengths worked out at compile
+ * time. A failed login gets its "Login incorrect" together with the next
+ * prompt, in one write once the retry delay is over, the way login(1) does.
+ *
+ * The initial hello also includes some basic negotiation. Apparently, the
+ * Mirai won't continue unless the right negotiation happens. I haven't
+ * figured out exactly what that is, but this seems adequate to make the
+ * bot continue.
+ ******************************************************************************/
+enum {
+	CANNED_NONE,
+	CANNED_HELLO,
+	CANNED_PASSWORD,
+	CANNED_RETRY,
+	CANNED_INCORRECT,
+	CANNED_BUSY,
+	CANNED_SHELL,
+	CANNED_COUNT
+};
 
+#define CANNED(text) {text, sizeof(text) - 1 + 0 * sizeof(struct {		\
+		int fits;							\
+		_Static_assert(sizeof(text) - 1 <= OUT_RESERVE, "canned text longer than OUT_RESERVE"); \
+	})}
 
-	/* Set receive timeout of 1 minute. */
-	{
-		struct timeval tv;
-		int err;
+struct Canned {
+	const char *text;
+	unsigned short length;
+};
 
-		tv.tv_sec = 60;
-		tv.tv_usec = 0;
+#define NEGOTIATE \
+	"\xff\xfb\x03" /* Will Suppress Go Ahead */ \
+	"\xff\xfb\x01" /* Will Echo */ \
+	"\xff\xfd\x1f" /* Do Negotiate Window Size */ \
+	"\xff\xfd\x18" /* Do Negotiate Terminal Type */
 
-		err = setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv));
-		if (err) {
-			ERROR_MSG("setsockopt(SO_RECVTIMEO): %s\n",
-				error_msg(WSAGetLastError()));
-		}
-	}
+#define BUSY "\r\nToo many connections, try again later\r\n"
+
+/******************************************************************************
+ * The profiles a listener can have (-l port/profile): what the device on
+ * that port looks like, up to the password prompt. Bots pick their
+ * credential lists by what the banner says, so a port that looks like a
+ * router gets tried with router passwords. The default is the first.
+ ******************************************************************************/
+enum {
+	PROFILE_BUSYBOX,
+	PROFILE_CISCO,
+	PROFILE_HUAWEI,
+	PROFILE_DVR,
+	PROFILE_COUNT
+};
+
+static const struct Profile {
+	const char *name;
+	struct Canned canned[CANNED_COUNT];
+} profiles[PROFILE_COUNT] = {
+	[PROFILE_BUSYBOX] = {"busybox", {
+		[CANNED_HELLO] = CANNED(NEGOTIATE "\r\nlogin: "),
+		[CANNED_PASSWORD] = CANNED("\r\nPassword: "),
+		[CANNED_RETRY] = CANNED("\r\nLogin incorrect\r\n\r\nlogin: "),
+		[CANNED_INCORRECT] = CANNED("\r\nLogin incorrect\r\n"),
+		[CANNED_BUSY] = CANNED(BUSY),
+		[CANNED_SHELL] = CANNED(SHELL_BANNER),
+	}},
+	[PROFILE_CISCO] = {"cisco", {
+		[CANNED_HELLO] = CANNED(NEGOTIATE "\r\n\r\nUser Access Verification\r\n\r\nUsername: "),
+		[CANNED_PASSWORD] = CANNED("\r\nPassword: "),
+		[CANNED_RETRY] = CANNED("\r\n% Login invalid\r\n\r\nUsername: "),
+		[CANNED_INCORRECT] = CANNED("\r\n% Login invalid\r\n"),
+		[CANNED_BUSY] = CANNED(BUSY),
+		[CANNED_SHELL] = CANNED(SHELL_BANNER),
+	}},
+	[PROFILE_HUAWEI] = {"huawei", {
+		[CANNED_HELLO] = CANNED(NEGOTIATE "\r\nLogin authentication\r\n\r\n\r\nUsername:"),
+		[CANNED_PASSWORD] = CANNED("\r\nPassword:"),
+		[CANNED_RETRY] = CANNED("\r\nError: Local authentication is rejected.\r\n\r\n\r\nUsername:"),
+		[CANNED_INCORRECT] = CANNED("\r\nError: Local authentication is rejected.\r\n"),
+		[CANNED_BUSY] = CANNED(BUSY),
+		[CANNED_SHELL] = CANNED(SHELL_BANNER),
+	}},
+	[PROFILE_DVR] = {"dvr", {
+		[CANNED_HELLO] = CANNED(NEGOTIATE "\r\n(none) login: "),
+		[CANNED_PASSWORD] = CANNED("\r\nPassword: "),
+		[CANNED_RETRY] = CANNED("\r\nLogin incorrect\r\n(none) login: "),
+		[CANNED_INCORRECT] = CANNED("\r\nLogin incorrect\r\n"),
+		[CANNED_BUSY] = CANNED(BUSY),
+		[CANNED_SHELL] = CANNED(SHELL_BANNER),
+	}},
+};
 
+static int profile_find(const char *name) {
+	int i;
 
-	/* The initial hello, which also includes some basic negotiation.
-	 * Apparently, the Mirai won't continue unless the right negotiation
-	 * happens. I haven't figured out exactly what that is, but this seems
-	 * adequate to make the bot continue */
-	hello = "\xff\xfb\x03" /* Will Suppress Go Ahead */
-		"\xff\xfb\x01" /* Will Echo */
-		"\xff\xfd\x1f" /* Do Negotiate Window Size */
-		"\xff\xfd\x18" /* Do Negotiate Terminal Type */
-		"\r\nlogin: ";
+	for (i = 0; i < PROFILE_COUNT; i++) {
+		if (strcmp(profiles[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
 
-again:
+/* The session's canned responses come from its listener's profile */
+static const struct Canned *session_canned(const struct Session *s, int which) {
+	return &profiles[s->profile].canned[which];
+}
 
-	/* LOGIN: send the "login: " string, then wait for response */
-	send(fd, hello, strlen(hello), flags);
-	login_length = recv_nvt_line(fd, login, sizeof(login), flags, &state);
-	if (login_length <= 0)
-		goto error;
+#ifdef HAVE_LIBURING
+/******************************************************************************
+ * The io_uring engine's side of a session. Where the epoll engine calls
+ * recv() until it would block, this submits a recv whenever the session
+ * wants more input, and the kernel fills a buffer from a ring shared by the
+ * whole loop when the data arrives. Sends are submitted from 'out' and
+ * retired when they complete. Everything submitted goes to the kernel in
+ * one io_uring_enter() per trip round the loop.
+ *
+ * The recv is single-shot on purpose. A multishot recv keeps taking
+ * buffers for as long as the peer keeps sending, even while the session
+ * can't use them (during its retry delay, or when the peer isn't reading
+ * our echo), and one such peer can drain the whole ring. This way each
+ * session holds at most one buffer, and otherwise the data waits in the
+ * socket, the same as with epoll.
+ *
+ * The low bits of each operation's user data say what it was; the rest is
+ * the session, which the pool keeps 64-byte aligned.
+ ******************************************************************************/
+enum {
+	URING_ACCEPT,
+	URING_RECV,
+	URING_SEND,
+	URING_IGNORE,
+};
 
-	/* PASSWORD: send the "password: " string, then wait for response */
-	send(fd, "\r\nPassword: ", 12, flags);
-	if (state == 0)
-		state = 1;
-	password_length = recv_nvt_line(fd, password, sizeof(password), flags, &state);
-	if (password_length <= 0)
-		goto error;
+#define URING_BUF_SIZE sizeof(((struct Session *)0)->in)
+#define URING_NONE 0xFFFF
 
-	/* Print the peering & login information */
-	print_csv(stdout, args->peername, login, login_length, password, password_length);
+static struct io_uring_sqe *uring_sqe(struct Loop *loop, struct Session *s, unsigned op) {
+	struct io_uring_sqe *sqe;
 
-	/* Print error and loop around to do it again */
-	if (state == 1)
-		state = 0;
-	send(fd, "\r\nLogin incorrect\r\n", 19, flags);
-	if (tries++ < 5) {
-		sleep(2);
-		hello = "\r\nlogin: ";
-		goto again;
+	sqe = io_uring_get_sqe(&loop->ring);
+	if (sqe == NULL) {
+		/* the queue is full: hand them over now, and carry on */
+		io_uring_submit(&loop->ring);
+		sqe = io_uring_get_sqe(&loop->ring);
+		if (sqe == NULL)
+			return NULL;
 	}
+	io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)s | op);
+	return sqe;
+}
 
+static void uring_arm_recv(struct Loop *loop, struct Session *s) {
+	struct io_uring_sqe *sqe = uring_sqe(loop, s, URING_RECV);
 
-end:
-	closesocket(fd);
-	ERROR_MSG("close,%s\n", args->peername);
-	free(args);
-	return NULL;
-error:
-	ERROR_MSG("recv,%s,%s\n", args->peername, error_msg(WSAGetLastError()));
-	goto end;
+	if (sqe == NULL)
+		return; /* the timeout will reap it */
+	io_uring_prep_recv(sqe, s->fd, NULL, URING_BUF_SIZE, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	s->recv_armed = 1;
+	s->inflight++;
 }
 
+static void uring_put_buf(struct Loop *loop, unsigned short bid) {
+	io_uring_buf_ring_add(loop->bufs, loop->buf_data + (size_t)bid * URING_BUF_SIZE,
+		URING_BUF_SIZE, bid, io_uring_buf_ring_mask(URING_BUFS), 0);
+	io_uring_buf_ring_advance(loop->bufs, 1);
+	loop->buf_free++;
+}
 
 /******************************************************************************
+ * Where a profile's canned response is in the loop's registered copy of
+ * them all, which has every profile's, one profile after another
  ******************************************************************************/
-void daemon_thread(int port) {
-	int fd;
-	
-	fd = create_ipv6_socket(port);
-	if (fd <= 0)
-		return;
+static size_t uring_canned_offset(int profile, int which) {
+	size_t offset = 0;
+	int p, i;
 
-	for (;;) {
-		int newfd;
-		struct ThreadArgs *args;
+	for (p = 0; p <= profile; p++) {
+		for (i = CANNED_NONE + 1; i < (p == profile ? which : CANNED_COUNT); i++)
+			offset += profiles[p].canned[i].length;
+	}
+	return offset;
+}
 
-		/* accept a new connection */
-		newfd = accept(fd, 0, 0);
-		if (newfd <= 0) {
-			ERROR_MSG("accept(%u): %s\n", port,
-				error_msg(WSAGetLastError()));
-			break;
+/******************************************************************************
+ * Send whatever is queued, unless a send is already under way. What's
+ * appended to 'out' meanwhile goes out when that one completes.
+ ******************************************************************************/
+static void uring_flush(struct Loop *loop, struct Session *s) {
+	struct io_uring_sqe *sqe;
+
+	if (s->sending || s->canned_sending)
+		return;
+	if (s->canned) {
+		/* with -Z: a zero-copy send from the registered copy */
+		const struct Canned *c = session_canned(s, s->canned);
+
+		sqe = uring_sqe(loop, s, URING_SEND);
+		if (sqe == NULL)
+			return;
+		io_uring_prep_send_zc_fixed(sqe, s->fd,
+			loop->canned + uring_canned_offset(s->profile, s->canned),
+			c->length, loop->flags, 0, 0);
+		s->canned_sending = 1;
+		s->inflight++;
+		return;
+	}
+	if (s->out_length == 0)
+		return;
+	sqe = uring_sqe(loop, s, URING_SEND);
+	if (sqe == NULL)
+		return;
+	io_uring_prep_send(sqe, s->fd, s->out, s->out_length, loop->flags);
+	s->sending = s->out_length;
+	s->inflight++;
+}
+
+/******************************************************************************
+ * The recv() of the io_uring engine: hand over the buffer the kernel filled
+ * for this session, if there is one, or else ask for the next one and
+ * report EAGAIN.
+ ******************************************************************************/
+static int uring_recv(struct Loop *loop, struct Session *s, unsigned char *buf) {
+	unsigned short bid = s->rx_buf;
+	int len;
+
+	if (bid == URING_NONE) {
+		if (s->rx_ended) {
+			errno = -s->rx_result;
+			return s->rx_result ? -1 : 0;
 		}
+		if (!s->recv_armed && !s->starving)
+			uring_arm_recv(loop, s);
+		errno = EAGAIN;
+		return -1;
+	}
 
-		/* Create new structure to hold per-thread-data */
-		args = malloc(sizeof(*args));
-		memset(args, 0, sizeof(*args));
-		args->fd = newfd;
-		args->peerlen = sizeof(args->peer);
-		getpeername(args->fd, (struct sockaddr*)&args->peer, &args->peerlen);
-		getnameinfo((struct sockaddr*)&args->peer, args->peerlen, args->peername, sizeof(args->peername), NULL, 0, NI_NUMERICHOST| NI_NUMERICSERV);
-		if (memcmp(args->peername, "::ffff:", 7) == 0)
-			memmove(args->peername, args->peername + 7, strlen(args->peername + 7) + 1);
-		fprintf(stderr, "connect,%s\n", args->peername);
+	len = loop->buf_length[bid];
+	memcpy(buf, loop->buf_data + (size_t)bid * URING_BUF_SIZE, len);
+	s->rx_buf = URING_NONE;
+	uring_put_buf(loop, bid);
+	return len;
+}
 
-		pthread_create(&args->handle, 0, handle_connection, args);
+/******************************************************************************
+ * Closing the descriptor doesn't stop operations the kernel already has, so
+ * the running recv is cancelled, and the pool only gets the session back
+ * once the last of them has completed.
+ ******************************************************************************/
+static void uring_close(struct Loop *loop, struct Session *s) {
+	struct io_uring_sqe *sqe;
 
-		/* clean up the thread handle, otherwise we have a small memory
-		 * leak of handles. Thanks to Stefan Laudemann for pointing
-		 * this out. I suspect it's more than just 8 bytes for the handle,
-		 * but that there are kernel resources that we'll run out of
-		 * too. */
-		pthread_detach(args->handle);
+	if (s->recv_armed) {
+		sqe = uring_sqe(loop, NULL, URING_IGNORE);
+		if (sqe)
+			io_uring_prep_cancel64(sqe, (uint64_t)(uintptr_t)s | URING_RECV, 0);
 	}
-
-	closesocket(fd);
+	if (s->rx_buf != URING_NONE) {
+		uring_put_buf(loop, s->rx_buf);
+		s->rx_buf = URING_NONE;
+	}
+	s->closed = 1;
+	closesocket(s->fd);
+	if (s->inflight == 0)
+		pool_free(&loop->sessions, s);
 }
+#endif
 
 /******************************************************************************
+ * The loop's sessions are kept in order of when we last heard from them,
+ * so that the one idle longest is always at the head
  ******************************************************************************/
-int main(int argc, char *argv[]) {
-	int i;
-	int port = 23;
+static void session_unlink(struct Loop *loop, struct Session *s) {
+	if (s->lru_prev)
+		s->lru_prev->lru_next = s->lru_next;
+	else
+		loop->lru_head = s->lru_next;
+	if (s->lru_next)
+		s->lru_next->lru_prev = s->lru_prev;
+	else
+		loop->lru_tail = s->lru_prev;
+	s->lru_prev = s->lru_next = NULL;
+}
 
-	pthread_mutex_init(&output, 0);
+static void session_touch(struct Loop *loop, struct Session *s) {
+	s->last_rx = loop->now;
+	if (loop->lru_tail == s)
+		return;
+	if (s->lru_prev || s->lru_next || loop->lru_head == s)
+		session_unlink(loop, s);
+	s->lru_prev = loop->lru_tail;
+	if (loop->lru_tail)
+		loop->lru_tail->lru_next = s;
+	else
+		loop->lru_head = s;
+	loop->lru_tail = s;
+}
 
-	/* Read configuration parameters */
-	for (i = 1; i < argc; i++) {
-		if (argv[i][0] != '-') {
-			fprintf(stderr, "startup,unknown parameter: %s\n", argv[i]);
-			exit(1);
-		}
-		switch (argv[i][1]) {
-		case 'l':
-		{
-			char *arg;
-			if (isdigit(argv[i][2])) {
-				arg = &argv[i][2];
-			} else {
-				if (++i >= argc) {
-					fprintf(stderr, "startup,expected parameter after -%c\n", 'i');
-					exit(1);
-				}
-				arg = argv[i];
-			}
-			if (strtoul(arg, 0, 0) < 1 || strtoul(arg, 0, 0) > 65535) {
-				fprintf(stderr, "startup,expected port number between 1..65535\n");
-				exit(1);
-			}
-			port = strtoul(arg, 0, 0);
-		}
-			break;
-		case 'h':
-		case '?':
-		case 'H':
-			fprintf(stderr, "usage:\n telnetlogger [-l port]\n");
-			exit(1);
-			break;
-		}
+/******************************************************************************
+ * Tear down a session: close the socket (which also takes it out of the
+ * epoll set), cancel its timer, and give it back to the pool.
+ ******************************************************************************/
+static void session_flush(struct Loop *loop, struct Session *s);
+
+static void session_close(struct Loop *loop, struct Session *s) {
+	session_flush(loop, s);
+	print_event(loop->log, s, EVENT_CLOSE, 0);
+	if (s->capture) {
+		stat_add(&loop->stats.captured, s->capture_length);
+		if (s->capture_length == loop->capture_max)
+			stat_add(&loop->stats.capture_full, 1);
+		print_capture(loop->log, loop->wallclock, s);
+	}
+	wheel_cancel(&loop->wheel, &s->timer);
+	session_unlink(loop, s);
+	if (s->admitted)
+		peertab_release(loop->peers, s->addr);
+	stat_set(&loop->stats.active, stat_get(&loop->stats.active) - 1);
+	histogram_record(&loop->stats.latency[LAT_SESSION], loop->now_us - s->started);
+
+#ifdef HAVE_LIBURING
+	if (loop->engine == ENGINE_URING) {
+		uring_close(loop, s);
+		return;
 	}
+#endif
+	closesocket(s->fd);
+	pool_free(&loop->sessions, s);
+}
+
+/******************************************************************************
+ * Report why we stopped receiving, then close.
+ ******************************************************************************/
+static void session_error(struct Loop *loop, struct Session *s, int err) {
+	if (err == WSA(ETIMEDOUT))
+		stat_add(&loop->stats.timeouts, 1);
+	else if (err == 0)
+		stat_add(&loop->stats.errors[STAT_ERR_CLOSED], 1);
+	else if (err == WSA(ECONNRESET))
+		stat_add(&loop->stats.errors[STAT_ERR_RESET], 1);
+	else
+		stat_add(&loop->stats.errors[STAT_ERR_OTHER], 1);
+	print_event(loop->log, s, EVENT_RECV, err);
+	session_close(loop, s);
+}
 
-	daemon_thread(port);
+/******************************************************************************
+ * Queue output for the peer. Nothing is sent until session_flush(), so all
+ * the echo and prompts produced from one chunk of input go out together.
+ * Anything that doesn't fit is dropped: that only happens when the peer
+ * has stopped reading, in which case it won't miss it.
+ ******************************************************************************/
+static void session_unsay(struct Session *s, size_t sent);
 
-	return 0;
+static void session_write(struct Session *s, const char *buf, size_t length) {
+	if (s->canned
+#ifdef HAVE_LIBURING
+		&& !s->canned_sending
+#endif
+		)
+		session_unsay(s, 0);
+	if (length > sizeof(s->out) - s->out_length)
+		length = sizeof(s->out) - s->out_length;
+	memcpy(s->out + s->out_length, buf, length);
+	s->out_length += length;
 }
 
+/******************************************************************************
+ * Queue a canned response. With -Z, when it's all we have to say, it is
+ * sent straight from where it lives instead of being copied into 'out'.
+ ******************************************************************************/
+static void session_say(struct Loop *loop, struct Session *s, int which) {
+	const struct Canned *c = session_canned(s, which);
+
+	if (loop->zerocopy && s->out_length == 0 && s->canned == CANNED_NONE)
+		s->canned = which;
+	else
+		session_write(s, c->text, c->length);
+}
+
+/******************************************************************************
+ * Put what wasn't sent of the canned response at the front of 'out' after
+ * all, because it was only partly sent or more output is coming after it
+ ******************************************************************************/
+static void session_unsay(struct Session *s, size_t sent) {
+	const struct Canned *c = session_canned(s, s->canned);
+	size_t length = c->length - sent;
+
+	s->canned = CANNED_NONE;
+#ifdef HAVE_LIBURING
+	s->canned_sending = 0;
+#endif
+	if (length > sizeof(s->out) - s->out_length)
+		length = sizeof(s->out) - s->out_length;
+	memmove(s->out + length, s->out, s->out_length);
+	memcpy(s->out, c->text + sent, length);
+	s->out_length += length;
+}
+
+/******************************************************************************
+ * Send queued output with a single send(). If the socket buffer is full, the
+ * rest stays queued until epoll tells us the socket is writable again. On a
+ * hard error we just discard it; the next recv() will report the problem.
+ ******************************************************************************/
+static void session_flush(struct Loop *loop, struct Session *s) {
+	int len;
+
+#ifdef HAVE_LIBURING
+	if (loop->engine == ENGINE_URING) {
+		uring_flush(loop, s);
+		return;
+	}
+#endif
+	if (s->canned) {
+		const struct Canned *c = session_canned(s, s->canned);
+
+		len = send(s->fd, c->text, c->length, loop->flags | MSG_ZEROCOPY);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				s->canned = CANNED_NONE;
+				s->out_length = 0;
+			}
+			return;
+		}
+		stat_add(&loop->stats.bytes_out, len);
+		if (len < c->length) {
+			session_unsay(s, len);
+			return;
+		}
+		s->canned = CANNED_NONE;
+	}
+	if (s->out_length == 0)
+		return;
+	len = send(s->fd, (char*)s->out, s->out_length, loop->flags);
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			s->out_length = 0;
+		return;
+	}
+	stat_add(&loop->stats.bytes_out, len);
+	memmove(s->out, s->out + len, s->out_length - len);
+	s->out_length -= len;
+}
+
+/******************************************************************************
+ * The session budgets (-B). Rather than checking every session all the
+ * time, each one's timer is set for the soonest it could go over, given
+ * what it has sent so far. Sending more only pushes the rate deadline
+ * back, so as with the receive timeout, the timer firing early just means
+ * working out the next one.
+ ******************************************************************************/
+static uint64_t session_deadline(const struct Loop *loop, const struct Session *s) {
+	uint64_t started = s->started / 1000;
+	uint64_t when = s->last_rx + RECV_TIMEOUT;
+
+	if (loop->budget_time && started + loop->budget_time < when)
+		when = started + loop->budget_time;
+	if (loop->budget_rate) {
+		uint64_t t = started + RATE_GRACE + (uint64_t)s->bytes_in * 1000 / loop->budget_rate;
+		if (t < when)
+			when = t;
+	}
+	return when;
+}
+
+/* The budget the session has gone over, or -1 */
+static int session_over_budget(const struct Loop *loop, const struct Session *s) {
+	uint64_t started = s->started / 1000;
+
+	if (loop->budget_time && loop->now >= started + loop->budget_time)
+		return BUDGET_TIME;
+	if (loop->budget_rate
+		&& loop->now >= started + RATE_GRACE + (uint64_t)s->bytes_in * 1000 / loop->budget_rate)
+		return BUDGET_RATE;
+	return -1;
+}
+
+static void session_budget(struct Loop *loop, struct Session *s, int budget) {
+	stat_add(&loop->stats.budget[budget], 1);
+	print_event(loop->log, s, EVENT_BUDGET, budget);
+	session_close(loop, s);
+}
+
+/******************************************************************************
+ * Send the "login: " prompt and start waiting for the username. If the
+ * peer already typed ahead while we were waiting, process that input now,
+ * since the edge-triggered epoll won't tell us about it again.
+ ******************************************************************************/
+static void session_read(struct Loop *loop, struct Session *s);
+
+static void session_prompt_login(struct Loop *loop, struct Session *s, int prompt) {
+	session_say(loop, s, prompt);
+	s->phase = PHASE_LOGIN;
+	s->login_length = 0;
+	s->prompted = loop->now_us;
+	session_touch(loop, s);
+	session_timer(loop, s, session_deadline(loop, s));
+	session_read(loop, s);
+}
+
+/******************************************************************************
+ * With -N, whether to log this credential: one in 'sample' at random, so
+ * that bots that come round on a schedule aren't always or never picked.
+ ******************************************************************************/
+static int loop_sampled(struct Loop *loop) {
+	uint64_t x = loop->sample_state;
+
+	if (loop->sample <= 1)
+		return 1;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	loop->sample_state = x;
+	if (x % loop->sample == 0)
+		return 1;
+	stat_add(&loop->stats.unsampled, 1);
+	return 0;
+}
+
+/******************************************************************************
+ * Answer the commands on the shell's line, one at a time, each in the
+ * output buffer once there's room for all of it. If there isn't even after
+ * sending what's waiting, the rest waits until the peer has read some, and
+ * the line stays in 'login' until then. Returns -1 if the session was
+ * closed.
+ ******************************************************************************/
+static int session_shell(struct Loop *loop, struct Session *s) {
+	while (s->shell_busy) {
+		char reply[sizeof(s->out)];
+		size_t offset = s->shell_offset;
+		size_t length;
+		int next = shell_run(reply, sizeof(reply), &length, s->login, s->login_length, &offset);
+
+		if (s->out_length + length > sizeof(s->out)) {
+			session_flush(loop, s);
+			if (s->out_length + length > sizeof(s->out))
+				return 0;
+		}
+		session_write(s, reply, length);
+		s->shell_offset = (unsigned short)offset;
+		if (next == SHELL_MORE)
+			continue;
+		s->shell_busy = 0;
+		s->login_length = 0;
+		if (next == SHELL_EXIT || ++s->commands >= SHELL_COMMANDS_MAX) {
+			session_close(loop, s);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/******************************************************************************
+ * Called when the NVT parser has finished a line. This advances the
+ * login/password state machine, which is the logic that used to be a
+ * sequence of blocking calls in a thread of its own. Returns -1 if the
+ * session was closed.
+ ******************************************************************************/
+static int session_line(struct Loop *loop, struct Session *s) {
+	switch (s->phase) {
+	case PHASE_LOGIN:
+		if (s->login_length <= 0) {
+			session_error(loop, s, 0);
+			return -1;
+		}
+
+		histogram_record(&loop->stats.latency[LAT_LOGIN], loop->now_us - s->prompted);
+
+		/* PASSWORD: send the "password: " string, then wait for response */
+		session_say(loop, s, CANNED_PASSWORD);
+		s->prompted = loop->now_us;
+		if (s->state == 0)
+			s->state = 1;
+		s->phase = PHASE_PASSWORD;
+		s->password_length = 0;
+		return 0;
+
+	case PHASE_PASSWORD:
+		if (s->password_length <= 0) {
+			session_error(loop, s, 0);
+			return -1;
+		}
+
+		histogram_record(&loop->stats.latency[LAT_PASSWORD], loop->now_us - s->prompted);
+
+		/* Print the peering & login information, or with -A just
+		 * count it, unless the table is full. With -K it's counted
+		 * for the most seen, and with -N only some are printed. */
+		stat_add(&loop->stats.credentials, 1);
+		if (loop->top_interval) {
+			topk_add(&loop->top_addrs, s->addr, NULL, 0, NULL, 0);
+			topk_add(&loop->top_pairs, NULL, s->login, s->login_length,
+				s->password, s->password_length);
+		}
+		if ((loop->agg_interval == 0
+			|| credtab_add(&loop->creds, s->login, s->login_length,
+				s->password, s->password_length, s->addr, loop->wallclock) == NULL)
+			&& loop_sampled(loop))
+			print_csv(loop->log, loop->wallclock, s,
+				loop->capture_max ? RECORD_FLAG_SESSION : 0);
+
+		/* Loop around to do it again, after a delay that is handled by
+		 * the event loop instead of sleep(). The error goes out with the
+		 * next prompt when the delay is over. With -a, some pairs get in
+		 * instead. */
+		if (s->state == 1)
+			s->state = 0;
+		if (loop->shell && (credtab_flags(&loop->creds, s->login, s->login_length,
+				s->password, s->password_length) & CRED_ACCEPT)) {
+			stat_add(&loop->stats.shells, 1);
+			session_say(loop, s, CANNED_SHELL);
+			s->phase = PHASE_SHELL;
+			s->login_length = 0;
+			return 0;
+		}
+		if (s->tries++ < 5) {
+			s->phase = PHASE_DELAY;
+			session_timer(loop, s, loop->now + RETRY_DELAY);
+			return 0;
+		}
+		session_say(loop, s, CANNED_INCORRECT);
+		session_close(loop, s);
+		return -1;
+
+	case PHASE_SHELL:
+		stat_add(&loop->stats.commands, 1);
+		s->shell_offset = 0;
+		s->shell_busy = 1;
+		return session_shell(loop, s);
+	}
+	return 0;
+}
+
+/******************************************************************************
+ * With -C, make room in the session's capture buffer for 'more' bytes, up
+ * to the cap. The buffer is only allocated once there's something to put
+ * in it, and grows by doubling. Out of memory, it just stops growing.
+ ******************************************************************************/
+static void session_capture_grow(struct Loop *loop, struct Session *s, size_t more) {
+	size_t want = s->capture_length + more;
+	size_t size = s->capture_size ? s->capture_size : CAPTURE_INITIAL;
+	unsigned char *p;
+
+	if (want <= s->capture_size || s->capture_size >= loop->capture_max)
+		return;
+	while (size < want)
+		size *= 2;
+	if (size > loop->capture_max)
+		size = loop->capture_max;
+	p = realloc(s->capture, size);
+	if (p == NULL)
+		return;
+	s->capture = p;
+	s->capture_size = (unsigned short)size;
+}
+
+/******************************************************************************
+ * Run buffered input through the NVT parser. Echo goes straight into the
+ * output buffer. Stops at the end of the input, when the output buffer is
+ * full, when the session goes into its retry delay, or while the shell
+ * still has commands to answer, leaving the rest of the input for later.
+ * Returns -1 if the session was closed.
+ ******************************************************************************/
+static int session_parse(struct Loop *loop, struct Session *s) {
+	if (session_shell(loop, s) < 0)
+		return -1;
+	while (s->in_offset < s->in_length && s->phase != PHASE_DELAY && !s->shell_busy) {
+		struct NvtEcho echo;
+		struct NvtEcho capture;
+		struct NvtEcho *cap = NULL;
+		int line_size;
+		int done;
+
+		if (s->out_length + OUT_RESERVE + NVT_ECHO_MAX > sizeof(s->out))
+			break;
+		echo.buf = s->out;
+		echo.length = s->out_length;
+		echo.max = sizeof(s->out) - OUT_RESERVE;
+		line_size = loop->budget_line ? (int)loop->budget_line + 1 : (int)sizeof(s->login);
+
+		if (loop->capture_max) {
+			session_capture_grow(loop, s, s->in_length - s->in_offset);
+			capture.buf = s->capture;
+			capture.length = s->capture_length;
+			capture.max = s->capture_size;
+			cap = &capture;
+		}
+
+		if (s->phase == PHASE_LOGIN || s->phase == PHASE_SHELL)
+			s->in_offset += nvt_parse(&s->state, s->login, line_size, &s->login_length,
+				s->in + s->in_offset, s->in_length - s->in_offset, &echo, &done, cap);
+		else
+			s->in_offset += nvt_parse(&s->state, s->password, line_size, &s->password_length,
+				s->in + s->in_offset, s->in_length - s->in_offset, &echo, &done, cap);
+		s->out_length = echo.length;
+		if (cap)
+			s->capture_length = (unsigned short)capture.length;
+
+		if (done == NVT_OVERFLOW) {
+			/* with a line budget, that's the end of it; without,
+			 * what there was of the line is used */
+			stat_add(&loop->stats.overflows, 1);
+			if (loop->budget_line) {
+				session_budget(loop, s, BUDGET_LINE);
+				return -1;
+			}
+			print_event(loop->log, s, EVENT_OVERFLOW, 0);
+		}
+		if (done && session_line(loop, s) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/******************************************************************************
+ * With -Z, the kernel tells us through the socket's error queue when it's
+ * done with the pages of a zero-copy send. The canned responses never
+ * change, so we don't care when; we just take the notifications off the
+ * queue so they don't pile up.
+ ******************************************************************************/
+static void session_reap_zerocopy(struct Session *s) {
+	char control[128];
+	struct msghdr msg;
+
+	do {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+	} while (recvmsg(s->fd, &msg, MSG_ERRQUEUE) >= 0);
+}
+
+/******************************************************************************
+ * Get the next chunk of input into 'in', the way recv() would
+ ******************************************************************************/
+static int session_recv(struct Loop *loop, struct Session *s) {
+#ifdef HAVE_LIBURING
+	if (loop->engine == ENGINE_URING)
+		return uring_recv(loop, s, s->in);
+#endif
+	return recv(s->fd, (char*)s->in, sizeof(s->in), loop->flags);
+}
+
+/******************************************************************************
+ * Called whenever the socket is readable or writable. We drain the socket
+ * with large reads into the session's input buffer, let the parser pick the
+ * lines out of it, and send back everything it produced in one go. If the
+ * output backs up because the peer isn't reading, we stop taking input
+ * until the socket becomes writable again.
+ ******************************************************************************/
+static void session_read(struct Loop *loop, struct Session *s) {
+	for (;;) {
+		int len;
+
+		if (session_parse(loop, s) < 0)
+			return;
+		if ((s->in_offset < s->in_length || s->shell_busy) && s->phase != PHASE_DELAY) {
+			/* the parser stopped because there's no room for echo,
+			 * or for the shell's next answer */
+			size_t pending = s->out_length;
+			session_flush(loop, s);
+			if (s->out_length == pending)
+				return; /* wait for EPOLLOUT */
+			continue;
+		}
+		if (s->phase == PHASE_DELAY)
+			break; /* hold on to the rest of the input until later */
+		s->in_offset = 0;
+		s->in_length = 0;
+
+		len = session_recv(loop, s);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			session_error(loop, s, WSAGetLastError());
+			return;
+		}
+		session_touch(loop, s);
+		stat_add(&loop->stats.bytes_in, len);
+		s->bytes_in += len;
+		if (len > 0 && !s->heard) {
+			histogram_record(&loop->stats.latency[LAT_FIRST_BYTE], loop->now_us - s->started);
+			s->heard = 1;
+		}
+		if (len == 0) {
+			/* A partial line still counts when the connection closes,
+			 * but the next read will see the close again and end it */
+			int partial = (s->phase == PHASE_LOGIN || s->phase == PHASE_SHELL)
+				? s->login_length : s->password_length;
+			if (partial == 0) {
+				session_error(loop, s, 0);
+				return;
+			}
+			if (session_line(loop, s) < 0)
+				return;
+			continue;
+		}
+		s->in_length = len;
+	}
+
+	session_flush(loop, s);
+}
+
+/******************************************************************************
+ * Called when a session's timer fires. Sessions over a budget are closed,
+ * sessions waiting out their retry delay get the next "login: " prompt, and
+ * sessions that haven't sent anything in a while are reaped, which is what
+ * the SO_RCVTIMEO on the socket used to do. Receiving data doesn't touch
+ * the timer, it only records the time; when the timer fires early we just
+ * push it back.
+ ******************************************************************************/
+static void session_expire(struct Timer *timer, void *arg) {
+	struct Loop *loop = (struct Loop *)arg;
+	struct Session *s = container_of(timer, struct Session, timer);
+	int budget = session_over_budget(loop, s);
+
+	if (budget >= 0)
+		session_budget(loop, s, budget);
+	else if (s->phase == PHASE_DELAY)
+		session_prompt_login(loop, s, CANNED_RETRY);
+	else if (s->last_rx + RECV_TIMEOUT > loop->now)
+		session_timer(loop, s, session_deadline(loop, s));
+	else
+		session_error(loop, s, WSA(ETIMEDOUT));
+}
+
+/******************************************************************************
+ * Tarpitted connections never get a session: just the descriptor, held
+ * open and never read, until it has been there TARPIT_TIME or we need the
+ * slot. The receive buffer is shrunk so the peer can't send much.
+ ******************************************************************************/
+static void loop_untarpit(struct Timer *timer, void *arg) {
+	struct Loop *loop = (struct Loop *)arg;
+
+	while (loop->tarpit_count && loop->tarpit[loop->tarpit_head].until <= loop->now) {
+		closesocket(loop->tarpit[loop->tarpit_head].fd);
+		loop->tarpit_head = (loop->tarpit_head + 1) % TARPIT_SLOTS;
+		loop->tarpit_count--;
+	}
+	if (loop->tarpit_count)
+		wheel_add(&loop->wheel, timer,
+			(loop->tarpit[loop->tarpit_head].until + TICK_MS - 1) / TICK_MS);
+}
+
+static void loop_tarpit(struct Loop *loop, int fd) {
+	unsigned tail;
+	int size = 1;
+
+	if (loop->tarpit_count == TARPIT_SLOTS) {
+		closesocket(loop->tarpit[loop->tarpit_head].fd);
+		loop->tarpit_head = (loop->tarpit_head + 1) % TARPIT_SLOTS;
+		loop->tarpit_count--;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	tail = (loop->tarpit_head + loop->tarpit_count) % TARPIT_SLOTS;
+	loop->tarpit[tail].fd = fd;
+	loop->tarpit[tail].until = loop->now + TARPIT_TIME;
+	loop->tarpit_count++;
+	if (!timer_pending(&loop->tarpit_timer))
+		wheel_add(&loop->wheel, &loop->tarpit_timer,
+			(loop->now + TARPIT_TIME + TICK_MS - 1) / TICK_MS);
+}
+
+/******************************************************************************
+ * A connection over the per-address limits: close it, or tarpit it, and
+ * say how many there have been once a second at most
+ ******************************************************************************/
+static void loop_limited(struct Loop *loop, int fd, int verdict) {
+	if (loop->penalty == PENALTY_TARPIT && loop->tarpit)
+		loop_tarpit(loop, fd);
+	else
+		closesocket(fd);
+
+	loop->limited++;
+	stat_add(&loop->stats.limited, 1);
+	if (loop->now >= loop->limited_reported + 1000) {
+		NOTICE_MSG("limit,%s %llu connections over the per-address %s limit\n",
+			loop->penalty == PENALTY_TARPIT ? "tarpitted" : "refused",
+			loop->limited, verdict == PEER_RATE ? "rate" : "session");
+		loop->limited = 0;
+		loop->limited_reported = loop->now;
+	}
+}
+
+/******************************************************************************
+ * Every session is in use, so shed load the way -s says. Returns a session
+ * for the new connection if evicting an idle one made room; otherwise the
+ * connection has been dealt with. With io_uring, a closed session can't be
+ * reused until the kernel lets go of it, so evicting doesn't always make
+ * room at once, and then the connection is refused.
+ ******************************************************************************/
+static struct Session *loop_shed(struct Loop *loop, const struct Listener *l, int fd) {
+	static const char *what[SHED_COUNT] = {"refused", "turned away", "evicted for"};
+	struct Session *s = NULL;
+	int shed = loop->shedding;
+
+	if (shed == SHED_EVICT) {
+		struct Session *victim = loop->lru_head;
+
+		if (victim && victim->last_rx + EVICT_IDLE <= loop->now) {
+			session_close(loop, victim);
+			s = pool_alloc(&loop->sessions);
+		}
+		if (s == NULL)
+			shed = SHED_REFUSE;
+	}
+	if (shed == SHED_BANNER) {
+		const struct Canned *c = &profiles[l->profile].canned[CANNED_BUSY];
+		send(fd, c->text, c->length, loop->flags | MSG_DONTWAIT);
+	}
+	if (s == NULL)
+		closesocket(fd);
+
+	stat_add(&loop->stats.shed[shed], 1);
+	loop->shed_unreported++;
+	if (loop->now >= loop->shed_reported + 1000) {
+		NOTICE_MSG("limit,%s %llu connections, %u sessions active\n",
+			what[shed], loop->shed_unreported, loop->sessions.count);
+		loop->shed_unreported = 0;
+		loop->shed_reported = loop->now;
+	}
+	return s;
+}
+
+/******************************************************************************
+ * With -s evict, don't wait until every session is in use: past the high
+ * water mark, close the sessions that have been idle longest, a few at a
+ * time, so that slow ones don't crowd out the connections still to come.
+ * The LRU list is in order of when we last heard from each, so they're
+ * all at the head, and the first one that hasn't been idle long enough
+ * means none of the rest have either.
+ ******************************************************************************/
+static void loop_relieve(struct Loop *loop) {
+	unsigned max = loop->sessions.max;
+	unsigned n;
+
+	if (max == 0 || loop->sessions.count * 100 < max * PRESSURE_HIGH)
+		return;
+	for (n = 0; n < PRESSURE_BATCH && loop->sessions.count * 100 > max * PRESSURE_LOW; n++) {
+		struct Session *victim = loop->lru_head;
+
+		if (victim == NULL || victim->last_rx + EVICT_IDLE > loop->now)
+			break;
+		stat_add(&loop->stats.evictions, 1);
+		session_close(loop, victim);
+	}
+}
+
+/******************************************************************************
+ * Start the session for a connection we've just accepted. The connection is
+ * already non-blocking; here it's added to the epoll set, and from then on
+ * all the work for it happens in response to events.
+ ******************************************************************************/
+static void loop_start_session(struct Loop *loop, const struct Listener *l, int newfd,
+	const struct sockaddr_in6 *peer) {
+	struct Session *s;
+	struct epoll_event ev;
+	unsigned char admitted = 0;
+
+	stat_add(&loop->stats.accepts, 1);
+
+	/* First the per-address limits, so that a connection that is going
+	 * to be refused anyway can't evict sessions to make room for itself.
+	 * The price is that one then refused for want of sessions has still
+	 * used up a token. */
+	if (loop->peers) {
+		int verdict = peertab_admit(loop->peers, peer->sin6_addr.s6_addr, loop->now);
+		if (verdict != PEER_OK) {
+			loop_limited(loop, newfd, verdict);
+			return;
+		}
+		admitted = 1;
+	}
+	if (loop->shedding == SHED_EVICT)
+		loop_relieve(loop);
+
+	/* Then get a structure to hold per-connection data. The pool is
+	 * capped, and once we're at the limit we shed load */
+	s = pool_alloc(&loop->sessions);
+	if (s == NULL) {
+		s = loop_shed(loop, l, newfd);
+		if (s == NULL) {
+			if (admitted)
+				peertab_release(loop->peers, peer->sin6_addr.s6_addr);
+			return;
+		}
+	}
+	s->admitted = admitted;
+	stat_add(&loop->stats.active, 1);
+
+	s->fd = newfd;
+	s->started = loop->now_us;
+	s->id = (uint64_t)loop->index << 48 | (loop->next_id++ & 0xFFFFFFFFFFFFULL);
+	s->timer.handler = session_expire;
+	memcpy(s->addr, &peer->sin6_addr, sizeof(s->addr));
+	s->port = ntohs(peer->sin6_port);
+	s->profile = l->profile;
+	if (loop->listener_count > 1)
+		s->local_port = l->port;
+	print_event(loop->log, s, EVENT_CONNECT, 0);
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = s;
+#ifdef HAVE_LIBURING
+	if (loop->engine == ENGINE_URING) {
+		s->rx_buf = URING_NONE;
+	} else
+#endif
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, newfd, &ev) < 0) {
+		ERROR_MSG("epoll_ctl(%d): %s\n", newfd, error_msg(WSAGetLastError()));
+		session_close(loop, s);
+		return;
+	}
+
+	/* The initial hello, with its negotiation */
+	session_prompt_login(loop, s, CANNED_HELLO);
+}
+
+/******************************************************************************
+ * Called when a listening socket is readable. Accept every connection
+ * that is waiting, not just one, so a burst empties the backlog in one go.
+ *
+ * When we run out of file descriptors, the connection would sit in the
+ * backlog and keep the socket readable forever, so we keep one descriptor
+ * in reserve: give it up, accept the connection, close it straight away,
+ * and take the reserve back. Other errors are about the one connection,
+ * so we just carry on.
+ ******************************************************************************/
+static void loop_accept(struct Loop *loop, const struct Listener *l) {
+	for (;;) {
+		struct sockaddr_in6 peer;
+		socklen_t peerlen = sizeof(peer);
+		int newfd;
+
+		/* accept a new connection, getting the peer address with it */
+		newfd = accept4(l->fd, (struct sockaddr*)&peer, &peerlen,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (newfd >= 0) {
+			loop_start_session(loop, l, newfd, &peer);
+			continue;
+		}
+
+		switch (errno) {
+		case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+		case EWOULDBLOCK:
+#endif
+			return;
+		case EINTR:
+		case ECONNABORTED:
+		case EPROTO:
+			continue;
+		case EMFILE:
+		case ENFILE:
+			ERROR_MSG("accept(%u): %s\n", l->port, "Out of file descriptors");
+			if (loop->reservefd < 0)
+				return;
+			closesocket(loop->reservefd);
+			newfd = accept4(l->fd, 0, 0, SOCK_CLOEXEC);
+			if (newfd >= 0)
+				closesocket(newfd);
+			loop->reservefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+			if (newfd < 0)
+				return;
+			continue;
+		default:
+			/* ENOBUFS, ENOMEM: try again on the next event */
+			ERROR_MSG("accept(%u): %s\n", l->port,
+				error_msg(WSAGetLastError()));
+			return;
+		}
+	}
+}
+
+/******************************************************************************
+ * Draining, when we're stopped or have handed over to a new process: stop
+ * accepting, give the sessions we have until the -D deadline to finish,
+ * then close the rest. The listening sockets stay open, since the new
+ * process may be using them, and main() closes them once every loop is
+ * done. Connections that arrive meanwhile wait in the backlog for it.
+ ******************************************************************************/
+static void loop_drain_expired(struct Timer *timer, void *arg) {
+	struct Loop *loop = (struct Loop *)arg;
+	unsigned long long left = stat_get(&loop->stats.active);
+
+	(void)timer;
+	if (left)
+		NOTICE_MSG("drain,closing %llu sessions still open\n", left);
+	while (loop->lru_head)
+		session_close(loop, loop->lru_head);
+}
+
+static void loop_drain(struct Loop *loop) {
+	unsigned i;
+
+	loop->drain_until = loop->now + loop->drain_time;
+	for (i = 0; i < loop->listener_count; i++) {
+#ifdef HAVE_LIBURING
+		if (loop->engine == ENGINE_URING) {
+			struct io_uring_sqe *sqe = uring_sqe(loop, NULL, URING_IGNORE);
+
+			if (sqe)
+				io_uring_prep_cancel64(sqe, (uint64_t)i << 2 | URING_ACCEPT, 0);
+			continue;
+		}
+#endif
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listeners[i].fd, NULL);
+	}
+	loop->drain_timer.handler = loop_drain_expired;
+	wheel_add(&loop->wheel, &loop->drain_timer, (loop->drain_until + TICK_MS - 1) / TICK_MS);
+}
+
+/* Called each time round the loop: whether it has drained, and can stop.
+ * At the deadline the drain timer closes whatever is left. */
+static int loop_done(struct Loop *loop) {
+	if (loop->drain_until == 0) {
+		if (!atomic_load(&loop->draining))
+			return 0;
+		loop_drain(loop);
+	}
+	return stat_get(&loop->stats.active) == 0;
+}
+
+#ifdef HAVE_LIBURING
+/******************************************************************************
+ * Keep a multishot accept running on each listening socket. It can't give
+ * us each connection's address, so that comes from getpeername(). Instead
+ * of a session, the user data has which listener it is.
+ ******************************************************************************/
+static void uring_arm_accept(struct Loop *loop, const struct Listener *l) {
+	struct io_uring_sqe *sqe = uring_sqe(loop, NULL, URING_ACCEPT);
+
+	if (sqe == NULL)
+		return;
+	io_uring_prep_multishot_accept(sqe, l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	io_uring_sqe_set_data64(sqe, (uint64_t)(l - loop->listeners) << 2 | URING_ACCEPT);
+}
+
+static void uring_accepted(struct Loop *loop, const struct Listener *l, int res) {
+	struct sockaddr_in6 peer;
+	socklen_t peerlen = sizeof(peer);
+
+	if (res >= 0) {
+		if (getpeername(res, (struct sockaddr*)&peer, &peerlen) == 0)
+			loop_start_session(loop, l, res, &peer);
+		else
+			closesocket(res);
+		return;
+	}
+
+	switch (-res) {
+	case EMFILE:
+	case ENFILE:
+		/* the same reserve-descriptor dance as the epoll engine */
+		loop_accept(loop, l);
+		break;
+	case EINTR:
+	case ECONNABORTED:
+	case EPROTO:
+	case ECANCELED:
+		break;
+	default:
+		ERROR_MSG("accept(%u): %s\n", l->port, error_msg(-res));
+		break;
+	}
+}
+
+/******************************************************************************
+ * A recv completed. Like an epoll event, this then runs the session's read
+ * loop, which asks for the next one once it's ready for it.
+ ******************************************************************************/
+static void uring_received(struct Loop *loop, struct Session *s, struct io_uring_cqe *cqe) {
+	s->recv_armed = 0;
+	s->inflight--;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+		loop->buf_free--;
+		if (s->closed || cqe->res <= 0) {
+			uring_put_buf(loop, bid);
+		} else {
+			loop->buf_length[bid] = cqe->res;
+			s->rx_buf = bid;
+		}
+	}
+
+	if (s->closed) {
+		if (s->inflight == 0)
+			pool_free(&loop->sessions, s);
+		return;
+	}
+
+	if (cqe->res == -ENOBUFS) {
+		/* every buffer is in use: start again when some come back */
+		if (!s->starving) {
+			s->starving = 1;
+			s->inflight++;
+			s->starved = loop->starved;
+			loop->starved = s;
+		}
+	} else if (cqe->res <= 0 && cqe->res != -ECANCELED) {
+		s->rx_ended = 1;
+		s->rx_result = cqe->res;
+	}
+
+	session_read(loop, s);
+}
+
+/******************************************************************************
+ * A send finished. Whatever it didn't get to stays queued, and like EPOLLOUT
+ * this lets a session that was held up by its output carry on.
+ ******************************************************************************/
+static void uring_sent(struct Loop *loop, struct Session *s, struct io_uring_cqe *cqe) {
+	int res = cqe->res;
+
+	/* A zero-copy send completes twice: once with the result, and once
+	 * more when the kernel is done with the buffer */
+	if (cqe->flags & IORING_CQE_F_NOTIF) {
+		if (--s->inflight == 0 && s->closed)
+			pool_free(&loop->sessions, s);
+		return;
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		s->inflight--;
+
+	if (s->closed) {
+		if (s->inflight == 0)
+			pool_free(&loop->sessions, s);
+		return;
+	}
+	if (res > 0)
+		stat_add(&loop->stats.bytes_out, res);
+	if (s->canned_sending) {
+		if (res < 0) {
+			s->canned = CANNED_NONE;
+			s->canned_sending = 0;
+			s->out_length = 0;
+		} else if (res < session_canned(s, s->canned)->length)
+			session_unsay(s, res);
+		else {
+			s->canned = CANNED_NONE;
+			s->canned_sending = 0;
+		}
+	} else if (res < 0) {
+		s->sending = 0;
+		s->out_length = 0;
+	} else {
+		s->sending = 0;
+		memmove(s->out, s->out + res, s->out_length - res);
+		s->out_length -= res;
+	}
+	session_read(loop, s);
+}
+
+/******************************************************************************
+ * Start receiving again for sessions that ran out of buffers, for as long
+ * as there are buffers to go round
+ ******************************************************************************/
+static void uring_feed_starved(struct Loop *loop) {
+	while (loop->starved && loop->buf_free) {
+		struct Session *s = loop->starved;
+
+		loop->starved = s->starved;
+		s->starving = 0;
+		s->inflight--;
+		if (s->closed) {
+			if (s->inflight == 0)
+				pool_free(&loop->sessions, s);
+		} else if (!s->rx_ended && !s->recv_armed)
+			uring_arm_recv(loop, s);
+	}
+}
+
+/******************************************************************************
+ * Set up the ring, and the buffers recv picks from. This happens before
+ * any threads start, so that a kernel without io_uring is a startup error.
+ ******************************************************************************/
+static int uring_init(struct Loop *loop) {
+	struct io_uring_params params;
+	unsigned i;
+	int p;
+	int err;
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+	err = io_uring_queue_init_params(URING_ENTRIES, &loop->ring, &params);
+	if (err == -EINVAL) {
+		/* older kernels don't know those flags */
+		memset(&params, 0, sizeof(params));
+		err = io_uring_queue_init_params(URING_ENTRIES, &loop->ring, &params);
+	}
+	if (err < 0) {
+		ERROR_MSG("io_uring_queue_init(): %s\n", strerror(-err));
+		return -1;
+	}
+
+	loop->bufs = io_uring_setup_buf_ring(&loop->ring, URING_BUFS, 0, 0, &err);
+	loop->buf_data = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+	loop->buf_length = malloc(URING_BUFS * sizeof(loop->buf_length[0]));
+	if (loop->bufs == NULL) {
+		ERROR_MSG("io_uring_setup_buf_ring(): %s\n", strerror(-err));
+		io_uring_queue_exit(&loop->ring);
+		return -1;
+	}
+	if (loop->buf_data == NULL || loop->buf_length == NULL) {
+		ERROR_MSG("io_uring: out of memory\n");
+		io_uring_queue_exit(&loop->ring);
+		return -1;
+	}
+	for (i = 0; i < URING_BUFS; i++)
+		uring_put_buf(loop, (unsigned short)i);
+
+	/* With -Z, the canned responses are sent from a registered buffer.
+	 * Registering pins the pages for writing, so they need a copy of
+	 * their own rather than the read-only originals. */
+	if (loop->zerocopy) {
+		struct iovec iov;
+
+		iov.iov_len = uring_canned_offset(PROFILE_COUNT - 1, CANNED_COUNT);
+		iov.iov_base = loop->canned = malloc(iov.iov_len);
+		if (loop->canned == NULL) {
+			ERROR_MSG("io_uring: out of memory\n");
+			io_uring_queue_exit(&loop->ring);
+			return -1;
+		}
+		for (p = 0; p < PROFILE_COUNT; p++) {
+			for (i = CANNED_NONE + 1; i < CANNED_COUNT; i++)
+				memcpy(loop->canned + uring_canned_offset(p, i),
+					profiles[p].canned[i].text, profiles[p].canned[i].length);
+		}
+		err = io_uring_register_buffers(&loop->ring, &iov, 1);
+		if (err < 0) {
+			ERROR_MSG("io_uring_register_buffers(): %s\n", strerror(-err));
+			io_uring_queue_exit(&loop->ring);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/******************************************************************************
+ * The io_uring version of the main loop. One io_uring_enter() both submits
+ * everything queued since the last one and waits for completions, with the
+ * same timeout as epoll_wait() would have.
+ ******************************************************************************/
+static void uring_run(struct Loop *loop) {
+	unsigned i;
+
+	for (i = 0; i < loop->listener_count; i++)
+		uring_arm_accept(loop, &loop->listeners[i]);
+
+	for (;;) {
+		struct __kernel_timespec ts;
+		struct __kernel_timespec *timeout = NULL;
+		struct io_uring_cqe *cqe;
+		unsigned head;
+		unsigned count = 0;
+		uint64_t next;
+		int err;
+
+		next = wheel_next(&loop->wheel);
+		if (next != UINT64_MAX) {
+			next *= TICK_MS;
+			next = (next > loop->now) ? next - loop->now : 0;
+			ts.tv_sec = next / 1000;
+			ts.tv_nsec = (next % 1000) * 1000000;
+			timeout = &ts;
+		}
+
+		err = io_uring_submit_and_wait_timeout(&loop->ring, &cqe, 1, timeout, &loop->waitmask);
+		if (err < 0 && err != -ETIME && err != -EINTR) {
+			ERROR_MSG("io_uring_submit_and_wait(): %s\n", strerror(-err));
+			break;
+		}
+		loop_clock(loop);
+
+		io_uring_for_each_cqe(&loop->ring, head, cqe) {
+			uint64_t data = io_uring_cqe_get_data64(cqe);
+			struct Session *s = (struct Session *)(uintptr_t)(data & ~(uint64_t)3);
+
+			switch (data & 3) {
+			case URING_ACCEPT:
+			{
+				const struct Listener *l = &loop->listeners[data >> 2];
+
+				uring_accepted(loop, l, cqe->res);
+				if (!(cqe->flags & IORING_CQE_F_MORE) && loop->drain_until == 0)
+					uring_arm_accept(loop, l);
+			}
+				break;
+			case URING_RECV:
+				uring_received(loop, s, cqe);
+				break;
+			case URING_SEND:
+				uring_sent(loop, s, cqe);
+				break;
+			}
+			count++;
+		}
+		io_uring_cq_advance(&loop->ring, count);
+
+		uring_feed_starved(loop);
+		wheel_advance(&loop->wheel, loop->now / TICK_MS, loop);
+		if (loop_done(loop))
+			break;
+	}
+}
+#endif
+
+/******************************************************************************
+ * Pin the calling thread to a CPU
+ ******************************************************************************/
+static void pin_to_cpu(int cpu) {
+	cpu_set_t set;
+	int err;
+
+	if (cpu < 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err)
+		ERROR_MSG("pthread_setaffinity_np(%d): %s\n", cpu, error_msg(err));
+}
+
+static void loop_close_listeners(struct Loop *loop) {
+	unsigned i;
+
+	for (i = 0; i < loop->listener_count; i++) {
+		if (!loop->listeners[i].borrowed)
+			closesocket(loop->listeners[i].fd);
+	}
+}
+
+/******************************************************************************
+ * Set up an event loop, opening its listening sockets. This happens before
+ * any threads start, so that a port we can't bind is a startup error.
+ ******************************************************************************/
+static int loop_init(struct Loop *loop, int engine, int zerocopy, const struct Listener *listeners,
+	unsigned listener_count, int reuseport, int backlog, unsigned max_sessions,
+	struct LogRing *log) {
+	struct epoll_event ev;
+	unsigned i;
+
+	loop->engine = engine;
+	loop->zerocopy = zerocopy;
+	loop->log = log;
+	pool_init(&loop->sessions, sizeof(struct Session), max_sessions);
+#ifdef MSG_NOSIGNAL
+	loop->flags |= MSG_NOSIGNAL;
+#endif
+
+	for (i = 0; i < listener_count; i++) {
+		struct Listener *l = &loop->listeners[i];
+
+		/* unless it's one we were handed, see inherit_listeners() */
+		*l = listeners[i];
+		if (l->fd < 0)
+			l->fd = create_ipv6_socket(l->port, reuseport, backlog);
+		if (l->fd <= 0) {
+			loop_close_listeners(loop);
+			return -1;
+		}
+		loop->listener_count++;
+
+		/* accepted connections inherit this, which saves a setsockopt()
+		 * each; the io_uring engine's zero-copy sends don't need it */
+		if (zerocopy && engine == ENGINE_EPOLL && !l->borrowed) {
+			int yes = 1;
+			if (setsockopt(l->fd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)) < 0) {
+				ERROR_MSG("setsockopt(SO_ZEROCOPY): %s\n", error_msg(WSAGetLastError()));
+				loop_close_listeners(loop);
+				return -1;
+			}
+		}
+	}
+	loop->reservefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+#ifdef HAVE_LIBURING
+	if (engine == ENGINE_URING) {
+		loop->epfd = -1;
+		if (uring_init(loop) < 0) {
+			loop_close_listeners(loop);
+			return -1;
+		}
+		return 0;
+	}
+#endif
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		ERROR_MSG("epoll_create1(): %s\n", error_msg(WSAGetLastError()));
+		loop_close_listeners(loop);
+		return -1;
+	}
+	for (i = 0; i < loop->listener_count; i++) {
+		/* a socket all the loops share only wakes one of them */
+		ev.events = EPOLLIN | (loop->listeners[i].shared ? EPOLLEXCLUSIVE : 0);
+		ev.data.ptr = &loop->listeners[i];
+		epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listeners[i].fd, &ev);
+	}
+	return 0;
+}
+
+/* Which listener an epoll event is for, or NULL if it's a session's */
+static struct Listener *loop_listener(struct Loop *loop, void *ptr) {
+	uintptr_t p = (uintptr_t)ptr;
+
+	if (p < (uintptr_t)loop->listeners
+		|| p >= (uintptr_t)(loop->listeners + loop->listener_count))
+		return NULL;
+	return (struct Listener *)ptr;
+}
+
+/******************************************************************************
+ * The credential table. Without -A it only holds the pairs not worth
+ * printing; with it, every pair seen, and a timer to flush the counts.
+ ******************************************************************************/
+static int loop_creds_init(struct Loop *loop, unsigned interval, int by_addr,
+	char **accept, unsigned accept_count) {
+	unsigned i;
+
+	if (credtab_init(&loop->creds, interval ? CRED_TABLE_SIZE : 64, by_addr) < 0)
+		return -1;
+	loop->agg_interval = interval;
+	if (credtab_flag(&loop->creds, "shell", "sh", CRED_SUPPRESS) < 0
+		|| credtab_flag(&loop->creds, "enable", "system", CRED_SUPPRESS) < 0)
+		return -1;
+
+	/* these are login then password, one after the other */
+	for (i = 0; i < accept_count; i++) {
+		if (credtab_flag(&loop->creds, accept[2 * i], accept[2 * i + 1], CRED_ACCEPT) < 0)
+			return -1;
+	}
+	loop->shell = (accept_count != 0);
+	return 0;
+}
+
+static void loop_flush_creds(struct Timer *timer, void *arg) {
+	struct Loop *loop = (struct Loop *)arg;
+
+	credtab_flush(&loop->creds, print_agg, loop->log);
+	wheel_add(&loop->wheel, timer, (loop->now + loop->agg_interval) / TICK_MS);
+}
+
+/******************************************************************************
+ * The most seen, with -K: 'k' addresses and 'k' pairs, reported every
+ * 'interval' ms, and counted from nothing again after each time. The
+ * sampling for -N is set up here too.
+ ******************************************************************************/
+static int loop_top_init(struct Loop *loop, unsigned k, unsigned interval, unsigned sample) {
+	loop->sample = sample;
+	loop->sample_state = clock_ms(CLOCK_REALTIME) * 0x9e3779b97f4a7c15ULL ^ (loop->index + 1);
+	if (k == 0)
+		return 0;
+	if (topk_init(&loop->top_addrs, TOPK_ADDR, k) < 0
+		|| topk_init(&loop->top_pairs, TOPK_PAIR, k) < 0)
+		return -1;
+	loop->top_interval = interval;
+	return 0;
+}
+
+static void print_top(const struct TopEntry *e, void *v_loop) {
+	struct Loop *loop = (struct Loop *)v_loop;
+	struct LogRecord *rec;
+
+	if (loop->log == NULL)
+		return;
+
+	rec = log_reserve(loop->log);
+	if (rec == NULL)
+		return;
+	rec->type = LOG_TOP;
+	rec->time = loop->wallclock;
+	rec->first = loop->top_since;
+	rec->count = e->count;
+	rec->session = 0;
+	memcpy(rec->addr, e->addr, sizeof(rec->addr));
+	rec->port = 0;
+	rec->login_length = e->login_length;
+	memcpy(rec->login, e->key, e->login_length);
+	rec->password_length = e->password_length;
+	memcpy(rec->password, e->key + e->login_length, e->password_length);
+	log_commit(loop->log, rec);
+}
+
+static void loop_flush_top(struct Loop *loop) {
+	topk_flush(&loop->top_addrs, print_top, loop);
+	topk_flush(&loop->top_pairs, print_top, loop);
+	loop->top_since = loop->wallclock;
+}
+
+static void loop_top_expired(struct Timer *timer, void *arg) {
+	struct Loop *loop = (struct Loop *)arg;
+
+	loop_flush_top(loop);
+	wheel_add(&loop->wheel, timer, (loop->now + loop->top_interval) / TICK_MS);
+}
+
+/******************************************************************************
+ * The main loop: one thread, one epoll set, and every connection handled
+ * by advancing its Session whenever its socket becomes readable or its
+ * timer fires. We sleep until the next tick that has a timer due, or until
+ * SIGNAL_WAKE says to drain, which only gets through while we're waiting,
+ * so it can't come between looking at 'draining' and going to sleep. Once
+ * drained, the counts not yet flushed for -A and -K go out before we stop.
+ ******************************************************************************/
+void *daemon_thread(void *v_loop) {
+	struct Loop *loop = (struct Loop *)v_loop;
+
+	pin_to_cpu(loop->cpu);
+	pthread_sigmask(SIG_BLOCK, NULL, &loop->waitmask);
+	sigdelset(&loop->waitmask, SIGNAL_WAKE);
+
+	loop_clock(loop);
+	wheel_init(&loop->wheel, loop->now / TICK_MS);
+	if (loop->agg_interval) {
+		loop->agg_timer.handler = loop_flush_creds;
+		wheel_add(&loop->wheel, &loop->agg_timer, (loop->now + loop->agg_interval) / TICK_MS);
+	}
+	if (loop->top_interval) {
+		loop->top_since = loop->wallclock;
+		loop->top_timer.handler = loop_top_expired;
+		wheel_add(&loop->wheel, &loop->top_timer, (loop->now + loop->top_interval) / TICK_MS);
+	}
+	loop->tarpit_timer.handler = loop_untarpit;
+#ifdef HAVE_LIBURING
+	if (loop->engine == ENGINE_URING) {
+		uring_run(loop);
+		if (loop->agg_interval)
+			credtab_flush(&loop->creds, print_agg, loop->log);
+		if (loop->top_interval)
+			loop_flush_top(loop);
+		return NULL;
+	}
+#endif
+	for (;;) {
+		struct epoll_event events[MAX_EVENTS];
+		uint64_t next;
+		int timeout = -1;
+		int count;
+		unsigned accepting;
+		int i;
+
+		next = wheel_next(&loop->wheel);
+		if (next != UINT64_MAX) {
+			next *= TICK_MS;
+			timeout = (next > loop->now) ? (int)(next - loop->now) : 0;
+		}
+
+		count = epoll_pwait(loop->epfd, events, MAX_EVENTS, timeout, &loop->waitmask);
+		if (count < 0 && errno != EINTR) {
+			ERROR_MSG("epoll_wait(): %s\n", error_msg(WSAGetLastError()));
+			break;
+		}
+		loop_clock(loop);
+
+		/* New connections are accepted after the other events, since
+		 * accepting can evict a session that has one in this batch */
+		accepting = 0;
+		for (i = 0; i < count; i++) {
+			struct Listener *l = loop_listener(loop, events[i].data.ptr);
+
+			if (l)
+				accepting |= 1u << (l - loop->listeners);
+			else {
+				if (loop->zerocopy && (events[i].events & EPOLLERR))
+					session_reap_zerocopy(events[i].data.ptr);
+				session_read(loop, events[i].data.ptr);
+			}
+		}
+		for (i = 0; accepting; i++, accepting >>= 1) {
+			if (accepting & 1)
+				loop_accept(loop, &loop->listeners[i]);
+		}
+
+		wheel_advance(&loop->wheel, loop->now / TICK_MS, loop);
+		if (loop_done(loop))
+			break;
+	}
+
+	closesocket(loop->epfd);
+	if (loop->agg_interval)
+		credtab_flush(&loop->creds, print_agg, loop->log);
+	if (loop->top_interval)
+		loop_flush_top(loop);
+	return NULL;
+}
+
+/******************************************************************************
+ * The page for -M: every loop's counters, added up. This runs in the
+ * metrics thread while the loops carry on, so the totals are only as
+ * consistent as a scrape needs.
+ ******************************************************************************/
+struct MetricsSource {
+	struct Loop *loops;
+	unsigned count;
+	struct Histogram log_latency;	/* the writer's */
+};
+
+static size_t render_metric(char *dst, size_t size, size_t d, const char *name,
+	const char *type, const char *help, const char *label, unsigned long long value) {
+	int n;
+
+	if (help)
+		n = snprintf(dst + d, size - d, "# HELP %s %s\n# TYPE %s %s\n%s%s %llu\n",
+			name, help, name, type, name, label ? label : "", value);
+	else
+		n = snprintf(dst + d, size - d, "%s%s %llu\n", name, label, value);
+	if (n < 0 || (size_t)n >= size - d)
+		return size;
+	return d + n;
+}
+
+static size_t loop_metrics(char *dst, size_t size, void *arg) {
+	static const char *errors[STAT_ERR_COUNT] = {
+		"{error=\"TCP connection closed\"}",
+		"{error=\"TCP connection reset\"}",
+		"{error=\"other\"}",
+	};
+	static const char *latencies[LAT_COUNT][2] = {
+		{"telnetlogger_first_byte_seconds", "Time from accept to the first byte received."},
+		{"telnetlogger_login_line_seconds", "Time from the login prompt to the end of the login line."},
+		{"telnetlogger_password_line_seconds", "Time from the password prompt to the end of the password line."},
+		{"telnetlogger_session_seconds", "Time from accept to close."},
+	};
+	unsigned long long log_latency[HIST_BUCKETS + 1];
+	static const char *policies[SHED_COUNT] = {
+		"{policy=\"refuse\"}",
+		"{policy=\"banner\"}",
+		"{policy=\"evict\"}",
+	};
+	static const char *budgets[BUDGET_COUNT] = {
+		"{budget=\"time\"}",
+		"{budget=\"line\"}",
+		"{budget=\"rate\"}",
+	};
+	struct MetricsSource *source = (struct MetricsSource *)arg;
+	unsigned long long t[sizeof(struct LoopStats) / sizeof(atomic_ullong)];
+	unsigned long long drops = 0;
+	size_t d = 0;
+	unsigned i;
+	size_t j;
+
+	/* every field is a counter, so they can be added up as an array */
+	memset(t, 0, sizeof(t));
+	for (i = 0; i < source->count; i++) {
+		atomic_ullong *c = (atomic_ullong *)&source->loops[i].stats;
+
+		for (j = 0; j < sizeof(t) / sizeof(t[0]); j++)
+			t[j] += stat_get(&c[j]);
+		drops += atomic_load_explicit(&source->loops[i].log->drops, memory_order_relaxed);
+	}
+#define TOTAL(field) t[offsetof(struct LoopStats, field) / sizeof(atomic_ullong)]
+
+#define METRIC(name, type, help, value) \
+	d = render_metric(dst, size, d, "telnetlogger_" name, type, help, NULL, value)
+	METRIC("accepts_total", "counter", "Connections accepted.", TOTAL(accepts));
+	METRIC("sessions_active", "gauge", "Sessions open.", TOTAL(active));
+	METRIC("received_bytes_total", "counter", "Bytes received from peers.", TOTAL(bytes_in));
+	METRIC("sent_bytes_total", "counter", "Bytes sent to peers.", TOTAL(bytes_out));
+	METRIC("credentials_total", "counter", "Login/password pairs received.", TOTAL(credentials));
+	METRIC("timeouts_total", "counter", "Sessions closed for sending nothing.", TOTAL(timeouts));
+	METRIC("limited_total", "counter", "Connections over the per-address limits.", TOTAL(limited));
+	METRIC("captured_bytes_total", "counter", "Bytes captured from sessions, with -C.", TOTAL(captured));
+	METRIC("shells_total", "counter", "Sessions let into the fake shell, with -a.", TOTAL(shells));
+	METRIC("shell_commands_total", "counter", "Lines typed into the fake shell.", TOTAL(commands));
+	METRIC("captures_full_total", "counter", "Sessions that filled their capture buffer.", TOTAL(capture_full));
+	METRIC("line_overflows_total", "counter", "Lines too long to keep all of.", TOTAL(overflows));
+	METRIC("evictions_total", "counter", "Idle sessions closed early as the sessions filled up, with -s evict.", TOTAL(evictions));
+	METRIC("unsampled_total", "counter", "Credentials left out of the log by -N sampling.", TOTAL(unsampled));
+	METRIC("log_drops_total", "counter", "Records dropped because a log ring was full.", drops);
+#undef METRIC
+	for (j = 0; j < STAT_ERR_COUNT; j++)
+		d = render_metric(dst, size, d, "telnetlogger_errors_total", "counter",
+			j ? NULL : "Sessions ended by a receive error, by error.",
+			errors[j], TOTAL(errors[j]));
+	for (j = 0; j < SHED_COUNT; j++)
+		d = render_metric(dst, size, d, "telnetlogger_shed_total", "counter",
+			j ? NULL : "Connections shed at the session limit, by policy.",
+			policies[j], TOTAL(shed[j]));
+	for (j = 0; j < BUDGET_COUNT; j++)
+		d = render_metric(dst, size, d, "telnetlogger_budget_closed_total", "counter",
+			j ? NULL : "Sessions closed for going over a -B budget, by budget.",
+			budgets[j], TOTAL(budget[j]));
+	for (j = 0; j < LAT_COUNT; j++)
+		d = histogram_render(dst, size, d, latencies[j][0], latencies[j][1],
+			&TOTAL(latency[j].buckets[0]));
+#undef TOTAL
+	memset(log_latency, 0, sizeof(log_latency));
+	histogram_merge(log_latency, &source->log_latency);
+	d = histogram_render(dst, size, d, "telnetlogger_log_write_seconds",
+		"Time from a record being queued to it being written out.", log_latency);
+	return d;
+}
+
+/******************************************************************************
+ * Pick the CPU for the n-th event loop, from the CPUs we're allowed to run
+ * on. Returns -1 if we can't tell.
+ ******************************************************************************/
+static int nth_cpu(unsigned n) {
+	cpu_set_t set;
+	int count;
+	int cpu;
+
+	if (sched_getaffinity(0, sizeof(set), &set) != 0)
+		return -1;
+	count = CPU_COUNT(&set);
+	if (count <= 0)
+		return -1;
+	n %= count;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &set) && n-- == 0)
+			return cpu;
+	}
+	return -1;
+}
+
+/******************************************************************************
+ * Get the value for an option, either stuck to the end of it ("-l23") or
+ * as the next parameter ("-l 23")
+ ******************************************************************************/
+static char *option_value(int argc, char *argv[], int *i) {
+	if (argv[*i][2] != '\0')
+		return &argv[*i][2];
+	if (++(*i) >= argc) {
+		fprintf(stderr, "startup,expected parameter after -%c\n", argv[*i - 1][1]);
+		exit(1);
+	}
+	return argv[*i];
+}
+
+/******************************************************************************
+ * Tell systemd how we're getting on, if it's waiting to hear (Type=notify).
+ * A socket name starting with '@' is in the abstract namespace.
+ ******************************************************************************/
+static void notify_systemd(const char *msg) {
+	const char *path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un addr;
+	socklen_t length;
+	int fd;
+
+	if (path == NULL || path[0] == '\0' || strlen(path) >= sizeof(addr.sun_path))
+		return;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (addr.sun_path[0] == '@')
+		addr.sun_path[0] = '\0';
+	length = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+	if (sendto(fd, msg, strlen(msg), MSG_NOSIGNAL, (struct sockaddr *)&addr, length) < 0)
+		ERROR_MSG("notify,%s: %s\n", path, strerror(errno));
+	close(fd);
+}
+
+/******************************************************************************
+ * Listening sockets we were started with, by systemd's socket activation
+ * or by the process we're taking over from (see handoff()), which both
+ * pass them the same way: from descriptor 3 on, LISTEN_FDS of them, if
+ * LISTEN_PID is us. There may be several for a port, one for each event
+ * loop of whoever opened them with SO_REUSEPORT.
+ ******************************************************************************/
+struct Inherited {
+	int fd;
+	unsigned short port;
+	unsigned nth;	/* of the ones for this port */
+};
+
+static unsigned inherit_listeners(struct Inherited *inherited, unsigned max) {
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	unsigned count = 0;
+	unsigned long n;
+	unsigned long i;
+
+	if (pid == NULL || fds == NULL || strtoul(pid, 0, 10) != (unsigned long)getpid())
+		return 0;
+	n = strtoul(fds, 0, 10);
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	for (i = 0; i < n && LISTEN_FDS_START + i < INT_MAX; i++) {
+		int fd = (int)(LISTEN_FDS_START + i);
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof(addr);
+		int listening = 0;
+		socklen_t size = sizeof(listening);
+		unsigned short port;
+		unsigned j;
+
+		if (getsockname(fd, (struct sockaddr *)&addr, &addrlen) < 0
+			|| (addr.ss_family != AF_INET && addr.ss_family != AF_INET6)
+			|| getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &size) < 0
+			|| !listening) {
+			ERROR_MSG("startup,descriptor %d handed to us isn't a listening TCP socket\n", fd);
+			close(fd);
+			continue;
+		}
+		if (count == max) {
+			ERROR_MSG("startup,more than %u listening sockets handed to us\n", max);
+			close(fd);
+			continue;
+		}
+		if (addr.ss_family == AF_INET)
+			port = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+		else
+			port = ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		inherited[count].fd = fd;
+		inherited[count].port = port;
+		inherited[count].nth = 0;
+		for (j = 0; j < count; j++) {
+			if (inherited[j].port == port)
+				inherited[count].nth++;
+		}
+		count++;
+	}
+	return count;
+}
+
+/* How many of them are for 'port' */
+static unsigned inherited_count(const struct Inherited *inherited, unsigned count,
+	unsigned short port) {
+	unsigned n = 0;
+	unsigned i;
+
+	for (i = 0; i < count; i++)
+		n += (inherited[i].port == port);
+	return n;
+}
+
+/* SIGNAL_WAKE only has to interrupt the wait it arrives in */
+static void wake_handler(int sig) {
+	(void)sig;
+}
+
+/******************************************************************************
+ * Hand over to a new process, for SIGHUP: start ourselves again, with the
+ * same command line, giving it our listening sockets the way systemd would
+ * (see inherit_listeners()). Since they're the same sockets, connections
+ * waiting to be accepted stay in the backlog for it, and none are refused
+ * while it starts. It says it's up by writing to a pipe we give it too,
+ * named by HANDOFF_ENV; then we drain. If it fails to come up, we kill it
+ * and carry on as we were.
+ *
+ * Both of us have the same stdout, and writes to a pipe bigger than
+ * PIPE_BUF aren't atomic, so if we both wrote to it, lines (or the framing
+ * of a binary stream) could be torn. So it gets a second pipe, also named
+ * by HANDOFF_ENV, and doesn't write to stdout until it sees end-of-file on
+ * that, which is when '*held' is closed, after our writer has stopped, or
+ * when we exit.
+ *
+ * Between fork() and exec() only async-signal-safe calls may be made, since
+ * the other threads may be holding locks, so everything is got ready first.
+ ******************************************************************************/
+static char self_path[PATH_MAX];
+static char listen_pid[32] = "LISTEN_PID=";
+
+static void handoff_exec(int *fds, unsigned n, int ready, int held, char **argv, char **envp) {
+	char digits[16];
+	unsigned length = 0;
+	unsigned i;
+	pid_t pid = getpid();
+	sigset_t none;
+
+	/* out of the way first, so that placing one can't clobber another */
+	for (i = 0; i < n; i++)
+		fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, LISTEN_FDS_START + n + 2);
+	ready = fcntl(ready, F_DUPFD_CLOEXEC, LISTEN_FDS_START + n + 2);
+	held = fcntl(held, F_DUPFD_CLOEXEC, LISTEN_FDS_START + n + 2);
+	for (i = 0; i < n; i++)
+		dup2(fds[i], LISTEN_FDS_START + i);
+	dup2(ready, LISTEN_FDS_START + n);
+	dup2(held, LISTEN_FDS_START + n + 1);
+
+	do {
+		digits[length++] = '0' + pid % 10;
+		pid /= 10;
+	} while (pid);
+	for (i = 0; i < length; i++)
+		listen_pid[sizeof("LISTEN_PID=") - 1 + i] = digits[length - 1 - i];
+	listen_pid[sizeof("LISTEN_PID=") - 1 + length] = '\0';
+
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+	execve(self_path, argv, envp);
+	_exit(127);
+}
+
+static int handoff(struct Loop *loops, unsigned threads, char **argv, int *held) {
+	extern char **environ;
+	char listen_fds[32];
+	char ready_fd[64];
+	struct pollfd pfd;
+	char **envp;
+	int *fds;
+	unsigned envc = 0;
+	unsigned n = 0;
+	unsigned i;
+	unsigned j;
+	int pipefd[2];
+	int heldfd[2];
+	pid_t pid;
+	char c;
+	int err;
+
+	for (i = 0; environ[i]; i++)
+		;
+	fds = malloc(threads * LISTEN_MAX * sizeof(fds[0]));
+	envp = malloc((i + 4) * sizeof(envp[0]));
+	if (fds == NULL || envp == NULL || pipe2(pipefd, O_CLOEXEC) < 0) {
+		ERROR_MSG("reload,%s\n", strerror(errno));
+		free(fds);
+		free(envp);
+		return -1;
+	}
+	if (pipe2(heldfd, O_CLOEXEC) < 0) {
+		ERROR_MSG("reload,%s\n", strerror(errno));
+		close(pipefd[0]);
+		close(pipefd[1]);
+		free(fds);
+		free(envp);
+		return -1;
+	}
+
+	/* every loop's own, which are all of them */
+	for (j = 0; j < loops[0].listener_count; j++) {
+		for (i = 0; i < threads; i++) {
+			if (!loops[i].listeners[j].borrowed)
+				fds[n++] = loops[i].listeners[j].fd;
+		}
+	}
+	for (i = 0; environ[i]; i++) {
+		if (strncmp(environ[i], "LISTEN_", 7) != 0
+			&& strncmp(environ[i], HANDOFF_ENV "=", sizeof(HANDOFF_ENV)) != 0)
+			envp[envc++] = environ[i];
+	}
+	snprintf(listen_fds, sizeof(listen_fds), "LISTEN_FDS=%u", n);
+	snprintf(ready_fd, sizeof(ready_fd), HANDOFF_ENV "=%u,%u", LISTEN_FDS_START + n,
+		LISTEN_FDS_START + n + 1);
+	envp[envc++] = listen_fds;
+	envp[envc++] = ready_fd;
+	envp[envc++] = listen_pid;
+	envp[envc] = NULL;
+
+	notify_systemd("RELOADING=1");
+	pid = fork();
+	if (pid == 0)
+		handoff_exec(fds, n, pipefd[1], heldfd[0], argv, envp);
+	err = errno;
+	close(pipefd[1]);
+	close(heldfd[0]);
+	free(fds);
+	free(envp);
+	if (pid < 0) {
+		ERROR_MSG("reload,fork(): %s\n", strerror(err));
+		close(pipefd[0]);
+		close(heldfd[1]);
+		notify_systemd("READY=1");
+		return -1;
+	}
+
+	/* it closes its end without writing if it fails to start */
+	pfd.fd = pipefd[0];
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, HANDOFF_TIMEOUT) == 1 && read(pipefd[0], &c, 1) == 1) {
+		close(pipefd[0]);
+		*held = heldfd[1];
+		NOTICE_MSG("reload,handed over to process %d\n", (int)pid);
+		return 0;
+	}
+	close(pipefd[0]);
+	close(heldfd[1]);
+	ERROR_MSG("reload,new process %d didn't start, carrying on\n", (int)pid);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	notify_systemd("READY=1");
+	return -1;
+}
+
+/******************************************************************************
+ ******************************************************************************/
+int main(int argc, char *argv[]) {
+	int i;
+	struct Listener listeners[LISTEN_MAX];
+	unsigned listener_count = 0;
+	int policy = LOG_FULL_DROP;
+	int format = FORMAT_TEXT;
+	int timestamps = 0;
+	int engine = ENGINE_EPOLL;
+	int zerocopy = 0;
+	const char *outdir = NULL;
+	unsigned segment_mb = 64;
+	unsigned segment_age = 3600;
+	unsigned sync_interval = 5;
+	unsigned agg_secs = 0;
+	unsigned top_k = 0;
+	unsigned top_secs = TOP_INTERVAL;
+	unsigned sample = 0;
+	unsigned capture_max = 0;
+	unsigned budget_secs = 0;
+	unsigned budget_line = 0;
+	unsigned budget_rate = 0;
+	char *accept[2 * SHELL_ACCEPT_MAX];
+	unsigned accept_count = 0;
+	int agg_by_addr = 0;
+	unsigned peer_rate = 0;
+	unsigned peer_burst = 0;
+	unsigned peer_sessions = 0;
+	int penalty = PENALTY_CLOSE;
+	int shedding = SHED_REFUSE;
+	const char *metrics = NULL;
+	const char *geo_path = NULL;
+	static struct GeoDb geo;
+	static struct MetricsSource metrics_source;
+	struct PeerTable peers;
+	struct SegmentLog segments;
+	unsigned char header[RECORD_HEADER_SIZE];
+	unsigned threads = 1;
+	int backlog = SOMAXCONN;
+	unsigned max_sessions = MAX_SESSIONS;
+	unsigned drain_secs = DRAIN_TIME;
+	struct Inherited inherited[MAX_THREADS * LISTEN_MAX];
+	unsigned inherited_total;
+	const char *handoff_fd = getenv(HANDOFF_ENV);
+	int hold = -1;
+	int held = -1;
+	char **args;
+	sigset_t signals;
+	int sig;
+	struct Loop *loops;
+	struct LogRing **rings;
+
+	/* What to start again on SIGHUP: ourselves, with the command line as
+	 * it was before the options were picked apart */
+	if (readlink("/proc/self/exe", self_path, sizeof(self_path) - 1) < 0)
+		snprintf(self_path, sizeof(self_path), "%s", argv[0]);
+	args = calloc(argc + 1, sizeof(args[0]));
+	for (i = 0; args && i < argc; i++)
+		args[i] = strdup(argv[i]);
+	if (handoff_fd)
+		unsetenv(HANDOFF_ENV);
+	inherited_total = inherit_listeners(inherited, sizeof(inherited) / sizeof(inherited[0]));
+
+	/* Read configuration parameters */
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] != '-') {
+			fprintf(stderr, "startup,unknown parameter: %s\n", argv[i]);
+			exit(1);
+		}
+		switch (argv[i][1]) {
+		case 'l':
+		{
+			char *arg = option_value(argc, argv, &i);
+			unsigned long port;
+			char *end;
+			int profile = PROFILE_BUSYBOX;
+			unsigned j;
+
+			port = strtoul(arg, &end, 0);
+			if (port < 1 || port > 65535 || (*end != '\0' && *end != '/')) {
+				fprintf(stderr, "startup,expected port number between 1..65535\n");
+				exit(1);
+			}
+			if (*end == '/' && (profile = profile_find(end + 1)) < 0) {
+				fprintf(stderr, "startup,unknown profile '%s', expected one of:", end + 1);
+				for (j = 0; j < PROFILE_COUNT; j++)
+					fprintf(stderr, " %s", profiles[j].name);
+				fprintf(stderr, "\n");
+				exit(1);
+			}
+			for (j = 0; j < listener_count; j++) {
+				if (listeners[j].port == port) {
+					fprintf(stderr, "startup,port %lu given twice\n", port);
+					exit(1);
+				}
+			}
+			if (listener_count == LISTEN_MAX) {
+				fprintf(stderr, "startup,at most %u ports\n", LISTEN_MAX);
+				exit(1);
+			}
+			listeners[listener_count].fd = -1;
+			listeners[listener_count].port = (unsigned short)port;
+			listeners[listener_count].profile = (unsigned char)profile;
+			listener_count++;
+		}
+			break;
+		case 'q':
+		{
+			char *arg = option_value(argc, argv, &i);
+			if (strcmp(arg, "drop") == 0)
+				policy = LOG_FULL_DROP;
+			else if (strcmp(arg, "block") == 0)
+				policy = LOG_FULL_BLOCK;
+			else {
+				fprintf(stderr, "startup,expected 'drop' or 'block' after -q\n");
+				exit(1);
+			}
+		}
+			break;
+		case 't':
+		{
+			char *arg = option_value(argc, argv, &i);
+			if (strtoul(arg, 0, 0) < 1 || strtoul(arg, 0, 0) > MAX_THREADS) {
+				fprintf(stderr, "startup,expected thread count between 1..%u\n", MAX_THREADS);
+				exit(1);
+			}
+			threads = strtoul(arg, 0, 0);
+		}
+			break;
+		case 'b':
+		{
+			char *arg = option_value(argc, argv, &i);
+			if (strtol(arg, 0, 0) < 1) {
+				fprintf(stderr, "startup,expected positive backlog after -b\n");
+				exit(1);
+			}
+			backlog = strtol(arg, 0, 0);
+		}
+			break;
+		case 'm':
+		{
+			char *arg = option_value(argc, argv, &i);
+			if (strtoul(arg, 0, 0) < 1) {
+				fprintf(stderr, "startup,expected session count after -m\n");
+				exit(1);
+			}
+			max_sessions = strtoul(arg, 0, 0);
+		}
+			break;
+		case 'F':
+		{
+			char *arg = option_value(argc, argv, &i);
+			if (strcmp(arg, "txt") == 0 || strcmp(arg, "text") == 0)
+				format = FORMAT_TEXT;
+			else if (strcmp(arg, "bin") == 0)
+				format = FORMAT_BINARY;
+			else {
+				fprintf(stderr, "startup,expected 'txt' or 'bin' after -F\n");
+				exit(1);
+			}
+		}
+			break;
+		case 'T':
+			timestamps = 1;
+			break;
+		case 'Z':
+			zerocopy = 1;
+			break;
+		case 'E':
+		{
+			char *arg = option_value(argc, argv, &i);
+			if (strcmp(arg, "epoll") == 0)
+				engine = ENGINE_EPOLL;
+			else if (strcmp(arg, "uring") == 0) {
+#ifdef HAVE_LIBURING
+				engine = ENGINE_URING;
+#else
+				fprintf(stderr, "startup,built without io_uring, use 'make URING=1'\n");
+				exit(1);
+#endif
+			} else {
+				fprintf(stderr, "startup,expected 'epoll' or 'uring' after -E\n");
+				exit(1);
+			}
+		}
+			break;
+		case 'o':
+			outdir = option_value(argc, argv, &i);
+			break;
+		case 'S':
+		{
+			char *arg = option_value(argc, argv, &i);
+			if (strtoul(arg, 0, 0) < 1 || strtoul(arg, 0, 0) > 65536) {
+				fprintf(stderr, "startup,expected segment size in megabytes after -S\n");
+				exit(1);
+			}
+			segment_mb = strtoul(arg, 0, 0);
+		}
+			break;
+		case 'R':
+		{
+			char *arg = option_value(argc, argv, &i);
+			char *end;
+			unsigned long secs = strtoul(arg, &end, 0);
+
+			/* 0 is never, and a digit first keeps out "-1" */
+			if (!isdigit((unsigned char)arg[0]) || *end != '\0' || secs > 366 * 86400) {
+				fprintf(stderr, "startup,expected seconds between rotations after -R\n");
+				exit(1);
+			}
+			segment_age = secs;
+		}
+			break;
+		case 'Y':
+		{
+			char *arg = option_value(argc, argv, &i);
+			char *end;
+			unsigned long secs = strtoul(arg, &end, 0);
+
+			if (!isdigit((unsigned char)arg[0]) || *end != '\0' || secs > 86400) {
+				fprintf(stderr, "startup,expected seconds between syncs after -Y\n");
+				exit(1);
+			}
+			sync_interval = secs;
+		}
+			break;
+		case 'r':
+		{
+			char *arg = option_value(argc, argv, &i);
+			char *end;
+
+			peer_rate = strtoul(arg, &end, 0);
+			if (*end == ',')
+				peer_burst = strtoul(end + 1, &end, 0);
+			if (peer_rate < 1 || peer_rate > 1000000 || *end != '\0'
+				|| peer_burst > 1000000) {
+				fprintf(stderr, "startup,expected connections per second[,burst] after -r\n");
+				exit(1);
+			}
+		}
+			break;
+		case 'B':
+		{
+			char *arg = option_value(argc, argv, &i);
+			char *end;
+
+			budget_secs = strtoul(arg, &end, 0);
+			if (*end == ',')
+				budget_line = strtoul(end + 1, &end, 0);
+			if (*end == ',')
+				budget_rate = strtoul(end + 1, &end, 0);
+			if (*end != '\0' || budget_secs > 86400 || budget_line > 255 || budget_rate > 1000000
+				|| (budget_secs == 0 && budget_line == 0 && budget_rate == 0)) {
+				fprintf(stderr, "startup,expected secs[,line-bytes[,bytes-per-sec]] after -B\n");
+				exit(1);
+			}
+		}
+			break;
+		case 'c':
+		{
+			char *arg = option_value(argc, argv, &i);
+			if (strtoul(arg, 0, 0) < 1) {
+				fprintf(stderr, "startup,expected session count after -c\n");
+				exit(1);
+			}
+			peer_sessions = strtoul(arg, 0, 0);
+		}
+			break;
+		case 'P':
+		{
+			char *arg = option_value(argc, argv, &i);
+			if (strcmp(arg, "close") == 0)
+				penalty = PENALTY_CLOSE;
+			else if (strcmp(arg, "tarpit") == 0)
+				penalty = PENALTY_TARPIT;
+			else {
+				fprintf(stderr, "startup,expected 'close' or 'tarpit' after -P\n");
+				exit(1);
+			}
+		}
+			break;
+		case 'M':
+			metrics = option_value(argc, argv, &i);
+			break;
+		case 'g':
+			geo_path = option_value(argc, argv, &i);
+			break;
+		case 's':
+		{
+			char *arg = option_value(argc, argv, &i);
+			if (strcmp(arg, "refuse") == 0)
+				shedding = SHED_REFUSE;
+			else if (strcmp(arg, "banner") == 0)
+				shedding = SHED_BANNER;
+			else if (strcmp(arg, "evict") == 0)
+				shedding = SHED_EVICT;
+			else {
+				fprintf(stderr, "startup,expected 'refuse', 'banner' or 'evict' after -s\n");
+				exit(1);
+			}
+		}
+			break;
+		case 'A':
+		{
+			char *arg = option_value(argc, argv, &i);
+			char *end;
+
+			agg_secs = strtoul(arg, &end, 0);
+			if (agg_secs < 1 || agg_secs > 86400
+				|| (*end != '\0' && strcmp(end, ",ip") != 0)) {
+				fprintf(stderr, "startup,expected seconds[,ip] after -A\n");
+				exit(1);
+			}
+			agg_by_addr = (*end != '\0');
+		}
+			break;
+		case 'K':
+		{
+			char *arg = option_value(argc, argv, &i);
+			char *end;
+
+			top_k = strtoul(arg, &end, 0);
+			if (*end == ',')
+				top_secs = strtoul(end + 1, &end, 0);
+			if (*end != '\0' || top_k < 1 || top_k > TOPK_MAX || top_secs < 1 || top_secs > 86400) {
+				fprintf(stderr, "startup,expected count 1..%u[,seconds] after -K\n", TOPK_MAX);
+				exit(1);
+			}
+		}
+			break;
+		case 'N':
+		{
+			char *end;
+
+			sample = strtoul(option_value(argc, argv, &i), &end, 0);
+			if (*end != '\0' || sample < 1 || sample > 1000000) {
+				fprintf(stderr, "startup,expected 1 in how many to log after -N\n");
+				exit(1);
+			}
+		}
+			break;
+		case 'a':
+		{
+			char *arg = option_value(argc, argv, &i);
+			char *colon = strchr(arg, ':');
+
+			if (colon == NULL || colon == arg || accept_count == SHELL_ACCEPT_MAX) {
+				fprintf(stderr, "startup,expected login:password after -a, at most %u of them\n",
+					SHELL_ACCEPT_MAX);
+				exit(1);
+			}
+			*colon = '\0';
+			accept[2 * accept_count] = arg;
+			accept[2 * accept_count + 1] = colon + 1;
+			accept_count++;
+		}
+			break;
+		case 'C':
+		{
+			char *end;
+
+			capture_max = strtoul(option_value(argc, argv, &i), &end, 0);
+			if (*end != '\0' || capture_max < 1 || capture_max > RECORD_CAPTURE_MAX) {
+				fprintf(stderr, "startup,expected capture size 1..%u after -C\n", RECORD_CAPTURE_MAX);
+				exit(1);
+			}
+		}
+			break;
+		case 'D':
+		{
+			char *end;
+
+			drain_secs = strtoul(option_value(argc, argv, &i), &end, 0);
+			if (*end != '\0' || drain_secs > 86400) {
+				fprintf(stderr, "startup,expected seconds after -D\n");
+				exit(1);
+			}
+		}
+			break;
+		case 'v':
+		{
+			char *arg = option_value(argc, argv, &i);
+			char *end;
+
+			verbosity = strtol(arg, &end, 0);
+			if (*end != '\0' || verbosity < VERBOSE_ERROR || verbosity > VERBOSE_EVENT) {
+				fprintf(stderr, "startup,expected verbosity 0..2 after -v\n");
+				exit(1);
+			}
+		}
+			break;
+		case 'h':
+		case '?':
+		case 'H':
+			fprintf(stderr, "usage:\n telnetlogger [-l port[/profile]] [-t threads] [-b backlog] [-m sessions] [-s refuse|banner|evict] [-q drop|block] [-F txt|bin] [-T] [-E epoll|uring] [-Z]\n\t[-A secs[,ip]] [-K k[,secs]] [-N n] [-C bytes] [-a login:password] [-B secs[,line[,rate]]] [-r rate[,burst]] [-c sessions] [-P close|tarpit]\n\t[-M [addr:]port|/path] [-g geo-db] [-v 0|1|2] [-D drain-secs] [-o dir] [-S megabytes] [-R rotate-secs] [-Y sync-secs]\n");
+			exit(1);
+			break;
+		}
+	}
+
+	/* Without -l, the ports we were handed, or failing that the one port
+	 * telnet is on. With it, sockets handed to us for other ports aren't
+	 * wanted, nor more for a port than we have loops to use them. */
+	if (listener_count == 0) {
+		for (i = 0; i < (int)inherited_total; i++) {
+			if (inherited[i].nth != 0)
+				continue;
+			if (listener_count == LISTEN_MAX) {
+				fprintf(stderr, "startup,at most %u ports\n", LISTEN_MAX);
+				exit(1);
+			}
+			listeners[listener_count].fd = -1;
+			listeners[listener_count].port = inherited[i].port;
+			listeners[listener_count].profile = PROFILE_BUSYBOX;
+			listener_count++;
+		}
+	}
+	if (listener_count == 0) {
+		listeners[0].fd = -1;
+		listeners[0].port = DEFAULT_PORT;
+		listeners[0].profile = PROFILE_BUSYBOX;
+		listener_count = 1;
+	}
+	for (i = 0; i < (int)inherited_total; i++) {
+		unsigned j;
+
+		for (j = 0; j < listener_count; j++) {
+			if (listeners[j].port == inherited[i].port)
+				break;
+		}
+		if (j == listener_count || inherited[i].nth >= threads) {
+			NOTICE_MSG("startup,closing socket handed to us for port %u\n", inherited[i].port);
+			close(inherited[i].fd);
+			inherited[i].fd = -1;
+		}
+	}
+
+	/* Binary records always carry their time; text only if asked */
+	if (timestamps && format == FORMAT_TEXT)
+		format = FORMAT_TEXT_TIME;
+
+	/* The per-address limits are shared by all the loops, since the
+	 * kernel spreads each address's connections over all of them */
+	if (peer_rate || peer_sessions) {
+		if (peer_rate && peer_burst == 0)
+			peer_burst = peer_rate;
+		if (peertab_init(&peers, PEER_TABLE_SIZE, peer_rate, peer_burst, peer_sessions) < 0) {
+			fprintf(stderr, "startup,out of memory\n");
+			exit(1);
+		}
+	}
+
+	/* One event loop per thread, each with its own listening sockets and
+	 * its own ring to the log writer */
+	loops = aligned_alloc(64, threads * sizeof(loops[0]));
+	if (loops)
+		memset(loops, 0, threads * sizeof(loops[0]));
+	rings = calloc(threads, sizeof(rings[0]));
+	if (loops == NULL || rings == NULL) {
+		fprintf(stderr, "startup,out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < (int)threads; i++) {
+		struct Listener mine[LISTEN_MAX];
+		unsigned j;
+
+		/* A port we were handed k sockets for: loop i takes the
+		 * (i % k)'th, and if there are more loops than sockets, they
+		 * share, and only the first loop to take each one owns it */
+		for (j = 0; j < listener_count; j++) {
+			unsigned k = inherited_count(inherited, inherited_total, listeners[j].port);
+			unsigned m;
+
+			if (k > threads)
+				k = threads;
+			mine[j] = listeners[j];
+			mine[j].shared = 0;
+			mine[j].borrowed = 0;
+			for (m = 0; k && m < inherited_total; m++) {
+				if (inherited[m].port == listeners[j].port && inherited[m].nth == i % k) {
+					mine[j].fd = inherited[m].fd;
+					mine[j].shared = k < threads;
+					mine[j].borrowed = (unsigned)i >= k;
+				}
+			}
+		}
+
+		rings[i] = log_ring_create(LOG_RING_SIZE, policy);
+		if (rings[i] == NULL) {
+			fprintf(stderr, "startup,could not create log ring\n");
+			exit(1);
+		}
+		loops[i].index = i;
+		loops[i].cpu = (threads > 1) ? nth_cpu(i) : -1;
+		if (loop_init(&loops[i], engine, zerocopy, mine, listener_count, threads > 1,
+				backlog, (max_sessions + threads - 1) / threads, rings[i]) < 0)
+			exit(1);
+		if (loop_creds_init(&loops[i], agg_secs * 1000, agg_by_addr, accept, accept_count) < 0
+			|| loop_top_init(&loops[i], top_k, top_secs * 1000, sample) < 0) {
+			fprintf(stderr, "startup,out of memory\n");
+			exit(1);
+		}
+		loops[i].shedding = shedding;
+		loops[i].capture_max = capture_max;
+		loops[i].budget_time = budget_secs * 1000;
+		loops[i].budget_line = budget_line;
+		loops[i].budget_rate = budget_rate;
+		loops[i].drain_time = drain_secs * 1000;
+		if (peer_rate || peer_sessions) {
+			loops[i].peers = &peers;
+			loops[i].penalty = penalty;
+			if (penalty == PENALTY_TARPIT)
+				loops[i].tarpit = calloc(TARPIT_SLOTS, sizeof(loops[i].tarpit[0]));
+		}
+	}
+
+	/* With -o, output goes to segment files instead of stdout. Open the
+	 * first one now so that a bad directory is reported at startup. */
+	if (outdir) {
+		segment_init(&segments, outdir, (size_t)segment_mb << 20, segment_age, sync_interval);
+		if (format == FORMAT_BINARY) {
+			segments.suffix = ".bin";
+			segments.header = header;
+			segments.header_length = record_binary_header(header);
+		}
+		if (segment_open(&segments) < 0) {
+			fprintf(stderr, "startup,%s: %s\n", outdir, strerror(errno));
+			exit(1);
+		}
+	}
+
+	/* A binary stream starts with its header, unless we're taking over
+	 * one that already has it */
+	if (format == FORMAT_BINARY && outdir == NULL && handoff_fd == NULL) {
+		size_t length = record_binary_header(header);
+
+		if (write(STDOUT_FILENO, header, length) != (ssize_t)length) {
+			fprintf(stderr, "startup,stdout: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+
+	/* The signals that stop or reload us are taken by this thread alone,
+	 * with sigwait(), so every thread we start has them blocked; the event
+	 * loops unblock SIGNAL_WAKE only while they wait for events. */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGNAL_WAKE);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	{
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = wake_handler;
+		sigaction(SIGNAL_WAKE, &sa, NULL);
+	}
+	sigdelset(&signals, SIGNAL_WAKE);
+
+	/* Metrics are served from a thread of their own, which only reads
+	 * the loops' counters */
+	if (metrics) {
+		metrics_source.loops = loops;
+		metrics_source.count = threads;
+		if (metrics_start(metrics, loop_metrics, &metrics_source) < 0) {
+			fprintf(stderr, "startup,metrics on %s: %s\n", metrics, strerror(errno));
+			exit(1);
+		}
+	}
+
+	/* The ASN and country database is only mapped, not read: pages come
+	 * in as lookups touch them */
+	if (geo_path && geo_open(&geo, geo_path) < 0) {
+		fprintf(stderr, "startup,%s: %s\n", geo_path,
+			errno == EINVAL ? "not a database made by geogen on this machine" : strerror(errno));
+		exit(1);
+	}
+
+	/* All output goes through the rings to a writer thread of its own.
+	 * Taking over stdout from another process, it waits until that one's
+	 * writer is done with it; segments are our own. */
+	if (handoff_fd && strchr(handoff_fd, ',')) {
+		hold = atoi(strchr(handoff_fd, ',') + 1);
+		fcntl(hold, F_SETFD, FD_CLOEXEC);
+		if (outdir) {
+			close(hold);
+			hold = -1;
+		}
+	}
+	if (log_writer_start(rings, threads, STDOUT_FILENO, hold, outdir ? &segments : NULL, format,
+			metrics ? &metrics_source.log_latency : NULL, geo_path ? &geo : NULL) < 0) {
+		fprintf(stderr, "startup,could not start log writer\n");
+		exit(1);
+	}
+
+	for (i = 0; i < (int)threads; i++) {
+		int err = pthread_create(&loops[i].handle, 0, daemon_thread, &loops[i]);
+		if (err) {
+			fprintf(stderr, "startup,pthread_create(): %s\n", strerror(err));
+			exit(1);
+		}
+	}
+
+	/* Up: tell whoever started us, systemd or the process we're taking
+	 * over from */
+	{
+		char msg[64];
+
+		snprintf(msg, sizeof(msg), "READY=1\nMAINPID=%d", (int)getpid());
+		notify_systemd(msg);
+	}
+	if (handoff_fd) {
+		int fd = atoi(handoff_fd);
+
+		if (write(fd, "", 1) < 0)
+			ERROR_MSG("startup,%s: %s\n", HANDOFF_ENV, strerror(errno));
+		close(fd);
+	}
+
+	/* Until we're told to stop, or have handed over to a new process */
+	for (;;) {
+		if (sigwait(&signals, &sig) != 0)
+			continue;
+		if (sig == SIGHUP) {
+			if (handoff(loops, threads, args, &held) == 0)
+				break;
+			continue;
+		}
+		notify_systemd("STOPPING=1");
+		break;
+	}
+
+	/* Then drain: every loop stops accepting and waits for its sessions,
+	 * and once they're all done, what's left in the rings is written out */
+	for (i = 0; i < (int)threads; i++) {
+		atomic_store(&loops[i].draining, 1);
+		pthread_kill(loops[i].handle, SIGNAL_WAKE);
+	}
+	for (i = 0; i < (int)threads; i++)
+		pthread_join(loops[i].handle, NULL);
+	for (i = 0; i < (int)threads; i++)
+		loop_close_listeners(&loops[i]);
+	log_writer_stop(rings[0]);
+	if (held >= 0)
+		close(held);
+
+	return 0;
+}
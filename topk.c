@@ -0,0 +1,246 @@
+/******************************************************************************
+ * Heavy hitters, with a Count-Min Sketch and a heap. See topk.h.
+ ******************************************************************************/
+#include "topk.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* FNV-1a over the key, as in credtab.c, then mixed, since the sketch's
+ * rows take their hashes from both halves */
+static uint64_t topk_hash(const struct TopK *top, const unsigned char *addr,
+	const char *login, size_t login_length, const char *password, size_t password_length) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	if (top->kind == TOPK_ADDR) {
+		for (i = 0; i < 16; i++)
+			h = (h ^ addr[i]) * 0x100000001b3ULL;
+	} else {
+		for (i = 0; i < login_length; i++)
+			h = (h ^ (unsigned char)login[i]) * 0x100000001b3ULL;
+		h = (h ^ 0x100) * 0x100000001b3ULL;
+		for (i = 0; i < password_length; i++)
+			h = (h ^ (unsigned char)password[i]) * 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+int topk_init(struct TopK *top, int kind, unsigned k) {
+	unsigned slots = 16;
+
+	while (slots < 2 * k)
+		slots *= 2;
+	memset(top, 0, sizeof(*top));
+	top->kind = kind;
+	top->k = k;
+	top->sketch = calloc((size_t)TOPK_DEPTH * TOPK_WIDTH, sizeof(top->sketch[0]));
+	top->entries = calloc(k, sizeof(top->entries[0]));
+	top->heap = calloc(k, sizeof(top->heap[0]));
+	top->slots = calloc(slots, sizeof(top->slots[0]));
+	if (top->sketch == NULL || top->entries == NULL || top->heap == NULL || top->slots == NULL)
+		return -1;
+	top->slot_mask = slots - 1;
+	return 0;
+}
+
+/******************************************************************************
+ * Add one to the sketch, conservatively: only the counters that are at the
+ * minimum go up. Row i's counter is at h1 + i * h2, which is as good as
+ * TOPK_DEPTH independent hashes. Returns the new estimate.
+ ******************************************************************************/
+static unsigned sketch_add(struct TopK *top, uint64_t hash) {
+	uint32_t h1 = (uint32_t)hash;
+	uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+	uint32_t *counters[TOPK_DEPTH];
+	uint32_t least = UINT32_MAX;
+	unsigned i;
+
+	for (i = 0; i < TOPK_DEPTH; i++) {
+		counters[i] = &top->sketch[(size_t)i * TOPK_WIDTH + ((h1 + i * h2) & (TOPK_WIDTH - 1))];
+		if (*counters[i] < least)
+			least = *counters[i];
+	}
+	if (least == UINT32_MAX)
+		return least;
+	for (i = 0; i < TOPK_DEPTH; i++) {
+		if (*counters[i] == least)
+			*counters[i] = least + 1;
+	}
+	return least + 1;
+}
+
+/******************************************************************************
+ * The hash table from keys to entries. It's open addressing with linear
+ * probing; removing an entry moves the ones after it back, so that there
+ * are never any tombstones.
+ ******************************************************************************/
+static unsigned *slot_find(struct TopK *top, uint64_t hash, const unsigned char *addr,
+	const char *login, size_t login_length, const char *password, size_t password_length) {
+	unsigned i = (unsigned)hash & top->slot_mask;
+
+	for (;;) {
+		unsigned *slot = &top->slots[i];
+		const struct TopEntry *e;
+
+		if (*slot == 0)
+			return slot;
+		e = &top->entries[*slot - 1];
+		if (e->hash == hash) {
+			if (top->kind == TOPK_ADDR && memcmp(e->addr, addr, 16) == 0)
+				return slot;
+			if (top->kind == TOPK_PAIR && e->login_length == login_length
+				&& e->password_length == password_length
+				&& memcmp(e->key, login, login_length) == 0
+				&& memcmp(e->key + login_length, password, password_length) == 0)
+				return slot;
+		}
+		i = (i + 1) & top->slot_mask;
+	}
+}
+
+static void slot_remove(struct TopK *top, const struct TopEntry *e) {
+	unsigned index = (unsigned)(e - top->entries) + 1;
+	unsigned i = (unsigned)e->hash & top->slot_mask;
+	unsigned j;
+
+	while (top->slots[i] != index)
+		i = (i + 1) & top->slot_mask;
+	top->slots[i] = 0;
+
+	/* anything after it that would have gone at or before the hole does */
+	for (j = (i + 1) & top->slot_mask; top->slots[j]; j = (j + 1) & top->slot_mask) {
+		unsigned home = (unsigned)top->entries[top->slots[j] - 1].hash & top->slot_mask;
+
+		if (((j - home) & top->slot_mask) >= ((j - i) & top->slot_mask)) {
+			top->slots[i] = top->slots[j];
+			top->slots[j] = 0;
+			i = j;
+		}
+	}
+}
+
+/******************************************************************************
+ * The min-heap on count
+ ******************************************************************************/
+static unsigned heap_count(const struct TopK *top, unsigned at) {
+	return top->entries[top->heap[at]].count;
+}
+
+static void heap_swap(struct TopK *top, unsigned a, unsigned b) {
+	unsigned x = top->heap[a];
+
+	top->heap[a] = top->heap[b];
+	top->heap[b] = x;
+	top->entries[top->heap[a]].heap = a;
+	top->entries[top->heap[b]].heap = b;
+}
+
+static void heap_up(struct TopK *top, unsigned at) {
+	while (at > 0 && heap_count(top, (at - 1) / 2) > heap_count(top, at)) {
+		heap_swap(top, at, (at - 1) / 2);
+		at = (at - 1) / 2;
+	}
+}
+
+static void heap_down(struct TopK *top, unsigned at) {
+	for (;;) {
+		unsigned least = at;
+		unsigned child = 2 * at + 1;
+
+		if (child < top->count && heap_count(top, child) < heap_count(top, least))
+			least = child;
+		if (child + 1 < top->count && heap_count(top, child + 1) < heap_count(top, least))
+			least = child + 1;
+		if (least == at)
+			return;
+		heap_swap(top, at, least);
+		at = least;
+	}
+}
+
+static void entry_set(struct TopK *top, struct TopEntry *e, uint64_t hash, const unsigned char *addr,
+	const char *login, size_t login_length, const char *password, size_t password_length) {
+	e->hash = hash;
+	if (top->kind == TOPK_ADDR) {
+		memcpy(e->addr, addr, 16);
+		return;
+	}
+	e->login_length = (unsigned char)login_length;
+	e->password_length = (unsigned char)password_length;
+	memcpy(e->key, login, login_length);
+	memcpy(e->key + login_length, password, password_length);
+}
+
+void topk_add(struct TopK *top, const unsigned char addr[16],
+	const char *login, size_t login_length, const char *password, size_t password_length) {
+	uint64_t hash;
+	unsigned estimate;
+	unsigned *slot;
+	struct TopEntry *e;
+
+	if (top->kind == TOPK_PAIR) {
+		if (login_length > 255)
+			login_length = 255;
+		if (password_length > 255)
+			password_length = 255;
+	}
+	hash = topk_hash(top, addr, login, login_length, password, password_length);
+	estimate = sketch_add(top, hash);
+	slot = slot_find(top, hash, addr, login, login_length, password, password_length);
+
+	/* one we have: it can only have gone up */
+	if (*slot) {
+		e = &top->entries[*slot - 1];
+		e->count = estimate;
+		heap_down(top, e->heap);
+		return;
+	}
+
+	/* room for another */
+	if (top->count < top->k) {
+		e = &top->entries[top->count];
+		entry_set(top, e, hash, addr, login, login_length, password, password_length);
+		e->count = estimate;
+		e->heap = top->count;
+		top->heap[top->count++] = (unsigned)(e - top->entries);
+		*slot = (unsigned)(e - top->entries) + 1;
+		heap_up(top, e->heap);
+		return;
+	}
+
+	/* or in place of the least, if it's now seen more */
+	e = &top->entries[top->heap[0]];
+	if (estimate <= e->count)
+		return;
+	slot_remove(top, e);
+	entry_set(top, e, hash, addr, login, login_length, password, password_length);
+	e->count = estimate;
+	slot = slot_find(top, hash, addr, login, login_length, password, password_length);
+	*slot = (unsigned)(e - top->entries) + 1;
+	heap_down(top, 0);
+}
+
+static int most_first(const void *a, const void *b) {
+	const struct TopEntry *x = *(const struct TopEntry *const *)a;
+	const struct TopEntry *y = *(const struct TopEntry *const *)b;
+
+	return (x->count < y->count) - (x->count > y->count);
+}
+
+void topk_flush(struct TopK *top, void (*emit)(const struct TopEntry *entry, void *arg), void *arg) {
+	const struct TopEntry *sorted[TOPK_MAX];
+	unsigned i;
+
+	for (i = 0; i < top->count; i++)
+		sorted[i] = &top->entries[i];
+	qsort(sorted, top->count, sizeof(sorted[0]), most_first);
+	for (i = 0; i < top->count; i++)
+		emit(sorted[i], arg);
+
+	memset(top->sketch, 0, (size_t)TOPK_DEPTH * TOPK_WIDTH * sizeof(top->sketch[0]));
+	memset(top->slots, 0, (top->slot_mask + 1) * sizeof(top->slots[0]));
+	top->count = 0;
+}
@@ -0,0 +1,62 @@
+#ifndef TOPK_H
+#define TOPK_H
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************************************************************
+ * The heavy hitters, for -K: the K source addresses, or login/password
+ * pairs, seen most often, in memory that doesn't grow however many distinct
+ * ones there are. Each event loop has one of each, so there is no locking.
+ *
+ * Every sighting goes into a Count-Min Sketch, TOPK_DEPTH rows of
+ * TOPK_WIDTH counters, each row indexed by a different hash of the key; the
+ * smallest of its counters is an estimate of how often a key was seen that
+ * is never too low, and with conservative updates (only the counters at
+ * that minimum go up) is rarely far too high. The K keys with the highest
+ * estimates are kept, keys and all, in a min-heap, Space-Saving style: a
+ * key not in it takes the place of the one at the top once its estimate is
+ * higher. A small hash table finds a key's place in the heap.
+ ******************************************************************************/
+#define TOPK_DEPTH 4
+#define TOPK_WIDTH 16384
+#define TOPK_MAX 1000
+
+enum {
+	TOPK_ADDR,	/* keyed by source address */
+	TOPK_PAIR,	/* keyed by login and password */
+};
+
+struct TopEntry {
+	uint64_t hash;
+	unsigned count;		/* the estimate */
+	unsigned heap;		/* where it is in the heap */
+	unsigned char addr[16];	/* TOPK_ADDR */
+	unsigned char login_length;	/* TOPK_PAIR */
+	unsigned char password_length;
+	char key[2 * 255];	/* login then password */
+};
+
+struct TopK {
+	int kind;		/* TOPK_xxx */
+	unsigned k;
+	unsigned count;		/* entries in use */
+	uint32_t *sketch;	/* TOPK_DEPTH rows of TOPK_WIDTH */
+	struct TopEntry *entries;
+	unsigned *heap;		/* entries, least count first */
+	unsigned *slots;	/* entry + 1, or 0 for empty */
+	unsigned slot_mask;
+};
+
+int topk_init(struct TopK *top, int kind, unsigned k);
+
+/* Count one sighting */
+void topk_add(struct TopK *top, const unsigned char addr[16],
+	const char *login, size_t login_length, const char *password, size_t password_length);
+
+/******************************************************************************
+ * Call 'emit' for each entry, the most often seen first, then start
+ * counting again from nothing.
+ ******************************************************************************/
+void topk_flush(struct TopK *top, void (*emit)(const struct TopEntry *entry, void *arg), void *arg);
+
+#endif
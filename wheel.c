@@ -0,0 +1,138 @@
+/******************************************************************************
+ * Hierarchical timer wheel. See wheel.h.
+ ******************************************************************************/
+#include "wheel.h"
+#include <string.h>
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+/******************************************************************************
+ * Put a timer in the slot for its expiry, relative to the wheel's current
+ * tick. Timers too far in the future go at the far end of the last level
+ * and get re-sorted when they cascade down.
+ ******************************************************************************/
+static void wheel_link(struct Wheel *wheel, struct Timer *timer) {
+	uint64_t expires = timer->expires;
+	uint64_t delta;
+	struct Timer **slot;
+	unsigned level;
+
+	if (expires < wheel->now)
+		expires = wheel->now;
+	delta = expires - wheel->now;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (delta < (1ULL << ((level + 1) * WHEEL_BITS)))
+			break;
+	}
+	if (delta >= (1ULL << (WHEEL_LEVELS * WHEEL_BITS)))
+		expires = wheel->now + (1ULL << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+
+	slot = &wheel->slots[level][(expires >> (level * WHEEL_BITS)) & WHEEL_MASK];
+	timer->next = *slot;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+	timer->pprev = slot;
+	*slot = timer;
+}
+
+static void wheel_unlink(struct Timer *timer) {
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+void wheel_init(struct Wheel *wheel, uint64_t now) {
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->now = now;
+}
+
+void wheel_add(struct Wheel *wheel, struct Timer *timer, uint64_t expires) {
+	if (timer->pprev)
+		wheel_unlink(timer);
+	else
+		wheel->count++;
+	timer->expires = expires;
+	wheel_link(wheel, timer);
+}
+
+void wheel_cancel(struct Wheel *wheel, struct Timer *timer) {
+	if (timer->pprev == NULL)
+		return;
+	wheel_unlink(timer);
+	wheel->count--;
+}
+
+/******************************************************************************
+ * Move every timer in one slot of a higher level down to where it belongs
+ * now that the wheel has caught up with it.
+ ******************************************************************************/
+static void wheel_cascade(struct Wheel *wheel, unsigned level) {
+	struct Timer **slot;
+	struct Timer *timer;
+
+	slot = &wheel->slots[level][(wheel->now >> (level * WHEEL_BITS)) & WHEEL_MASK];
+	timer = *slot;
+	*slot = NULL;
+	while (timer) {
+		struct Timer *next = timer->next;
+		wheel_link(wheel, timer);
+		timer = next;
+	}
+}
+
+void wheel_advance(struct Wheel *wheel, uint64_t now, void *arg) {
+	while (wheel->now <= now) {
+		struct Timer **slot;
+		struct Timer *work;
+		unsigned level;
+
+		if (wheel->count == 0) {
+			wheel->now = now + 1;
+			break;
+		}
+
+		/* every time a level wraps around, pull down the next slot
+		 * of the level above it */
+		for (level = 1; level < WHEEL_LEVELS; level++) {
+			if ((wheel->now & ((1ULL << (level * WHEEL_BITS)) - 1)) != 0)
+				break;
+			wheel_cascade(wheel, level);
+		}
+
+		/* Take the due timers off the wheel before moving the clock on,
+		 * so that a handler that re-adds its timer for "now" lands in
+		 * the next tick instead of the one we are working on */
+		slot = &wheel->slots[0][wheel->now & WHEEL_MASK];
+		work = *slot;
+		*slot = NULL;
+		if (work)
+			work->pprev = &work;
+		wheel->now++;
+
+		while (work) {
+			struct Timer *timer = work;
+			wheel_unlink(timer);
+			wheel->count--;
+			timer->handler(timer, arg);
+		}
+	}
+}
+
+uint64_t wheel_next(const struct Wheel *wheel) {
+	uint64_t tick;
+
+	if (wheel->count == 0)
+		return UINT64_MAX;
+
+	/* the next occupied slot on the first level, or the next time the
+	 * first level wraps and something has to cascade, whichever is first */
+	for (tick = wheel->now; ; tick++) {
+		if ((tick & WHEEL_MASK) == 0)
+			return tick;
+		if (wheel->slots[0][tick & WHEEL_MASK])
+			return tick;
+	}
+}
@@ -0,0 +1,62 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************************************************************
+ * A hierarchical timer wheel, in the style of the old Linux kernel timers.
+ * Each level has 64 slots; a slot on level N covers 64^N ticks. Timers are
+ * intrusive, so adding and cancelling a timer is O(1) and never allocates.
+ * What a "tick" is in wall-clock terms is up to the caller.
+ ******************************************************************************/
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+struct Timer {
+	struct Timer *next;
+	struct Timer **pprev; /* NULL when not scheduled */
+	uint64_t expires;
+	void (*handler)(struct Timer *timer, void *arg);
+};
+
+struct Wheel {
+	uint64_t now; /* the next tick to be processed */
+	unsigned count;
+	struct Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+/* Get the structure a timer is embedded in */
+#define container_of(ptr, type, member) \
+	((type*)((char*)(ptr) - offsetof(type, member)))
+
+void wheel_init(struct Wheel *wheel, uint64_t now);
+
+/******************************************************************************
+ * Schedule a timer to fire at tick 'expires'. Timers already in the past
+ * fire on the next call to wheel_advance(). If the timer was already
+ * scheduled, it is moved.
+ ******************************************************************************/
+void wheel_add(struct Wheel *wheel, struct Timer *timer, uint64_t expires);
+
+void wheel_cancel(struct Wheel *wheel, struct Timer *timer);
+
+static inline int timer_pending(const struct Timer *timer) {
+	return timer->pprev != NULL;
+}
+
+/******************************************************************************
+ * Fire every timer due up to and including tick 'now', passing 'arg' to
+ * the handlers. Handlers are free to add or cancel timers, themselves
+ * included.
+ ******************************************************************************/
+void wheel_advance(struct Wheel *wheel, uint64_t now, void *arg);
+
+/******************************************************************************
+ * The next tick at which wheel_advance() has work to do, for working out
+ * how long to sleep. UINT64_MAX if no timers are scheduled. This can be
+ * earlier than the earliest timer, when a higher level needs cascading.
+ ******************************************************************************/
+uint64_t wheel_next(const struct Wheel *wheel);
+
+#endif